@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""Benchmark the Occ formats of build_index --occ: the bytes of Occ in the
+array file (with the SA samples for runs, which has no SA), and the search
+time and peak memory of sbwt on the same reads.
+
+usage: bench_occ.py <build_index> <sbwt> <ref.fa> <reads.fa> [period] [size_seed] [build options...]
+"""
+import os
+import struct
+import subprocess
+import sys
+import time
+
+FORMATS = ('full', 'sampled', 'wavelet', 'runs')
+
+
+def run(cmd):
+    proc = subprocess.run(cmd, capture_output=True, text=True)
+    if proc.returncode != 0:
+        sys.exit(f"{' '.join(cmd)} failed:\n{proc.stderr}")
+
+
+def search_ms(err):
+    for line in err.splitlines():
+        if 'Search phase elapsed time' in line:
+            return int(line.split('\t')[-1].split()[0])
+    return -1
+
+
+def occ_bytes(prefix):
+    """Bytes of the array file that are neither the sequence nor SA, packed or not"""
+    with open(prefix + '.meta.sbwt', 'rb') as f:
+        meta = f.read()
+    length, = struct.unpack('<Q', meta[48:56])
+    offset_bytes = struct.unpack('<I', meta[44:48])[0] // 8
+    flags, = struct.unpack('<I', meta[96:100])
+    size_seq = 0 if flags & 1 else 4 * ((length + 3) // 4) + length
+    size_sa = 0 if flags & 8 else length * offset_bytes
+    if flags & 16:
+        bits = (length - 1).bit_length()
+        size_sa = 12 + 8 * ((length * bits + 63) // 64 + 1)
+    return os.path.getsize(prefix + '.array.sbwt') - size_seq - size_sa, length
+
+
+def main():
+    if len(sys.argv) < 5:
+        sys.exit(__doc__)
+    build_index, sbwt, ref_fa, reads_fa = sys.argv[1:5]
+    period = sys.argv[5] if len(sys.argv) > 5 else '3'
+    size_seed = sys.argv[6] if len(sys.argv) > 6 else '50'
+    build_opts = sys.argv[7:]
+    prefix = ref_fa + '.' + period
+
+    print(f"{'occ':8} {'occ bytes':>12} {'bits/char':>9} {'search ms':>10} {'wall s':>7} {'peak MB':>8}")
+    for fmt in FORMATS:
+        run([build_index, ref_fa, period, size_seed, '--occ', fmt, *build_opts])
+        size_occ, length = occ_bytes(prefix)
+        begin = time.time()
+        proc = subprocess.Popen([sbwt, reads_fa, prefix], stdout=subprocess.DEVNULL,
+                                stderr=subprocess.PIPE, text=True)
+        err = proc.stderr.read()
+        _, status, rusage = os.wait4(proc.pid, 0)
+        wall = time.time() - begin
+        if status != 0:
+            sys.exit(f"sbwt failed on --occ {fmt}:\n{err}")
+        print(f"{fmt:8} {size_occ:12} {8.0 * size_occ / length:9.2f} {search_ms(err):10} "
+              f"{wall:7.2f} {rusage.ru_maxrss / 1024:8.1f}")
+
+
+if __name__ == '__main__':
+    main()
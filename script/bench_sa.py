@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Benchmark the forms of SA of build_index: in full, --sa-packed and
+--sa-sample K. For each one, the bytes of SA in the array file (the samples
+and their marks when sampled); for sbwt on the same reads, the search time,
+the SA entries located and their mean LF steps, the cost of a locate over
+SA in full, and the peak memory.
+
+usage: bench_sa.py <build_index> <sbwt> <ref.fa> <reads.fa> [period] [size_seed] [build options...]
+"""
+import os
+import struct
+import subprocess
+import sys
+import time
+
+FORMS = (('full', []), ('packed', ['--sa-packed'])) \
+        + tuple((str(rate), ['--sa-sample', str(rate)]) for rate in (4, 8, 16, 32, 64))
+
+
+def run(cmd):
+    proc = subprocess.run(cmd, capture_output=True, text=True)
+    if proc.returncode != 0:
+        sys.exit(f"{' '.join(cmd)} failed:\n{proc.stderr}")
+
+
+def log_field(err, key):
+    for line in err.splitlines():
+        if key in line:
+            return line.split(key)[-1].strip()
+    return ''
+
+
+def main():
+    if len(sys.argv) < 5:
+        sys.exit(__doc__)
+    build_index, sbwt, ref_fa, reads_fa = sys.argv[1:5]
+    period = sys.argv[5] if len(sys.argv) > 5 else '3'
+    size_seed = sys.argv[6] if len(sys.argv) > 6 else '50'
+    build_opts = sys.argv[7:]
+    prefix = ref_fa + '.' + period
+
+    print(f"{'sa':>6} {'sa bytes':>12} {'bits/char':>9} {'search ms':>10} {'located':>10} "
+          f"{'LF steps':>8} {'ns/locate':>9} {'peak MB':>8}")
+    size_rest = None
+    full_ms = None
+    for form, opts in FORMS:
+        run([build_index, ref_fa, period, size_seed, *opts, *build_opts])
+        with open(prefix + '.meta.sbwt', 'rb') as f:
+            meta = f.read()
+        length, = struct.unpack('<Q', meta[48:56])
+        offset_bytes = struct.unpack('<I', meta[44:48])[0] // 8
+        size_array = os.path.getsize(prefix + '.array.sbwt')
+        if size_rest is None:
+            size_rest = size_array - length * offset_bytes
+        size_sa = size_array - size_rest
+
+        begin = time.time()
+        proc = subprocess.Popen([sbwt, reads_fa, prefix], stdout=subprocess.DEVNULL,
+                                stderr=subprocess.PIPE, text=True)
+        err = proc.stderr.read()
+        _, status, rusage = os.wait4(proc.pid, 0)
+        if status != 0:
+            sys.exit(f"sbwt failed on SA {form}:\n{err}")
+        search_ms = int(log_field(err, 'Search phase elapsed time:').split()[0])
+        located = log_field(err, 'SA located:')
+        num_located = int(located.split()[0]) if located else 0
+        steps = float(located.split('(')[1].split()[0]) if located else 0.0
+        if full_ms is None:
+            full_ms = search_ms
+        ns_locate = 1e6 * (search_ms - full_ms) / num_located if num_located else 0.0
+        print(f"{form:>6} {size_sa:12} {8.0 * size_sa / length:9.2f} {search_ms:10} {num_located:10} "
+              f"{steps:8.2f} {ns_locate:9.0f} {rusage.ru_maxrss / 1024:8.1f}")
+
+
+if __name__ == '__main__':
+    main()
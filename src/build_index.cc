@@ -7,43 +7,122 @@
 #include <vector>
 #include <memory> // for shared_ptr
 #include <fstream> // for ofstream, ifstream
+#include <thread> // for hardware_concurrency
+#include <atomic>
+#include <algorithm>
 
 #include "sbwt.h"
 #include "utility.h"
 #include "io_build_index.h"
+#include "packed_reference.h"
+#include "checkpoint.h"
+#include "build_report.h"
+#include "thread_pool.h"
 #include "log.h"
 
 using std::shared_ptr;
 using std::string;
+using std::vector;
 using namespace utility;
 
-int main(int argc, char **argv)
+/// References up to this many bytes (the FASTA file bounds the sequence)
+/// are indexed with 32-bit offsets, with room for the $s
+static const uint64_t kMaxSize32BitOffset = 0xFFFFFFFFull - 2 * 1024;
+
+static uint64_t SizeFile(const char *file_name)
 {
-        if (argc < 3) {
-                PrintHelp_BuildIndex(argc, argv);
-                return 1;
-        }
+        std::ifstream fin(file_name, std::ios::binary | std::ios::ate);
+        return fin ? (uint64_t)fin.tellg() : 0;
+}
 
-        /* initialize random seed: */
-        //srand (time(NULL));
+/// The options of build_index
+struct BuildOptions {
+        uint32_t size_seed;
+        string builder;
+        string second_layout;           /* sorted or eytzinger */
+        string occ_format;              /* full, sampled, wavelet or runs */
+        uint32_t sa_sample;             /* SA kept at every sa_sample-th position, 1: all */
+        bool is_sa_packed;              /* SA bit-packed in the array file */
+        uint32_t size_min;              /* least size of a segment, 0 to choose it */
+        uint64_t second_max_mem;        /* cap on the segments it is chosen for, 0: the bytes of SA */
+        uint64_t max_mem;               /* 0: build in memory */
+        uint32_t num_threads;
+        bool is_checkpoint;             /* journal the build to resume it */
+        bool is_resume;                 /* go on from the checkpoint, if any */
+        bool is_second_only;            /* the second index of index files built already */
+        sbwt::BuildReport *report;      /* telemetry for --report, or nullptr */
+};
 
-        char *file_name = argv[1];
-        uint32_t period = GetUint(argc, argv[2]);
-        uint32_t size_seed = 0;
-        if (argc >= 4) {
-                size_seed = GetUint(argc, argv[3]);
+/// The second index of the options, for a suffix array of size_sa bytes:
+/// size_min given, or chosen from the groups sharing their seed, their
+/// segments taking at most the bytes of the suffix array by default
+static void InitSecondIndex(sbwt::SecondIndex &second, const BuildOptions &options, uint64_t size_sa)
+{
+        second.layout = options.second_layout == "eytzinger" ? sbwt::SecondIndex::kLayoutEytzinger
+                                                             : sbwt::SecondIndex::kLayoutSorted;
+        if (options.size_min > 0) {
+                second.size_min = options.size_min;
+        } else {
+                second.tune_max_bytes = options.second_max_mem > 0 ? options.second_max_mem : size_sa;
         }
-        uint32_t num_block_sort = 5;
+}
 
-        LOGINFO("Read reference and init index...\n");
-        sbwt::BuildIndexRawData build_index(file_name, period, num_block_sort);
-        LOGINFO("Total length: " << build_index.length_ref << "\n");
+/// Sort, then write the index files of one period; max_mem is its share of
+/// --max-mem
+template <typename TOffset>
+static int BuildAndWriteIndex(sbwt::BasicIndexRawData<TOffset> &build_index, const string &prefix_filename,
+                              const BuildOptions &options, uint64_t max_mem)
+{
+        /// Both builders produce the same suffix array
+        void (*BuildIndexSorted)(sbwt::BasicIndexRawData<TOffset>&) =
+                options.builder == "sais" ? sbwt::BuildIndexSais<TOffset> : sbwt::BuildIndexBlockwise<TOffset>;
+        const uint32_t size_seed = options.size_seed;
+        const uint32_t period = build_index.period;
+        build_index.report = options.report;
+        build_index.occ_format = options.occ_format == "sampled" ? sbwt::kOccSampled
+                               : options.occ_format == "wavelet" ? sbwt::kOccWavelet
+                               : options.occ_format == "runs" ? sbwt::kOccRunLength : sbwt::kOccFull;
+        build_index.sa_sample_rate = options.sa_sample;
+        build_index.is_sa_packed = options.is_sa_packed;
 
-        if (size_seed > 0) {
+        /// The options that change what is built; the external build cuts
+        /// its chunks from the budget and the number of threads
+        std::unique_ptr<sbwt::BuildCheckpoint<TOffset> > checkpoint;
+        if (options.is_checkpoint) {
+                string setting = "builder=" + options.builder + " seed=" + std::to_string(size_seed)
+                                 + " layout=" + options.second_layout
+                                 + " occ=" + options.occ_format
+                                 + " sa_sample=" + std::to_string(options.sa_sample)
+                                 + " sa_packed=" + std::to_string(options.is_sa_packed)
+                                 + " size_min=" + std::to_string(options.size_min)
+                                 + " second_max_mem=" + std::to_string(options.second_max_mem);
+                if (max_mem > 0) {
+                        setting += " max_mem=" + std::to_string(max_mem)
+                                   + " threads=" + std::to_string(build_index.num_threads);
+                }
+                try {
+                        checkpoint.reset(new sbwt::BuildCheckpoint<TOffset>(build_index, prefix_filename,
+                                                                            setting, options.is_resume));
+                } catch (...) {
+                        return 1;
+                }
+                build_index.checkpoint = checkpoint.get();
+        }
+
+        if (max_mem > 0) {
+                LOGINFO("Building index out of core...\n");
+                try {
+                        sbwt::BuildIndexExternal(build_index, prefix_filename, max_mem);
+                } catch (...) {
+                        return 1;
+                }
+                LOGINFO("Build index done\n");
+        }
+        else if (size_seed > 0) {
                 LOGINFO("Building index...\n");
 
                 /// Build SA, Occ, B, and C
-                sbwt::BuildIndexBlockwise(build_index);
+                BuildIndexSorted(build_index);
 
 #if DEBUG_SECONDINDEX
                 //sbwt::PrintFullSearchMatrix(build_index);
@@ -51,19 +130,35 @@ int main(int argc, char **argv)
 
                 LOGINFO("Build second index...\n");
                 sbwt::SecondIndex secondIndex;
-                /// Init SecondIndex
-                secondIndex.RebuildIndexInit(build_index, size_seed);
-                /// Sorting
-                /// Change the first index in SA
-                secondIndex.RebuildIndex(build_index);
-                LOGINFO("Size of second index: " << secondIndex.size << "\n");
-
-                /// write SA(changed), Occ, B and C into disk
-                LOGINFO("Write into disk...\n");
-                sbwt::WriteIntoDiskBuildIndex(build_index, string(file_name));
+                InitSecondIndex(secondIndex, options, (uint64_t)build_index.length_ref * sizeof(TOffset));
+                if (build_index.occ_format == sbwt::kOccRunLength) {
+                        /// Its entries are searched through SA, which the
+                        /// run-length index does not keep: the seed only
+                        secondIndex.size_seed = size_seed;
+                } else {
+                        /// Init SecondIndex
+                        secondIndex.RebuildIndexInit(build_index, size_seed);
+                        /// Sorting
+                        secondIndex.RebuildIndex(build_index);
+                }
+                LOGINFO("Size of second index: " << secondIndex.size << " + " << secondIndex.size_wide
+                        << " wide entries in " << secondIndex.segments.size() << " segments\n");
 
-
-                sbwt::WriteIntoDiskBuildSecondIndex(build_index, string(file_name), secondIndex);
+                /// write SA, Occ, B and C into disk
+                LOGINFO("Write into disk...\n");
+                try {
+                        if (!checkpoint || !checkpoint->IsDone("array-file")) {
+                                sbwt::ReportPhase phase(options.report, "write-array", period);
+                                sbwt::WriteIntoDiskBuildIndex(build_index, prefix_filename);
+                                if (checkpoint) {
+                                        checkpoint->Done("array-file");
+                                }
+                        }
+                        sbwt::ReportPhase phase(options.report, "write-second-index", period);
+                        sbwt::WriteIntoDiskBuildSecondIndex(build_index, prefix_filename, secondIndex);
+                } catch (...) {
+                        return 1;
+                }
                 LOGINFO("Done\n");
 
                 LOGINFO("Build index done\n");
@@ -72,16 +167,382 @@ int main(int argc, char **argv)
         }
         else {
                 LOGINFO("Building index...\n");
-                sbwt::BuildIndexBlockwise(build_index);
+                BuildIndexSorted(build_index);
 
                 //sbwt::PrintFullSearchMatrix(build_index);
 
                 /// write into disk
                 LOGINFO("Write into disk...\n");
-                sbwt::WriteIntoDiskBuildIndex(build_index, string(file_name));
+                try {
+                        sbwt::ReportPhase phase(options.report, "write-array", period);
+                        sbwt::WriteIntoDiskBuildIndex(build_index, prefix_filename);
+                } catch (...) {
+                        return 1;
+                }
                 LOGINFO("Build index done\n");
 
         }
 
+        /// The index files are complete
+        if (checkpoint) {
+                build_index.checkpoint = nullptr;
+                checkpoint->Remove();
+        }
         return 0;
 }
+
+template <typename TOffset>
+static int BuildIndexWithOffset(char *file_name, uint32_t period, const BuildOptions &options)
+{
+        uint32_t num_block_sort = 0;   /* length of the radix pass, 0 to choose it from the reference */
+
+        LOGINFO("Read reference and init index...\n");
+        std::unique_ptr<sbwt::BasicIndexRawData<TOffset> > build_index_ptr;
+        sbwt::ReportPhase phase(options.report, "read-reference", period);
+        try {
+                build_index_ptr.reset(new sbwt::BasicIndexRawData<TOffset>(file_name, period, num_block_sort));
+        } catch (...) {
+                return 1;
+        }
+        phase.End();
+        sbwt::BasicIndexRawData<TOffset> &build_index = *build_index_ptr;
+        if (options.report) {
+                options.report->AddBytes("reference", period, build_index.length_ref);
+        }
+        LOGINFO("Total length: " << build_index.length_ref
+                << " (" << sizeof(TOffset) * 8 << "-bit offsets)\n");
+        build_index.num_threads = options.num_threads;
+        return BuildAndWriteIndex(build_index, string(file_name), options, options.max_mem);
+}
+
+/// Several periods of one reference: it is read once and stored once, in
+/// "fa.ref.sbwt", and up to num_threads periods are built at a time, sharing
+/// the threads and --max-mem.
+template <typename TOffset>
+static int BuildIndexPeriods(char *file_name, const vector<uint32_t> &periods, const BuildOptions &options)
+{
+        LOGINFO("Read reference...\n");
+        sbwt::PackedReference ref;
+        sbwt::ReportPhase phase_read(options.report, "read-reference", 0);
+        if (!sbwt::ReadFastaPacked(file_name, ref)) {
+                LOGERROR("Cannot read " << file_name);
+                return 1;
+        }
+        phase_read.End();
+        if (options.report) {
+                options.report->AddBytes("packed-reference", 0, (ref.Length() + 31) / 32 * sizeof(uint64_t));
+        }
+        sbwt::ReportPhase phase_write(options.report, "write-reference", 0);
+        if (!sbwt::WriteIntoDiskReference(ref, string(file_name))) {
+                return 1;
+        }
+        phase_write.End();
+
+        const uint32_t num_threads = options.num_threads;
+        const uint32_t num_concurrent = std::min<uint32_t>(periods.size(), num_threads);
+        LOGINFO("Build " << periods.size() << " periods, " << num_concurrent << " at a time ("
+                << sizeof(TOffset) * 8 << "-bit offsets)\n");
+        std::atomic<int> ret(0);
+        sbwt::ThreadPool pool(num_concurrent);
+        for (auto period : periods) {
+                pool.Submit([&, period]() {
+                        try {
+                                sbwt::ReportPhase phase(options.report, "unpack-reference", period);
+                                sbwt::BasicIndexRawData<TOffset> build_index(ref, period, 0);
+                                phase.End();
+                                if (options.report) {
+                                        options.report->AddBytes("reference", period, build_index.length_ref);
+                                }
+                                build_index.num_threads = std::max<uint32_t>(1, num_threads / num_concurrent);
+                                build_index.is_ref_shared = true;
+                                if (BuildAndWriteIndex(build_index, string(file_name), options,
+                                                       options.max_mem / num_concurrent) != 0) {
+                                        ret = 1;
+                                }
+                        } catch (...) {
+                                LOGERROR("Period " << period);
+                                ret = 1;
+                        }
+                });
+        }
+        pool.Wait();
+        return ret;
+}
+
+/// The second index of the index files "fa.period" built already, with
+/// or without one: their reference is read and their SA streamed, the
+/// other index files are left as they are
+template <typename TOffset>
+static int RebuildSecondIndex(const string &prefix_filename, uint32_t period, const BuildOptions &options)
+{
+        string prefix_period = prefix_filename + "." + std::to_string(period);
+        LOGINFO("Read reference of " << prefix_period << "...\n");
+        sbwt::ReportPhase phase(options.report, "read-reference", period);
+        sbwt::BasicIndexRawData<TOffset> build_index(prefix_period, false);
+        phase.End();
+        if (build_index.length_ref == 0 || build_index.period != period) {
+                LOGERROR("Cannot read the index files " << prefix_period);
+                return 1;
+        }
+        if (build_index.occ_format == sbwt::kOccRunLength) {
+                LOGERROR("The index files " << prefix_period << " keep SA sampled at the runs of the BWT"
+                         << " (--occ runs), which the second index cannot be built from");
+                return 1;
+        }
+        if (build_index.sa_sample_rate > 1) {
+                LOGERROR("The index files " << prefix_period << " keep SA sampled every "
+                         << build_index.sa_sample_rate << " positions (--sa-sample),"
+                         << " which the second index cannot be built from");
+                return 1;
+        }
+        build_index.num_threads = options.num_threads;
+        build_index.report = options.report;
+
+        LOGINFO("Build second index...\n");
+        sbwt::SecondIndex secondIndex;
+        InitSecondIndex(secondIndex, options, (uint64_t)build_index.length_ref * sizeof(TOffset));
+        try {
+                secondIndex.RebuildIndexFromFiles(build_index, prefix_filename, options.size_seed);
+                LOGINFO("Size of second index: " << secondIndex.size << " + " << secondIndex.size_wide
+                        << " wide entries in " << secondIndex.segments.size() << " segments\n");
+                sbwt::ReportPhase phase(options.report, "write-second-index", period);
+                sbwt::WriteIntoDiskBuildSecondIndex(build_index, prefix_filename, secondIndex);
+        } catch (...) {
+                return 1;
+        }
+        LOGINFO("Done\n");
+        return 0;
+}
+
+/// "3" or "3,4,5"; sorted, without duplicates
+static vector<uint32_t> ParsePeriods(int argc, const string &arg)
+{
+        vector<uint32_t> periods;
+        size_t beg = 0;
+        for (;;) {
+                size_t end = arg.find(',', beg);
+                string period = arg.substr(beg, end == string::npos ? string::npos : end - beg);
+                periods.push_back(GetUint(argc, &period[0]));
+                if (end == string::npos) {
+                        break;
+                }
+                beg = end + 1;
+        }
+        std::sort(periods.begin(), periods.end());
+        periods.erase(std::unique(periods.begin(), periods.end()), periods.end());
+        return periods;
+}
+
+int main(int argc, char **argv)
+{
+        /// Split options from positional arguments
+        vector<char*> args;
+        BuildOptions options;
+        options.size_seed = 0;
+        options.builder = "blockwise";
+        options.second_layout = "sorted";
+        options.occ_format = "full";
+        options.sa_sample = 1;
+        options.is_sa_packed = false;
+        options.size_min = 0;
+        options.second_max_mem = 0;
+        options.max_mem = 0;
+        options.num_threads = 1;
+        options.is_checkpoint = false;
+        options.is_resume = false;
+        options.is_second_only = false;
+        options.report = nullptr;
+        string report_filename;         /* --report */
+        uint32_t offset_bits = 0;       /* 0: choose from the size of the reference */
+        for (int i = 1; i < argc; ++i) {
+                string opt(argv[i]);
+                if (opt == "--threads" || opt == "-t") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.num_threads = GetUint(argc, argv[++i]);
+                        if (options.num_threads == 0) {
+                                options.num_threads = std::thread::hardware_concurrency();
+                        }
+                        if (options.num_threads == 0) {
+                                options.num_threads = 1;
+                        }
+                } else if (opt == "--builder") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.builder = argv[++i];
+                        if (options.builder != "blockwise" && options.builder != "sais") {
+                                LOGERROR("Unknown builder: " << options.builder);
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                } else if (opt == "--second-layout") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.second_layout = argv[++i];
+                        if (options.second_layout != "sorted" && options.second_layout != "eytzinger") {
+                                LOGERROR("Unknown second index layout: " << options.second_layout);
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                } else if (opt == "--occ") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.occ_format = argv[++i];
+                        if (options.occ_format != "full" && options.occ_format != "sampled"
+                            && options.occ_format != "wavelet" && options.occ_format != "runs") {
+                                LOGERROR("Unknown Occ format: " << options.occ_format);
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                } else if (opt == "--sa-sample") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.sa_sample = GetUint(argc, argv[++i]);
+                        if (options.sa_sample == 0) {
+                                LOGERROR("--sa-sample must be 1 at least");
+                                return 1;
+                        }
+                } else if (opt == "--sa-packed") {
+                        options.is_sa_packed = true;
+                } else if (opt == "--size-min") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.size_min = GetUint(argc, argv[++i]);
+                        if (options.size_min < 2) {
+                                LOGERROR("--size-min must be 2 at least");
+                                return 1;
+                        }
+                } else if (opt == "--second-max-mem") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.second_max_mem = GetSize(argv[++i]);
+                } else if (opt == "--second-only") {
+                        options.is_second_only = true;
+                } else if (opt == "--max-mem") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        options.max_mem = GetSize(argv[++i]);
+                } else if (opt == "--offset") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        offset_bits = GetUint(argc, argv[++i]);
+                        if (offset_bits != 32 && offset_bits != 64) {
+                                LOGERROR("--offset must be 32 or 64");
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                } else if (opt == "--report") {
+                        if (i + 1 >= argc) {
+                                PrintHelp_BuildIndex(argc, argv);
+                                return 1;
+                        }
+                        report_filename = argv[++i];
+                } else if (opt == "--checkpoint") {
+                        options.is_checkpoint = true;
+                } else if (opt == "--resume") {
+                        options.is_checkpoint = true;
+                        options.is_resume = true;
+                } else {
+                        args.push_back(argv[i]);
+                }
+        }
+
+        if (args.size() < 2) {
+                PrintHelp_BuildIndex(argc, argv);
+                return 1;
+        }
+
+        char *file_name = args[0];
+        vector<uint32_t> periods = ParsePeriods(argc, string(args[1]));
+        if (args.size() >= 3) {
+                options.size_seed = GetUint(argc, args[2]);
+        }
+        if (options.is_second_only
+            && (options.size_seed == 0 || options.max_mem > 0 || options.is_checkpoint)) {
+                LOGERROR("--second-only needs <size_seed>, and neither --max-mem nor --checkpoint");
+                return 1;
+        }
+        if (options.sa_sample > 1 && options.occ_format == "runs") {
+                LOGERROR("--occ runs samples SA at the runs of the BWT, not with --sa-sample");
+                return 1;
+        }
+        if (options.is_sa_packed && (options.sa_sample > 1 || options.occ_format == "runs")) {
+                LOGERROR("--sa-packed packs SA in full, neither with --sa-sample nor --occ runs");
+                return 1;
+        }
+        if (options.max_mem > 0 && (options.size_seed > 0 || options.builder == "sais")) {
+                LOGERROR("--max-mem builds blockwise and without the second index");
+                return 1;
+        }
+        if (options.is_second_only) {
+                /// The width of the offsets is the one of the index files
+                offset_bits = sbwt::ReadIndexOffsetBits(string(file_name) + "." + std::to_string(periods[0]));
+        } else if (offset_bits == 0) {
+                offset_bits = SizeFile(file_name) > kMaxSize32BitOffset ? 64 : 32;
+        }
+
+        std::unique_ptr<sbwt::BuildReport> report;
+        if (!report_filename.empty()) {
+                report.reset(new sbwt::BuildReport());
+                report->Set("reference", string(file_name));
+                report->Set("periods", string(args[1]));
+                report->Set("size_seed", options.size_seed);
+                report->Set("size_min", options.size_min);
+                report->Set("second_max_mem", options.second_max_mem);
+                report->Set("builder", options.builder);
+                report->Set("second_layout", options.second_layout);
+                report->Set("occ", options.occ_format);
+                report->Set("sa_sample", options.sa_sample);
+                report->Set("sa_packed", options.is_sa_packed);
+                report->Set("max_mem", options.max_mem);
+                report->Set("threads", options.num_threads);
+                report->Set("offset_bits", offset_bits);
+                options.report = report.get();
+        }
+
+        int ret = 0;
+        if (options.is_second_only) {
+                /// One period after the other, each on all the threads
+                for (size_t k = 0; k < periods.size() && ret == 0; ++k) {
+                        string prefix_period = string(file_name) + "." + std::to_string(periods[k]);
+                        if (sbwt::ReadIndexOffsetBits(prefix_period) == 64) {
+                                ret = RebuildSecondIndex<uint64_t>(string(file_name), periods[k], options);
+                        } else {
+                                ret = RebuildSecondIndex<uint32_t>(string(file_name), periods[k], options);
+                        }
+                }
+        } else if (periods.size() > 1) {
+                if (offset_bits == 64) {
+                        ret = BuildIndexPeriods<uint64_t>(file_name, periods, options);
+                } else {
+                        ret = BuildIndexPeriods<uint32_t>(file_name, periods, options);
+                }
+        } else if (offset_bits == 64) {
+                ret = BuildIndexWithOffset<uint64_t>(file_name, periods[0], options);
+        } else {
+                ret = BuildIndexWithOffset<uint32_t>(file_name, periods[0], options);
+        }
+
+        if (report && !report->Write(report_filename, ret) && ret == 0) {
+                ret = 1;
+        }
+        return ret;
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "build_report.h"
+#include "log.h"
+
+namespace sbwt {
+
+/// s as a JSON string
+static string JsonString(const string &s)
+{
+        string out("\"");
+        for (char c : s) {
+                if (c == '"' || c == '\\') {
+                        out += '\\';
+                        out += c;
+                } else if ((unsigned char)c < 0x20) {
+                        char buf[8];
+                        snprintf(buf, sizeof(buf), "\\u%04x", c);
+                        out += buf;
+                } else {
+                        out += c;
+                }
+        }
+        return out + "\"";
+}
+
+BuildReport::BuildReport():
+        start(std::chrono::steady_clock::now()),
+        cpu_start(CpuSeconds())
+{
+}
+
+double BuildReport::CpuSeconds()
+{
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) {
+                return 0;
+        }
+        return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6
+               + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+uint64_t BuildReport::RssBytes()
+{
+        /// resident pages, the second field of /proc/self/statm (Linux)
+        std::ifstream fin("/proc/self/statm");
+        uint64_t size = 0, resident = 0;
+        if (!(fin >> size >> resident)) {
+                return 0;
+        }
+        return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+uint64_t BuildReport::PeakRssBytes()
+{
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) {
+                return 0;
+        }
+#if defined(__APPLE__)
+        return usage.ru_maxrss;         /* bytes */
+#else
+        return (uint64_t)usage.ru_maxrss * 1024;        /* KiB */
+#endif
+}
+
+void BuildReport::AddPhase(const string &name, uint32_t period, double wall_seconds, double cpu_seconds)
+{
+        Phase phase = {name, period, wall_seconds, cpu_seconds, RssBytes(), PeakRssBytes()};
+        std::lock_guard<std::mutex> lock(mutex);
+        phases.push_back(phase);
+}
+
+void BuildReport::AddBytes(const string &structure, uint32_t period, uint64_t bytes)
+{
+        Structure s = {structure, period, bytes};
+        std::lock_guard<std::mutex> lock(mutex);
+        structures.push_back(s);
+}
+
+void BuildReport::AddHistogram(const string &name, uint32_t period, const SizeHistogram &sizes)
+{
+        Histogram h = {name, period, sizes};
+        std::lock_guard<std::mutex> lock(mutex);
+        histograms.push_back(h);
+}
+
+void BuildReport::Set(const string &key, const string &value)
+{
+        std::lock_guard<std::mutex> lock(mutex);
+        settings.push_back(std::make_pair(key, JsonString(value)));
+}
+
+void BuildReport::Set(const string &key, uint64_t value)
+{
+        std::lock_guard<std::mutex> lock(mutex);
+        settings.push_back(std::make_pair(key, std::to_string(value)));
+}
+
+bool BuildReport::Write(const string &file_name, int status) const
+{
+        std::lock_guard<std::mutex> lock(mutex);
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(6);
+        out << "{\n  \"status\": " << status << ",\n";
+        for (auto &kv : settings) {
+                out << "  " << JsonString(kv.first) << ": " << kv.second << ",\n";
+        }
+        out << "  \"wall_seconds\": " << wall << ",\n"
+            << "  \"cpu_seconds\": " << CpuSeconds() - cpu_start << ",\n"
+            << "  \"peak_rss_bytes\": " << PeakRssBytes() << ",\n";
+
+        out << "  \"phases\": [";
+        for (size_t i = 0; i < phases.size(); ++i) {
+                const Phase &p = phases[i];
+                out << (i ? ",\n" : "\n")
+                    << "    {\"name\": " << JsonString(p.name) << ", \"period\": " << p.period
+                    << ", \"wall_seconds\": " << p.wall_seconds << ", \"cpu_seconds\": " << p.cpu_seconds
+                    << ", \"rss_bytes\": " << p.rss_bytes << ", \"peak_rss_bytes\": " << p.peak_rss_bytes << "}";
+        }
+        out << "\n  ],\n";
+
+        out << "  \"structures\": [";
+        for (size_t i = 0; i < structures.size(); ++i) {
+                const Structure &s = structures[i];
+                out << (i ? ",\n" : "\n")
+                    << "    {\"name\": " << JsonString(s.name) << ", \"period\": " << s.period
+                    << ", \"bytes\": " << s.bytes << "}";
+        }
+        out << "\n  ],\n";
+
+        out << "  \"histograms\": [";
+        for (size_t i = 0; i < histograms.size(); ++i) {
+                const Histogram &h = histograms[i];
+                out << (i ? ",\n" : "\n")
+                    << "    {\"name\": " << JsonString(h.name) << ", \"period\": " << h.period << ", \"bins\": [";
+                bool is_first = true;
+                for (size_t b = 0; b < h.sizes.count.size(); ++b) {
+                        if (h.sizes.count[b] == 0) {
+                                continue;
+                        }
+                        out << (is_first ? "" : ", ")
+                            << "{\"min\": " << (1ull << b) << ", \"max\": " << ((1ull << b) * 2 - 1)
+                            << ", \"count\": " << h.sizes.count[b] << ", \"total\": " << h.sizes.total[b] << "}";
+                        is_first = false;
+                }
+                out << "]}";
+        }
+        out << "\n  ]\n}\n";
+
+        std::ofstream fout(file_name.c_str());
+        fout << out.str();
+        fout.close();
+        if (!fout) {
+                LOGERROR("Cannot write " << file_name);
+                return false;
+        }
+        return true;
+}
+
+ReportPhase::ReportPhase(BuildReport *report, const string &name, uint32_t period):
+        report(report),
+        name(name),
+        period(period)
+{
+        if (report) {
+                start = std::chrono::steady_clock::now();
+                cpu_start = BuildReport::CpuSeconds();
+        }
+}
+
+void ReportPhase::End()
+{
+        if (!report) {
+                return;
+        }
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        report->AddPhase(name, period, wall, BuildReport::CpuSeconds() - cpu_start);
+        report = nullptr;
+}
+
+} /* namespace sbwt */
@@ -0,0 +1,110 @@
+#ifndef SBWT_BUILD_REPORT_H
+#define SBWT_BUILD_REPORT_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sbwt {
+
+using std::string;
+using std::vector;
+
+/// Counts and suffixes of sizes in power-of-two bins: bin b holds the sizes
+/// in [2^b, 2^(b+1))
+struct SizeHistogram {
+        void Add(uint64_t size)
+        {
+                uint32_t b = size ? 63 - __builtin_clzll(size) : 0;
+                if (b >= count.size()) {
+                        count.resize(b + 1, 0);
+                        total.resize(b + 1, 0);
+                }
+                ++count[b];
+                total[b] += size;
+        }
+        vector<uint64_t> count;
+        vector<uint64_t> total;
+};
+
+/**
+ * Telemetry of an index build, written as JSON by build_index --report:
+ *
+ *      phases          wall and CPU seconds of every phase, with the
+ *                      resident memory and its high-water mark at its end
+ *      structures      bytes allocated per structure
+ *      histograms      size distributions, e.g. of the sorted blocks
+ *
+ * Every record carries the period it belongs to, 0 for the ones shared by
+ * the periods. CPU time and memory are the process's, so they add up the
+ * periods built at the same time. Safe to call from every thread.
+ */
+class BuildReport {
+public:
+        BuildReport();
+
+        void AddPhase(const string &name, uint32_t period, double wall_seconds, double cpu_seconds);
+        void AddBytes(const string &structure, uint32_t period, uint64_t bytes);
+        void AddHistogram(const string &name, uint32_t period, const SizeHistogram&);
+        void Set(const string &key, const string &value);
+        void Set(const string &key, uint64_t value);
+
+        /// Write the report into file_name; false on failure
+        bool Write(const string &file_name, int status) const;
+
+        /// User plus system CPU seconds of the process
+        static double CpuSeconds();
+        /// Resident memory of the process, and its high-water mark
+        static uint64_t RssBytes();
+        static uint64_t PeakRssBytes();
+
+private:
+        struct Phase {
+                string name;
+                uint32_t period;
+                double wall_seconds;
+                double cpu_seconds;
+                uint64_t rss_bytes;
+                uint64_t peak_rss_bytes;
+        };
+        struct Structure {
+                string name;
+                uint32_t period;
+                uint64_t bytes;
+        };
+        struct Histogram {
+                string name;
+                uint32_t period;
+                SizeHistogram sizes;
+        };
+
+        mutable std::mutex mutex;
+        std::chrono::steady_clock::time_point start;
+        double cpu_start;
+        vector<std::pair<string, string> > settings;    /* key, JSON value */
+        vector<Phase> phases;
+        vector<Structure> structures;
+        vector<Histogram> histograms;
+};
+
+/// A phase of the build, from construction to End() or destruction; does
+/// nothing without a report.
+class ReportPhase {
+public:
+        ReportPhase(BuildReport *report, const string &name, uint32_t period);
+        ~ReportPhase() { End(); }
+        void End();
+
+private:
+        BuildReport *report;
+        string name;
+        uint32_t period;
+        std::chrono::steady_clock::time_point start;
+        double cpu_start;
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_BUILD_REPORT_H */
@@ -0,0 +1,298 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "io_build_index.h"
+#include "log.h"
+
+namespace sbwt {
+
+static const char *kCheckpointMagic = "sbwt-checkpoint 2";
+
+/// FNV-1a of the reference, to tell a checkpoint of another one
+static uint64_t HashSequence(const char *seq, uint64_t n)
+{
+        uint64_t h = 0xCBF29CE484222325ull;
+        for (uint64_t i = 0; i < n; ++i) {
+                h = (h ^ (uint8_t)seq[i]) * 0x100000001B3ull;
+        }
+        return h;
+}
+
+/// Open file_name for writing at any offset, creating it if need be
+static bool OpenForUpdate(const string &file_name, std::fstream &fs)
+{
+        fs.open(file_name.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        if (!fs.is_open()) {
+                std::ofstream(file_name.c_str(), std::ios::binary);
+                fs.open(file_name.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        }
+        return fs.is_open();
+}
+
+template <typename T>
+static bool WriteAt(const string &file_name, uint64_t pos, const T *beg, uint64_t size)
+{
+        std::fstream fs;
+        if (!OpenForUpdate(file_name, fs)) {
+                return false;
+        }
+        fs.seekp(pos * sizeof(T));
+        fs.write((const char*)beg, size * sizeof(T));
+        fs.flush();
+        return (bool)fs;
+}
+
+template <typename T>
+static bool ReadAt(const string &file_name, uint64_t pos, T *beg, uint64_t size)
+{
+        std::ifstream fin(file_name.c_str(), std::ios::binary);
+        fin.seekg(pos * sizeof(T));
+        fin.read((char*)beg, size * sizeof(T));
+        return (bool)fin;
+}
+
+template <typename TOffset>
+BuildCheckpoint<TOffset>::BuildCheckpoint(const BasicIndexRawData<TOffset> &build_index,
+                                          const string &prefix_filename,
+                                          const string &setting, bool is_resume):
+        length_ref(build_index.length_ref),
+        size_second_saved(0),
+        size_wide_saved(0),
+        num_segment_saved(0)
+{
+        file_journal = IndexFilename(build_index, prefix_filename, ".ckpt");
+        file_sa = file_journal + ".sa";
+        file_second = file_journal + ".second";
+        file_second_wide = file_journal + ".wide";
+        file_segments = file_journal + ".segments";
+
+        std::ostringstream first_line;
+        first_line << kCheckpointMagic
+               << " N=" << build_index.length_ref
+               << " period=" << build_index.period
+               << " bits=" << sizeof(TOffset) * 8
+               << " shared=" << build_index.is_ref_shared
+               << " hash=" << std::hex << HashSequence(build_index.seq_raw, build_index.length_ref) << std::dec
+               << " " << setting;
+        header = first_line.str();
+
+        if (is_resume) {
+                std::ifstream fin(file_journal.c_str(), std::ios::binary);
+                std::stringstream content;
+                content << fin.rdbuf();
+                vector<string> lines;
+                string text = content.str(), line;
+                size_t beg = 0, end = 0;
+                /// complete lines only
+                while ((end = text.find('\n', beg)) != string::npos) {
+                        lines.push_back(text.substr(beg, end - beg));
+                        beg = end + 1;
+                }
+                if (lines.empty()) {
+                        LOGINFO("No checkpoint in " << file_journal << ", starting from scratch\n");
+                } else if (lines[0] != header) {
+                        LOGINFO("Checkpoint " << file_journal << " is of another build, starting over\n");
+                } else {
+                        records.assign(lines.begin() + 1, lines.end());
+                        LOGINFO("Resume from " << file_journal << " (" << records.size() << " records)\n");
+                }
+        }
+
+        WriteJournal();
+
+        vector<string> fields;
+        if (LastRecord("second", fields) && fields.size() == 5) {
+                size_second_saved = std::stoull(fields[2]);
+                size_wide_saved = std::stoull(fields[3]);
+                num_segment_saved = std::stoull(fields[4]);
+        }
+}
+
+/// Rewrite the journal with the valid records only
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::WriteJournal()
+{
+        if (journal.is_open()) {
+                journal.close();
+        }
+        journal.open(file_journal.c_str(), std::ios::binary | std::ios::trunc);
+        journal << header << '\n';
+        for (auto &r : records) {
+                journal << r << '\n';
+        }
+        journal.flush();
+        if (!journal) {
+                LOGERROR("Cannot write " << file_journal);
+                throw std::runtime_error("BuildCheckpoint");
+        }
+}
+
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::Restart()
+{
+        records.clear();
+        size_second_saved = 0;
+        size_wide_saved = 0;
+        num_segment_saved = 0;
+        WriteJournal();
+}
+
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::Append(const string &line)
+{
+        journal << line << '\n';
+        journal.flush();
+        if (!journal) {
+                LOGERROR("Cannot write " << file_journal);
+                throw std::runtime_error("BuildCheckpoint");
+        }
+        records.push_back(line);
+}
+
+template <typename TOffset>
+bool BuildCheckpoint<TOffset>::LastRecord(const string &tag, vector<string> &fields) const
+{
+        for (auto it = records.rbegin(); it != records.rend(); ++it) {
+                if (it->compare(0, tag.size() + 1, tag + " ") == 0) {
+                        std::istringstream in(*it);
+                        string field;
+                        fields.clear();
+                        while (in >> field) {
+                                fields.push_back(field);
+                        }
+                        return true;
+                }
+        }
+        return false;
+}
+
+template <typename TOffset>
+bool BuildCheckpoint<TOffset>::IsDone(const string &phase) const
+{
+        return std::find(records.begin(), records.end(), phase) != records.end();
+}
+
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::Done(const string &phase)
+{
+        Append(phase);
+}
+
+template <typename TOffset>
+bool BuildCheckpoint<TOffset>::IsSorted(TOffset beg, TOffset end) const
+{
+        string record = "sorted " + std::to_string(beg) + " " + std::to_string(end);
+        return std::find(records.begin(), records.end(), record) != records.end();
+}
+
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::SaveSorted(const TOffset *sorted, TOffset beg, TOffset end)
+{
+        if (!WriteAt(file_sa, beg, sorted, end - beg)) {
+                LOGERROR("Cannot write " << file_sa);
+                throw std::runtime_error("BuildCheckpoint");
+        }
+        Append("sorted " + std::to_string(beg) + " " + std::to_string(end));
+}
+
+template <typename TOffset>
+bool BuildCheckpoint<TOffset>::LoadSorted(TOffset *sorted, TOffset beg, TOffset end)
+{
+        if (!ReadAt(file_sa, beg, sorted, end - beg)) {
+                return false;
+        }
+        for (TOffset i = 0; i < end - beg; ++i) {
+                if (sorted[i] >= length_ref) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::SaveSecond(const uint16_t *array, uint64_t size,
+                                          const uint32_t *array_wide, uint64_t size_wide,
+                                          const vector<TOffset> &seg_begin, TOffset i)
+{
+        if (!WriteAt(file_second, size_second_saved, array + size_second_saved, size - size_second_saved)
+            || !WriteAt(file_second_wide, size_wide_saved, array_wide + size_wide_saved,
+                        size_wide - size_wide_saved)
+            || !WriteAt(file_segments, num_segment_saved, seg_begin.data() + num_segment_saved,
+                        seg_begin.size() - num_segment_saved)) {
+                LOGERROR("Cannot write " << file_second);
+                throw std::runtime_error("BuildCheckpoint");
+        }
+        size_second_saved = size;
+        size_wide_saved = size_wide;
+        num_segment_saved = seg_begin.size();
+        Append("second " + std::to_string(i) + " " + std::to_string(size) + " " + std::to_string(size_wide)
+               + " " + std::to_string(seg_begin.size()));
+}
+
+template <typename TOffset>
+bool BuildCheckpoint<TOffset>::LoadSecond(uint16_t *array, uint64_t capacity, uint64_t &size,
+                                          uint32_t *array_wide, uint64_t capacity_wide, uint64_t &size_wide,
+                                          vector<TOffset> &seg_begin, TOffset &i)
+{
+        vector<string> fields;
+        if (!LastRecord("second", fields) || fields.size() != 5) {
+                return false;
+        }
+        i = std::stoull(fields[1]);
+        size = std::stoull(fields[2]);
+        size_wide = std::stoull(fields[3]);
+        seg_begin.resize(std::stoull(fields[4]));
+        if (size > capacity || size_wide > capacity_wide || i > length_ref) {
+                return false;
+        }
+        return ReadAt(file_second, 0, array, size) && ReadAt(file_second_wide, 0, array_wide, size_wide)
+               && ReadAt(file_segments, 0, seg_begin.data(), seg_begin.size());
+}
+
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::SaveChunk(uint32_t num_chunk, TOffset pos_sa, const TOffset *occ)
+{
+        std::ostringstream record;
+        record << "chunk " << num_chunk << " " << pos_sa;
+        for (int b = 0; b < 4; ++b) {
+                record << " " << occ[b];
+        }
+        Append(record.str());
+}
+
+template <typename TOffset>
+uint32_t BuildCheckpoint<TOffset>::LoadChunk(TOffset &pos_sa, TOffset *occ) const
+{
+        vector<string> fields;
+        if (!LastRecord("chunk", fields) || fields.size() != 7) {
+                return 0;
+        }
+        pos_sa = std::stoull(fields[2]);
+        for (int b = 0; b < 4; ++b) {
+                occ[b] = std::stoull(fields[3 + b]);
+        }
+        return std::stoul(fields[1]);
+}
+
+template <typename TOffset>
+void BuildCheckpoint<TOffset>::Remove()
+{
+        journal.close();
+        std::remove(file_journal.c_str());
+        std::remove(file_sa.c_str());
+        std::remove(file_second.c_str());
+        std::remove(file_second_wide.c_str());
+        std::remove(file_segments.c_str());
+}
+
+template class BuildCheckpoint<uint32_t>;
+template class BuildCheckpoint<uint64_t>;
+
+} /* namespace sbwt */
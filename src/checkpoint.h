@@ -0,0 +1,96 @@
+#ifndef SBWT_CHECKPOINT_H
+#define SBWT_CHECKPOINT_H
+
+#include <stdint.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sbwt.h"
+
+namespace sbwt {
+
+using std::string;
+using std::vector;
+
+/**
+ * Checkpoint of an index build, so that a killed build can be resumed.
+ *
+ * The journal "prefix.period.ckpt" is a text file of records, one per line,
+ * appended once the data they refer to is flushed:
+ *
+ *      sorted BEG END          SA[BEG, END) is final, in .ckpt.sa
+ *      second I SIZE WIDE NSEG the second index is built up to the group
+ *                              starting at SA position I (complete if N):
+ *                              SIZE 16-bit entries of it in .ckpt.second,
+ *                              WIDE 32-bit ones in .ckpt.wide, and the SA
+ *                              positions of its NSEG segments in
+ *                              .ckpt.segments
+ *      chunk C POS OCC[4]      chunks [0, C) of the external build are
+ *                              written; POS suffixes, OCC the counts so far
+ *      PHASE                   a phase is done: suffix-array, spilled,
+ *                              array-file
+ *
+ * Its first line records the build: the reference (length and hash), the
+ * period, the width of the offsets and the options that change the index. A
+ * resumed build whose first line differs starts over, as does one whose data
+ * files do not match the journal; a line cut short by the kill is ignored.
+ */
+template <typename TOffset>
+class BuildCheckpoint {
+public:
+        /// Checkpoint of build_index, whose reference is read already, into
+        /// the index files of prefix_filename. setting: the build options.
+        /// Unless is_resume, any previous checkpoint is discarded.
+        BuildCheckpoint(const BasicIndexRawData<TOffset>&, const string &prefix_filename,
+                        const string &setting, bool is_resume);
+
+        bool IsDone(const string &phase) const;
+        void Done(const string &phase);
+
+        /// The range SA[beg, end), from and to sorted[0, end - beg)
+        bool IsSorted(TOffset beg, TOffset end) const;
+        void SaveSorted(const TOffset *sorted, TOffset beg, TOffset end);
+        bool LoadSorted(TOffset *sorted, TOffset beg, TOffset end);
+
+        /// The second index: size entries of array, size_wide of
+        /// array_wide, and the SA positions of its segments, built up to SA
+        /// position i
+        void SaveSecond(const uint16_t *array, uint64_t size, const uint32_t *array_wide, uint64_t size_wide,
+                        const vector<TOffset> &seg_begin, TOffset i);
+        bool LoadSecond(uint16_t *array, uint64_t capacity, uint64_t &size,
+                        uint32_t *array_wide, uint64_t capacity_wide, uint64_t &size_wide,
+                        vector<TOffset> &seg_begin, TOffset &i);
+
+        /// The external build: chunks [0, num_chunk) written
+        void SaveChunk(uint32_t num_chunk, TOffset pos_sa, const TOffset *occ);
+        uint32_t LoadChunk(TOffset &pos_sa, TOffset *occ) const;
+
+        /// Drop the records, when the data files do not match them
+        void Restart();
+        /// Remove the checkpoint files once the index files are complete
+        void Remove();
+
+private:
+        void Append(const string&);
+        void WriteJournal();
+        /// The last record starting with tag, split on spaces
+        bool LastRecord(const string &tag, vector<string>&) const;
+
+        TOffset length_ref;
+        string header;
+        string file_journal;
+        string file_sa;
+        string file_second;
+        string file_second_wide;
+        string file_segments;
+        vector<string> records;
+        std::ofstream journal;
+        uint64_t size_second_saved;     /* entries of .ckpt.second in the journal */
+        uint64_t size_wide_saved;       /* entries of .ckpt.wide in the journal */
+        uint64_t num_segment_saved;     /* offsets of .ckpt.segments in the journal */
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_CHECKPOINT_H */
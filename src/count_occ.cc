@@ -11,6 +11,7 @@
 #include <memory> // for shared_ptr
 
 #include "sbwt.h"
+#include "io_build_index.h"
 #include "utility.h"
 
 using std::string;
@@ -30,9 +31,13 @@ int main(int argc, char **argv)
         string prefix_filename = string(argv[1]);
         uint32_t seed_length = GetUint(argc, argv[2]);
 
-        sbwt::BuildIndexRawData build_index(prefix_filename);
-
-        CountSeedOccurrence(build_index, seed_length);
+        if (sbwt::ReadIndexOffsetBits(prefix_filename) == 64) {
+                sbwt::BuildIndexRawData64 build_index(prefix_filename);
+                CountSeedOccurrence(build_index, seed_length);
+        } else {
+                sbwt::BuildIndexRawData build_index(prefix_filename);
+                CountSeedOccurrence(build_index, seed_length);
+        }
 
         return 0;
 }
@@ -7,6 +7,7 @@
 #include <string>
 #include <cassert>
 #include <memory> // for shared_ptr
+#include <stdexcept>
 #include <stdint.h>
 
 #include <seqan/sequence.h>
@@ -20,6 +21,13 @@
 #include "word_io.h"
 #include "sequence_pack.h"
 #include "sbwt.h"
+#include "packed_reference.h"
+#include "sampled_occ.h"
+#include "wavelet_occ.h"
+#include "run_length_index.h"
+#include "sampled_sa.h"
+#include "packed_sa.h"
+#include "build_report.h"
 #include "log.h"
 
 using namespace seqan;
@@ -28,26 +36,52 @@ using namespace std;
 namespace sbwt
 {
 
-void WriteIntoDiskBuildIndex(sbwt::BuildIndexRawData &build_index, const string &prefix_filename)
+template <typename TOffset>
+string IndexFilename(const BasicIndexRawData<TOffset> &build_index,
+                     const string &prefix_filename,
+                     const string &extension)
 {
-        vector<uint32_t > nums(build_index.length_ref);
-        for (int i = 0; i != build_index.length_ref; ++i) {nums[i] = build_index.suffix_array[i];}
-        string file_array_filename = prefix_filename
-                                     + "."
-                                     + std::to_string(build_index.period)
-                                     + ".array.sbwt";
-        string file_meta_filename = prefix_filename
-                                    + "."
-                                    + std::to_string(build_index.period)
-                                    + ".meta.sbwt";
-
-        std::ofstream array_fout(file_array_filename.c_str(), std::ios::binary);
-        std::ofstream meta_fout(file_meta_filename.c_str(), std::ios::binary);
+        return prefix_filename
+               + "."
+               + std::to_string(build_index.period)
+               + extension;
+}
 
-        uint32_t size_packed_seq_8bit = build_index.length_ref / 4;
+template <typename TOffset>
+uint64_t SizePackedSeq8Bit(const BasicIndexRawData<TOffset> &build_index)
+{
+        uint64_t size_packed_seq_8bit = build_index.length_ref / 4;
         size_packed_seq_8bit += build_index.length_ref % 4 == 0 ? 0 : 1;
-        ///uint64_t size_packed_seq = build_index.length_ref / 32;
+        return size_packed_seq_8bit;
+}
+
+template <typename TOffset>
+uint64_t OffsetOccurrence(const BasicIndexRawData<TOffset> &build_index, int c)
+{
+        uint64_t size_sequence = build_index.is_ref_shared ? 0
+                : SizePackedSeq8Bit(build_index) * 4 + build_index.length_ref;
+        return size_sequence + (uint64_t)build_index.length_ref * sizeof(TOffset) * c;
+}
+
+template <typename TOffset>
+uint64_t OffsetSuffixArray(const BasicIndexRawData<TOffset> &build_index)
+{
+        /// The sampled Occ and the wavelet tree come after SA, the run-length
+        /// index in its place
+        return OffsetOccurrence(build_index, build_index.occ_format == kOccFull ? 4 : 0);
+}
 
+/// A 32-bit field of the meta header, 0 if it needs the 64-bit trailer
+static uint32_t MetaU32(uint64_t val)
+{
+        return val > 0xFFFFFFFFull ? 0 : (uint32_t)val;
+}
+
+template <typename TOffset>
+void WriteIntoDiskBuildIndexMeta(BasicIndexRawData<TOffset> &build_index, const string &prefix_filename)
+{
+        string file_meta_filename = IndexFilename(build_index, prefix_filename, ".meta.sbwt");
+        std::ofstream meta_fout(file_meta_filename.c_str(), std::ios::binary);
 
         /**
          * Meta information
@@ -55,16 +89,45 @@ void WriteIntoDiskBuildIndex(sbwt::BuildIndexRawData &build_index, const string
         LOGINFO("Write meta information...\n");
         bool is_bigendian = currentlyBigEndian();
         writeU32(meta_fout, (uint32_t)is_bigendian, is_bigendian);      /* The endian flag */
-        writeU32(meta_fout, build_index.length_ref, is_bigendian);      /* Length of reference sequence including $s*/
+        writeU32(meta_fout, MetaU32(build_index.length_ref), is_bigendian);/* Length of reference sequence including $s*/
         writeU32(meta_fout, build_index.num_block_sort, is_bigendian);  /* Number of blocks, 4 for 256 */
         writeU32(meta_fout, build_index.num_dollar, is_bigendian);      /* The # of $s those are appended */
         writeU32(meta_fout, build_index.period, is_bigendian);          /* The period of sbwt */
-        writeU32(meta_fout, size_packed_seq_8bit, is_bigendian);        /* The size of packed sequence */
+        writeU32(meta_fout, MetaU32(SizePackedSeq8Bit(build_index)), is_bigendian);/* The size of packed sequence */
 
         /// write first column
         for (int i = 0; i != 4; ++i) {
-                writeU32(meta_fout, build_index.first_column[i], is_bigendian);
+                writeU32(meta_fout, MetaU32(build_index.first_column[i]), is_bigendian);
+        }
+
+        /// Trailer, ignored by readers of version 1: the width of the
+        /// offsets and the fields above in 64 bits
+        writeU32(meta_fout, kIndexMetaVersion, is_bigendian);
+        writeU32(meta_fout, sizeof(TOffset) * 8, is_bigendian);
+        writeU64(meta_fout, build_index.length_ref, is_bigendian);
+        writeU64(meta_fout, SizePackedSeq8Bit(build_index), is_bigendian);
+        for (int i = 0; i != 4; ++i) {
+                writeU64(meta_fout, build_index.first_column[i], is_bigendian);
+        }
+        writeU32(meta_fout, (build_index.is_ref_shared ? kIndexFlagSharedRef : 0)
+                            | (build_index.occ_format == kOccSampled ? kIndexFlagSampledOcc : 0)
+                            | (build_index.occ_format == kOccWavelet ? kIndexFlagWaveletOcc : 0)
+                            | (build_index.occ_format == kOccRunLength ? kIndexFlagRunLength : 0)
+                            | (build_index.is_sa_packed ? kIndexFlagPackedSa : 0), is_bigendian);
+        writeU32(meta_fout, build_index.sa_sample_rate, is_bigendian);
+
+        meta_fout.flush();
+        meta_fout.close();
+}
+
+template <typename TOffset>
+void WriteIntoDiskBuildIndexSequence(BasicIndexRawData<TOffset> &build_index, std::ostream &array_fout)
+{
+        /// Written once for all the periods, see WriteIntoDiskReference
+        if (build_index.is_ref_shared) {
+                return;
         }
+        uint64_t size_packed_seq_8bit = SizePackedSeq8Bit(build_index);
 
         /**
          * Array and sequence
@@ -86,15 +149,14 @@ void WriteIntoDiskBuildIndex(sbwt::BuildIndexRawData &build_index, const string
         {
                 /// Watch out for the boarder
                 LOGINFO("Packed binary sequence...\n");
-                std::shared_ptr<uint8_t > binary_8bit_sptr(new uint8_t[(size_packed_seq_8bit * 4) + 1024]);
+                std::shared_ptr<uint8_t > binary_8bit_sptr(new uint8_t[size_packed_seq_8bit + 1024]);
 
                 for (int i = 0; i != 4; ++i) {
                         sbwtio::BaseChar2Binary8B(build_index.seq_raw + i,
                                                   size_packed_seq_8bit,
-                                                  binary_8bit_sptr.get() + i*size_packed_seq_8bit);
+                                                  binary_8bit_sptr.get());
 
-                        array_fout.write((const char*)(binary_8bit_sptr.get() + i*size_packed_seq_8bit),
-                                         size_packed_seq_8bit);
+                        array_fout.write((const char*)binary_8bit_sptr.get(), size_packed_seq_8bit);
                 }
         }
 
@@ -102,38 +164,117 @@ void WriteIntoDiskBuildIndex(sbwt::BuildIndexRawData &build_index, const string
         /// TODO map directly the memory to files
         LOGINFO("Write raw sequence...\n");
         array_fout.write(build_index.seq_raw, build_index.length_ref);
+}
+
+template <typename TOffset>
+void WriteIntoDiskBuildIndex(BasicIndexRawData<TOffset> &build_index, const string &prefix_filename)
+{
+        string file_array_filename = IndexFilename(build_index, prefix_filename, ".array.sbwt");
+        std::ofstream array_fout(file_array_filename.c_str(), std::ios::binary);
 
-        //array_fout.write(build_index.seq_transformed, build_index.length_ref);
+        WriteIntoDiskBuildIndexMeta(build_index, prefix_filename);
+        WriteIntoDiskBuildIndexSequence(build_index, array_fout);
 
         /// Occurrence
-        LOGINFO("Write raw occurrence...\n");
-        for (int i = 0; i != 4; ++i) {
-                uint32_t *beg = build_index.occurrence[i];
-                uint32_t *end = beg+build_index.length_ref;
-                while (beg != end) {
-                        writeU32(array_fout, *beg, is_bigendian);
-                        ++beg;
+        if (build_index.occ_format == kOccFull) {
+                LOGINFO("Write raw occurrence...\n");
+                for (int i = 0; i != 4; ++i) {
+                        WriteArray(array_fout, build_index.occurrence[i], build_index.length_ref);
+                }
+        }
+
+        /// suffix array, unless sampled by the run-length index or at the end
+        const bool is_sa_sampled = build_index.sa_sample_rate > 1;
+        if (build_index.is_sa_packed) {
+                LOGINFO("Write packed suffix array...\n");
+                PackedSaWriter<TOffset> writer(array_fout, build_index.length_ref);
+                for (TOffset i = 0; i != build_index.length_ref; ++i) {
+                        writer.Append(build_index.suffix_array[i]);
+                }
+                writer.Finish();
+                if (build_index.report) {
+                        uint64_t num_word = PackedSa<TOffset>::NumWord(build_index.length_ref,
+                                                                       PackedSa<TOffset>::Width(build_index.length_ref));
+                        build_index.report->AddBytes("packed-suffix-array", build_index.period,
+                                                     num_word * sizeof(uint64_t));
                 }
+        } else if (build_index.occ_format != kOccRunLength && !is_sa_sampled) {
+                LOGINFO("Write raw suffix array...\n");
+                WriteArray(array_fout, build_index.suffix_array, build_index.length_ref);
         }
 
-        /// suffix array
-        LOGINFO("Write raw suffix array...\n");
-        uint32_t *beg = build_index.suffix_array;
-        uint32_t *end = build_index.suffix_array + build_index.length_ref;
-        while (beg != end) {
-                writeU32(array_fout, *beg, is_bigendian);
-                ++beg;
+        /// The BWT character i is the one whose column goes up at i
+        if (build_index.occ_format != kOccFull || is_sa_sampled) {
+                LOGINFO("Write occurrence after SA...\n");
+                TOffset *const *O = build_index.occurrence;
+                const TOffset N = build_index.length_ref;
+                std::unique_ptr<SampledOccWriter<TOffset> > writer;
+                std::unique_ptr<WaveletOcc<TOffset> > wavelet;
+                std::unique_ptr<RunLengthIndex<TOffset> > runs;
+                std::unique_ptr<SampledSa<TOffset> > samples;
+                if (build_index.occ_format == kOccSampled) {
+                        writer.reset(new SampledOccWriter<TOffset>(array_fout));
+                } else if (build_index.occ_format == kOccWavelet) {
+                        uint64_t count_base[4] = {O[0][N-1], O[1][N-1], O[2][N-1], O[3][N-1]};
+                        wavelet.reset(new WaveletOcc<TOffset>(count_base));
+                } else if (build_index.occ_format == kOccRunLength) {
+                        runs.reset(new RunLengthIndex<TOffset>(N, build_index.period));
+                }
+                if (is_sa_sampled) {
+                        samples.reset(new SampledSa<TOffset>(build_index.period, build_index.sa_sample_rate));
+                }
+                for (TOffset i = 0; i != N; ++i) {
+                        char c = '$';
+                        for (int b = 0; b != 4; ++b) {
+                                if (O[b][i] != (i ? O[b][i-1] : 0)) {
+                                        c = "ACGT"[b];
+                                }
+                        }
+                        if (runs) {
+                                runs->Append(c, build_index.suffix_array[i]);
+                        } else if (wavelet) {
+                                wavelet->Append(c);
+                        } else if (writer) {
+                                writer->Append(c);
+                        }
+                        if (samples) {
+                                samples->Append(c, build_index.suffix_array[i]);
+                        }
+                }
+                if (runs) {
+                        runs->Finish();
+                        LOGINFO("Runs of the BWT: " << runs->NumRun() << "\n");
+                        if (build_index.report) {
+                                build_index.report->AddBytes("run-length-index", build_index.period, runs->Bytes());
+                        }
+                        runs->Save(array_fout);
+                } else if (wavelet) {
+                        wavelet->Save(array_fout);
+                } else if (writer) {
+                        writer->Finish();
+                }
+                if (samples) {
+                        LOGINFO("SA samples: " << samples->NumSample() << "\n");
+                        if (build_index.report) {
+                                build_index.report->AddBytes("sampled-suffix-array", build_index.period,
+                                                             samples->Bytes());
+                        }
+                        samples->Save(array_fout);
+                }
         }
 
         array_fout.flush();
         array_fout.close();
-        meta_fout.flush();
-        meta_fout.close();
+        if (!array_fout) {
+                LOGERROR("Cannot write " << file_array_filename);
+                throw std::runtime_error("WriteIntoDiskBuildIndex");
+        }
 }
 
 
+template <typename TOffset>
 void WriteIntoDiskBuildSecondIndex(
-                sbwt::BuildIndexRawData &build_index,
+                BasicIndexRawData<TOffset> &build_index,
                 const string &prefix_filename,
                 SecondIndex &second_index)
 {
@@ -157,22 +298,91 @@ void WriteIntoDiskBuildSecondIndex(
 
         /// Write flag on endianness
         writeU16(second_fout, (uint16_t)is_bigendian);
-        /// meta information
-        writeU64(second_fout, second_index.size);
+        /// meta information, the version 1 size 0 first
+        writeU64(second_fout, 0);
         writeU32(second_fout, second_index.size_min);
         writeU32(second_fout, second_index.size_seed);
-
-        /// Write array
-        auto ptr = second_index.array_ptr;
-        for (uint32_t i = 0; i < second_index.size; ++i) {
-                writeU16(second_fout, *ptr);
-                ++ptr;
+        writeU32(second_fout, kSecondIndexVersion);
+        writeU32(second_fout, second_index.layout);
+        writeU64(second_fout, second_index.segments.size());
+        writeU64(second_fout, second_index.size);
+        writeU64(second_fout, second_index.size_wide);
+
+        /// Write the directory of the segments, then their entries
+        const vector<SecondIndex::Segment> &segments = second_index.segments;
+        vector<uint64_t> begs(segments.size()), offsets(segments.size());
+        vector<uint32_t> counts(segments.size());
+        for (size_t k = 0; k < segments.size(); ++k) {
+                begs[k] = segments[k].beg;
+                counts[k] = segments[k].count;
+                offsets[k] = segments[k].offset;
         }
+        WriteArray(second_fout, begs.data(), begs.size());
+        WriteArray(second_fout, counts.data(), counts.size());
+        WriteArray(second_fout, offsets.data(), offsets.size());
+        WriteArray(second_fout, second_index.array_ptr, second_index.size);
+        WriteArray(second_fout, second_index.array_wide, second_index.size_wide);
 
         second_fout.flush();
         second_fout.close();
+        if (!second_fout) {
+                LOGERROR("Cannot write " << file_second_filename);
+                throw std::runtime_error("WriteIntoDiskBuildSecondIndex");
+        }
+}
+
+string ReferenceFilename(const string &prefix_filename)
+{
+        return prefix_filename + ".ref.sbwt";
+}
+
+bool WriteIntoDiskReference(const PackedReference &ref, const string &prefix_filename)
+{
+        string file_ref_filename = ReferenceFilename(prefix_filename);
+        std::ofstream ref_fout(file_ref_filename.c_str(), std::ios::binary);
+        LOGINFO("Write the reference shared by the periods...\n");
+        if (!ref.Save(ref_fout)) {
+                LOGERROR("Cannot write " << file_ref_filename);
+                return false;
+        }
+        return true;
+}
+
+uint32_t ReadIndexOffsetBits(const string &prefix_filename)
+{
+        string file_meta_filename = prefix_filename + ".meta.sbwt";
+        std::ifstream meta_fin(file_meta_filename.c_str(), std::ios_base::in | ios::binary);
+        if (!meta_fin.is_open()) {
+                return 0;
+        }
+        bool is_big_endian = readU32(meta_fin, true) != 0;
+        /// skip the rest of the version 1 header
+        for (int i = 0; i != 9; ++i) {
+                readU32(meta_fin, is_big_endian);
+        }
+        if (!meta_fin) {
+                return 0;
+        }
+        uint32_t version = readU32(meta_fin, is_big_endian);
+        if (!meta_fin || version < 2) {
+                return 32;
+        }
+        return readU32(meta_fin, is_big_endian);
 }
 
+#define SBWT_INSTANTIATE_IO(TOffset) \
+        template string IndexFilename<TOffset>(const BasicIndexRawData<TOffset>&, const string&, const string&); \
+        template uint64_t SizePackedSeq8Bit<TOffset>(const BasicIndexRawData<TOffset>&); \
+        template uint64_t OffsetOccurrence<TOffset>(const BasicIndexRawData<TOffset>&, int); \
+        template uint64_t OffsetSuffixArray<TOffset>(const BasicIndexRawData<TOffset>&); \
+        template void WriteIntoDiskBuildIndexMeta<TOffset>(BasicIndexRawData<TOffset>&, const string&); \
+        template void WriteIntoDiskBuildIndexSequence<TOffset>(BasicIndexRawData<TOffset>&, std::ostream&); \
+        template void WriteIntoDiskBuildIndex<TOffset>(BasicIndexRawData<TOffset>&, const string&); \
+        template void WriteIntoDiskBuildSecondIndex<TOffset>(BasicIndexRawData<TOffset>&, const string&, SecondIndex&);
+
+SBWT_INSTANTIATE_IO(uint32_t)
+SBWT_INSTANTIATE_IO(uint64_t)
+#undef SBWT_INSTANTIATE_IO
 
 } /* namespace sbwt */
 
@@ -1,14 +1,64 @@
 #ifndef SBWT_IO_BUILD_INDEX_H
 #define SBWT_IO_BUILD_INDEX_H
 
+#include <ostream>
 #include <string>
 
 #include "sbwt.h"
 
 namespace sbwt{
 using std::string;
-void WriteIntoDiskBuildIndex(sbwt::BuildIndexRawData&, const string&);
-void WriteIntoDiskBuildSecondIndex(sbwt::BuildIndexRawData&, const string&, SecondIndex&);
+/// Version of the meta file: 1 has the ten 32-bit words only, 2 appends
+/// the width of the offsets and the 64-bit lengths, 3 the flags below, 4
+/// the rate SA is sampled at (1: SA in full, otherwise see SampledSa)
+const uint32_t kIndexMetaVersion = 4;
+/// The array file has no sequence section, it is in the .ref.sbwt file
+const uint32_t kIndexFlagSharedRef = 1;
+/// The array file has no Occ columns, but Occ sampled in cache lines after
+/// SA (see SampledOcc), or a wavelet tree (see WaveletOcc)
+const uint32_t kIndexFlagSampledOcc = 2;
+const uint32_t kIndexFlagWaveletOcc = 4;
+/// The array file has neither the Occ columns nor SA, but the run-length
+/// BWT with SA sampled at its runs in the place of SA (see RunLengthIndex)
+const uint32_t kIndexFlagRunLength = 8;
+/// SA is bit-packed in its place (see PackedSa)
+const uint32_t kIndexFlagPackedSa = 16;
+/// Version of the second index file: 1 has the segments in one array, their
+/// headers swapped into SA; 2 a directory of the segments and SA intact; 3
+/// the layout of the entries too
+const uint32_t kSecondIndexVersion = 3;
+
+/// Instantiated for uint32_t and uint64_t offsets
+template <typename TOffset>
+void WriteIntoDiskBuildIndex(BasicIndexRawData<TOffset>&, const string&);
+/// Pieces of WriteIntoDiskBuildIndex, for builders that stream their output
+template <typename TOffset>
+string IndexFilename(const BasicIndexRawData<TOffset>&, const string&/*prefix*/, const string&/*extension*/);
+template <typename TOffset>
+uint64_t SizePackedSeq8Bit(const BasicIndexRawData<TOffset>&);
+template <typename TOffset>
+uint64_t OffsetOccurrence(const BasicIndexRawData<TOffset>&, int/*A, C, G or T*/);
+template <typename TOffset>
+uint64_t OffsetSuffixArray(const BasicIndexRawData<TOffset>&);
+template <typename TOffset>
+void WriteIntoDiskBuildIndexMeta(BasicIndexRawData<TOffset>&, const string&);
+template <typename TOffset>
+void WriteIntoDiskBuildIndexSequence(BasicIndexRawData<TOffset>&, std::ostream&);
+template <typename TOffset>
+void WriteIntoDiskBuildSecondIndex(BasicIndexRawData<TOffset>&, const string&, SecondIndex&);
+/// The reference shared by the index files "prefix.period" of several periods
+string ReferenceFilename(const string&/*prefix*/);
+bool WriteIntoDiskReference(const PackedReference&, const string&);
+/// Width (32 or 64) of the offsets of the index files "prefix.period", 0 if
+/// the meta file cannot be read
+uint32_t ReadIndexOffsetBits(const string&);
+
+/// The index files are in native (little-endian) order
+template <typename T>
+inline void WriteArray(std::ostream &fout, const T *beg, size_t size)
+{
+        fout.write((const char*)beg, size * sizeof(T));
+}
 
 } /* namespace sbwt */
 
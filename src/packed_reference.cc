@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "packed_reference.h"
+
+namespace sbwt {
+
+/// Bytes of the FASTA file read at a time
+static const size_t kFastaBlockSize = 1u << 22;
+
+static inline bool IsBase(char c)
+{
+        return c == 'A' || c == 'C' || c == 'G' || c == 'T';
+}
+
+/// 2-bit code of A/C/G/T: 0x41, 0x43, 0x47 and 0x54 to 0, 1, 2 and 3
+static inline uint8_t BaseCode(char c)
+{
+        return ((c >> 1) & 3) ^ ((c >> 2) & 1);
+}
+
+/// 2-bit codes of the 8 bases at p, packed from the low bits
+static inline uint64_t PackBases8(const char *p)
+{
+        uint64_t v;
+        memcpy(&v, p, 8);
+        /// BaseCode of every byte, then gather the 2-bit fields
+        uint64_t c = ((v >> 1) & 0x0303030303030303ull) ^ ((v >> 2) & 0x0101010101010101ull);
+        c = (c | (c >> 6)) & 0x000F000F000F000Full;
+        c = (c | (c >> 12)) & 0x000000FF000000FFull;
+        c = (c | (c >> 24)) & 0xFFFFull;
+        return c;
+}
+
+/// Number of leading A/C/G/T among the 16 bytes at p
+static inline uint32_t LeadingBases16(const char *p)
+{
+#if defined(__SSE2__)
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('A')), _mm_cmpeq_epi8(v, _mm_set1_epi8('C'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('G')), _mm_cmpeq_epi8(v, _mm_set1_epi8('T'))));
+        uint32_t not_base = ~(uint32_t)_mm_movemask_epi8(m) & 0xFFFF;
+        return not_base ? __builtin_ctz(not_base) : 16;
+#else
+        uint32_t k = 0;
+        while (k < 16 && IsBase(p[k])) {
+                ++k;
+        }
+        return k;
+#endif
+}
+
+/// The 4 bases packed in every byte
+struct Bases4Table {
+        Bases4Table()
+        {
+                for (int x = 0; x < 256; ++x) {
+                        for (int j = 0; j < 4; ++j) {
+                                bases[x][j] = "ACGT"[(x >> (2 * j)) & 3];
+                        }
+                }
+        }
+        char bases[256][4];
+};
+
+/// Unpack block b of the arena to out + b * (bases per block)
+void PackedReference::UnpackBlock(size_t b, char *out) const
+{
+        static const Bases4Table table;
+        const uint64_t *words = blocks[b].get();
+        uint64_t i = b * kWordsPerBlock * 32;
+        uint64_t end = std::min<uint64_t>(length, i + kWordsPerBlock * 32);
+        for (uint64_t j = 0; i + 32 <= end; ++j, i += 32) {
+                uint64_t w = words[j];
+                for (int k = 0; k < 8; ++k) {
+                        memcpy(out + i + 4 * k, table.bases[(w >> (8 * k)) & 0xFF], 4);
+                }
+        }
+        for (; i < end; ++i) {
+                uint64_t j = i % (kWordsPerBlock * 32);
+                out[i] = "ACGT"[(words[j >> 5] >> (2 * (j & 31))) & 3];
+        }
+}
+
+void PackedReference::Unpack(char *out) const
+{
+        for (size_t b = 0; b < blocks.size(); ++b) {
+                UnpackBlock(b, out);
+        }
+}
+
+void PackedReference::UnpackAndRelease(char *out)
+{
+        for (size_t b = 0; b < blocks.size(); ++b) {
+                UnpackBlock(b, out);
+                blocks[b].reset();
+        }
+        blocks.clear();
+        length = 0;
+}
+
+bool PackedReference::Save(std::ostream &out) const
+{
+        out.write((const char*)&length, sizeof(length));
+        uint64_t num_word = (length + 31) / 32;
+        for (size_t b = 0; b < blocks.size() && num_word > 0; ++b) {
+                uint64_t n = std::min<uint64_t>(num_word, kWordsPerBlock);
+                out.write((const char*)blocks[b].get(), n * sizeof(uint64_t));
+                num_word -= n;
+        }
+        return (bool)out;
+}
+
+bool PackedReference::Load(std::istream &in)
+{
+        blocks.clear();
+        length = 0;
+        uint64_t size = 0;
+        if (!in.read((char*)&size, sizeof(size))) {
+                return false;
+        }
+        uint64_t num_word = (size + 31) / 32;
+        for (uint64_t w = 0; w < num_word; w += kWordsPerBlock) {
+                uint64_t n = std::min<uint64_t>(num_word - w, kWordsPerBlock);
+                blocks.emplace_back(new uint64_t[kWordsPerBlock]());
+                if (!in.read((char*)blocks.back().get(), n * sizeof(uint64_t))) {
+                        blocks.clear();
+                        return false;
+                }
+        }
+        length = size;
+        return true;
+}
+
+bool ReadFastaPacked(const char *file_name, PackedReference &ref)
+{
+        FILE *handler = fopen(file_name, "rb");
+        if (!handler) {
+                return false;
+        }
+
+        std::vector<char> buffer(kFastaBlockSize);
+        bool in_header = false;         /* inside a '>' line */
+        bool line_start = true;
+        size_t n = 0;
+        while ((n = fread(buffer.data(), 1, buffer.size(), handler)) > 0) {
+                const char *buf = buffer.data();
+                size_t i = 0;
+                while (i < n) {
+                        if (in_header) {
+                                const char *eol = (const char*)memchr(buf + i, '\n', n - i);
+                                if (!eol) {
+                                        i = n;
+                                        break;
+                                }
+                                i = eol - buf + 1;
+                                in_header = false;
+                                line_start = true;
+                                continue;
+                        }
+                        if (line_start && buf[i] == '>') {
+                                in_header = true;
+                                ++i;
+                                continue;
+                        }
+                        /// Runs of bases, classified and packed 16 at a time
+                        while (i + 16 <= n) {
+                                uint32_t k = LeadingBases16(buf + i);
+                                if (k == 0) {
+                                        break;
+                                }
+                                uint64_t bits = PackBases8(buf + i) | PackBases8(buf + i + 8) << 16;
+                                if (k < 16) {
+                                        bits &= (1ull << (2 * k)) - 1;
+                                }
+                                ref.Append(bits, k);
+                                i += k;
+                                line_start = false;
+                                if (k < 16) {
+                                        break;
+                                }
+                        }
+                        if (i == n) {
+                                break;
+                        }
+                        /// Newlines, other characters and the tail of the block
+                        char c = buf[i++];
+                        if (IsBase(c)) {
+                                ref.Append(BaseCode(c), 1);
+                        }
+                        line_start = c == '\n';
+                }
+        }
+        bool ok = !ferror(handler);
+        fclose(handler);
+        return ok;
+}
+
+} /* namespace sbwt */
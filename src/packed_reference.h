@@ -0,0 +1,71 @@
+#ifndef SBWT_PACKED_REFERENCE_H
+#define SBWT_PACKED_REFERENCE_H
+
+#include <stdint.h>
+
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace sbwt {
+
+/**
+ * Reference sequence packed 2 bits per base (A=0, C=1, G=2, T=3), 32 bases
+ * per word, in an arena of fixed-size blocks: growing it never moves or
+ * copies the bases already stored.
+ */
+class PackedReference {
+public:
+        PackedReference(): length(0) { }
+
+        /// Append count <= 32 bases, packed 2 bits each from the low bits
+        void Append(uint64_t bits, uint32_t count)
+        {
+                uint64_t w = length >> 5;
+                uint32_t off = length & 31;
+                Word(w) |= bits << (2 * off);
+                if (off + count > 32) {
+                        Word(w + 1) |= bits >> (2 * (32 - off));
+                }
+                length += count;
+        }
+        uint64_t Length() const { return length; }
+        /// Unpack all the bases to A/C/G/T into out
+        void Unpack(char *out) const;
+        /// Unpack, releasing the arena block by block; the reference is
+        /// empty afterwards.
+        void UnpackAndRelease(char *out);
+
+        /// The length, then the packed words (native order)
+        bool Save(std::ostream&) const;
+        bool Load(std::istream&);
+
+private:
+        static const uint64_t kWordsPerBlock = 1u << 16;     /* 2M bases, 512 KiB */
+
+        void UnpackBlock(size_t, char*) const;
+        uint64_t &Word(uint64_t w)
+        {
+                if ((w / kWordsPerBlock) >= blocks.size()) {
+                        blocks.emplace_back(new uint64_t[kWordsPerBlock]());
+                }
+                return blocks[w / kWordsPerBlock][w % kWordsPerBlock];
+        }
+
+        std::vector<std::unique_ptr<uint64_t[]> > blocks;
+        uint64_t length;
+};
+
+/**
+ * Stream a FASTA file into ref, reading it in large blocks. Header lines
+ * ('>' up to the end of the line) are skipped, and so are the characters
+ * other than A/C/G/T; the sequences are concatenated. Runs of bases are
+ * classified 16 bytes at a time (SSE2, when available).
+ *
+ * Returns false if the file cannot be opened or read.
+ */
+bool ReadFastaPacked(const char *file_name, PackedReference &ref);
+
+} /* namespace sbwt */
+#endif /* SBWT_PACKED_REFERENCE_H */
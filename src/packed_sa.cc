@@ -0,0 +1,103 @@
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "packed_sa.h"
+#include "io_build_index.h"
+
+namespace sbwt {
+
+template <typename TOffset>
+bool PackedSa<TOffset>::Load(std::istream &fin)
+{
+        fin.read((char*)&length, sizeof(length));
+        fin.read((char*)&bits, sizeof(bits));
+        if (!fin || bits == 0 || bits > sizeof(TOffset) * 8) {
+                return false;
+        }
+        words.resize(NumWord(length, bits));
+        fin.read((char*)words.data(), words.size() * sizeof(uint64_t));
+        return (bool)fin;
+}
+
+template <typename TOffset>
+PackedSaWriter<TOffset>::PackedSaWriter(std::ostream &out, uint64_t len):
+        fout(out),
+        length(len),
+        bits(PackedSa<TOffset>::Width(len)),
+        word(0),
+        filled(0),
+        num_word(0)
+{
+        WriteArray(fout, &length, 1);
+        WriteArray(fout, &bits, 1);
+}
+
+template <typename TOffset>
+void PackedSaWriter<TOffset>::Flush()
+{
+        WriteArray(fout, buffer.data(), buffer.size());
+        num_word += buffer.size();
+        buffer.clear();
+}
+
+/// The word being filled, then zeros up to the one past the entries
+template <typename TOffset>
+bool PackedSaWriter<TOffset>::Finish()
+{
+        if (filled) {
+                buffer.push_back(word);
+        }
+        uint64_t num_total = PackedSa<TOffset>::NumWord(length, bits);
+        while (num_word + buffer.size() < num_total) {
+                buffer.push_back(0);
+        }
+        Flush();
+        return (bool)fout;
+}
+
+template <typename TOffset>
+SaReader<TOffset>::SaReader(std::istream &in, bool packed):
+        fin(in),
+        is_packed(packed),
+        bits(sizeof(TOffset) * 8),
+        pos(0)
+{
+        if (is_packed) {
+                uint64_t length = 0;
+                fin.read((char*)&length, sizeof(length));
+                fin.read((char*)&bits, sizeof(bits));
+        }
+}
+
+/// The words of the entries, the consumed ones dropped, and the one past
+/// them are read ahead
+template <typename TOffset>
+bool SaReader<TOffset>::Read(TOffset *sa, uint64_t count)
+{
+        if (!is_packed) {
+                fin.read((char*)sa, count * sizeof(TOffset));
+                return (bool)fin;
+        }
+        words.erase(words.begin(), words.begin() + std::min<uint64_t>(pos / 64, words.size()));
+        pos %= 64;
+        uint64_t num_need = (pos + count * bits + 63) / 64 + 1;
+        if (words.size() < num_need) {
+                size_t num_have = words.size();
+                words.resize(num_need);
+                fin.read((char*)(words.data() + num_have), (num_need - num_have) * sizeof(uint64_t));
+        }
+        for (uint64_t k = 0; k < count; ++k, pos += bits) {
+                sa[k] = PackedSa<TOffset>::Extract(words.data(), pos, bits);
+        }
+        return (bool)fin;
+}
+
+template class PackedSa<uint32_t>;
+template class PackedSa<uint64_t>;
+template class PackedSaWriter<uint32_t>;
+template class PackedSaWriter<uint64_t>;
+template class SaReader<uint32_t>;
+template class SaReader<uint64_t>;
+
+} /* namespace sbwt */
@@ -0,0 +1,118 @@
+#ifndef SBWT_PACKED_SA_H
+#define SBWT_PACKED_SA_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <istream>
+#include <ostream>
+#include <vector>
+
+namespace sbwt {
+
+/**
+ * SA bit-packed: ceil(log2 N) bits an entry, from the low bits of 64-bit
+ * words on, against sizeof(TOffset) bytes (23 bits for a 5 Mbp genome,
+ * 32 bits for SA in 32-bit offsets). An entry is read by one unaligned
+ * 64-bit load from its first byte, and a word past the last one keeps the
+ * load of the last entries within the words.
+ */
+template <typename TOffset>
+class PackedSa {
+public:
+        PackedSa(): length(0), bits(1) { }
+
+        TOffset operator[](uint64_t i) const { return Extract(words.data(), i * bits, bits); }
+        /// The entry of bits bits at bit pos of words: one unaligned load
+        /// from its byte up to 57 bits (all 32-bit offsets), else the two
+        /// words it straddles merged
+        static TOffset Extract(const uint64_t *words, uint64_t pos, uint32_t bits)
+        {
+                const uint64_t mask = ~0ull >> (64 - bits);
+                if (sizeof(TOffset) == 4 || bits <= 57) {
+                        uint64_t value;
+                        memcpy(&value, (const uint8_t*)words + pos / 8, sizeof(value));
+                        return (value >> (pos % 8)) & mask;
+                }
+                const uint64_t *w = words + pos / 64;
+                const uint32_t shift = pos % 64;
+                /// w[1] shifted in two steps: by 64 when shift is 0
+                return ((w[0] >> shift) | ((w[1] << 1) << (63 - shift))) & mask;
+        }
+        /// The address of entry i, to prefetch
+        const uint64_t *Address(uint64_t i) const { return words.data() + i * bits / 64; }
+
+        /// Bits of the entries of a SA of length suffixes
+        static uint32_t Width(uint64_t length) { return length > 1 ? 64 - __builtin_clzll(length - 1) : 1; }
+        /// Words of the entries and the one past them
+        static uint64_t NumWord(uint64_t length, uint32_t bits) { return (length * bits + 63) / 64 + 1; }
+
+        uint32_t Bits() const { return bits; }
+        uint64_t Bytes() const { return words.size() * sizeof(uint64_t); }
+        /// The section PackedSaWriter wrote
+        bool Load(std::istream&);
+
+private:
+        uint64_t length;
+        uint32_t bits;
+        std::vector<uint64_t> words;
+};
+
+/**
+ * Writer of the section of PackedSa, from SA given entry by entry in
+ * order: the length and the bits, then the words as they fill up.
+ */
+template <typename TOffset>
+class PackedSaWriter {
+public:
+        PackedSaWriter(std::ostream&, uint64_t length);
+        void Append(TOffset sa)
+        {
+                word |= (uint64_t)sa << filled;
+                if (filled + bits >= 64) {
+                        buffer.push_back(word);
+                        /// The high bits of sa that did not fit
+                        word = filled ? (uint64_t)sa >> (64 - filled) : 0;
+                        if (buffer.size() == kBufferWords) {
+                                Flush();
+                        }
+                }
+                filled = (filled + bits) % 64;
+        }
+        /// Write the last words; false on an error
+        bool Finish();
+
+private:
+        static const uint32_t kBufferWords = 1u << 16;
+        void Flush();
+
+        std::ostream &fout;
+        uint64_t length;
+        uint32_t bits;
+        uint64_t word;                  /* the word being filled */
+        uint32_t filled;                /* its bits filled */
+        uint64_t num_word;              /* words written */
+        std::vector<uint64_t> buffer;
+};
+
+/**
+ * SA read in order from the array file, in sizeof(TOffset) bytes an entry
+ * or packed (see PackedSa), the stream at the start of its section.
+ */
+template <typename TOffset>
+class SaReader {
+public:
+        SaReader(std::istream&, bool/*packed*/);
+        /// The next count entries of SA into sa; false on an error
+        bool Read(TOffset *sa, uint64_t count);
+
+private:
+        std::istream &fin;
+        bool is_packed;
+        uint32_t bits;
+        std::vector<uint64_t> words;    /* the words read and not consumed, then one */
+        uint64_t pos;                   /* bit of the next entry in words */
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_PACKED_SA_H */
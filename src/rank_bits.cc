@@ -0,0 +1,30 @@
+#include <stdint.h>
+
+#include "rank_bits.h"
+#include "io_build_index.h"
+
+namespace sbwt {
+
+bool RankBits::Save(std::ostream &fout) const
+{
+        uint64_t num_word = lines.size();
+        WriteArray(fout, &size, 1);
+        WriteArray(fout, &num_word, 1);
+        WriteArray(fout, lines.data(), lines.size());
+        return (bool)fout;
+}
+
+bool RankBits::Load(std::istream &fin)
+{
+        uint64_t num_word = 0;
+        fin.read((char*)&size, sizeof(size));
+        fin.read((char*)&num_word, sizeof(num_word));
+        if (!fin || num_word != (size / kLineBits + 1) * kLineWords) {
+                return false;
+        }
+        lines.resize(num_word);
+        fin.read((char*)lines.data(), num_word * sizeof(uint64_t));
+        return (bool)fin;
+}
+
+} /* namespace sbwt */
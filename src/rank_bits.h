@@ -0,0 +1,76 @@
+#ifndef SBWT_RANK_BITS_H
+#define SBWT_RANK_BITS_H
+
+#include <stdint.h>
+
+#include <istream>
+#include <ostream>
+#include <vector>
+
+namespace sbwt {
+
+/**
+ * Bits with rank in lines of 64 bytes: the number of ones before the line,
+ * then kLineBits bits. Rank1 reads one line; there is always a line past
+ * the last bit.
+ */
+class RankBits {
+public:
+        static const uint32_t kLineWords = 8;
+        static const uint32_t kLineBits = (kLineWords - 1) * 64;
+
+        RankBits(): lines(kLineWords, 0), size(0) { }
+
+        void PushBack(bool bit)
+        {
+                size_t beg = lines.size() - kLineWords;
+                uint32_t r = size % kLineBits;
+                lines[beg + 1 + r / 64] |= (uint64_t)bit << (r % 64);
+                if (++size % kLineBits == 0) {
+                        uint64_t ones = lines[beg] + CountLine(beg);
+                        lines.resize(lines.size() + kLineWords, 0);
+                        lines[beg + kLineWords] = ones;
+                }
+        }
+        bool Get(uint64_t i) const
+        {
+                const uint32_t r = i % kLineBits;
+                return (lines[i / kLineBits * kLineWords + 1 + r / 64] >> (r % 64)) & 1;
+        }
+        /// The ones among the first i bits
+        uint64_t Rank1(uint64_t i) const
+        {
+                const uint64_t *line = &lines[i / kLineBits * kLineWords];
+                const uint32_t r = i % kLineBits;
+                uint64_t ones = line[0];
+                uint32_t w = 0;
+                for (; w != r / 64; ++w) {
+                        ones += __builtin_popcountll(line[1 + w]);
+                }
+                if (r % 64) {
+                        ones += __builtin_popcountll(line[1 + w] << (64 - r % 64));
+                }
+                return ones;
+        }
+        uint64_t Size() const { return size; }
+        uint64_t Bytes() const { return lines.size() * sizeof(uint64_t); }
+
+        bool Save(std::ostream&) const;
+        bool Load(std::istream&);
+
+private:
+        uint64_t CountLine(size_t beg) const
+        {
+                uint64_t ones = 0;
+                for (uint32_t w = 1; w != kLineWords; ++w) {
+                        ones += __builtin_popcountll(lines[beg + w]);
+                }
+                return ones;
+        }
+
+        std::vector<uint64_t> lines;
+        uint64_t size;
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_RANK_BITS_H */
@@ -0,0 +1,135 @@
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "run_length_index.h"
+#include "io_build_index.h"
+
+namespace sbwt {
+
+template <typename TOffset>
+RunLengthIndex<TOffset>::RunLengthIndex(TOffset len, uint32_t per):
+        length(len),
+        period(per),
+        num_row(0),
+        last(-1),
+        last_sa(0)
+{
+}
+
+template <typename TOffset>
+void RunLengthIndex<TOffset>::Append(char c, TOffset sa)
+{
+        int a = -1;
+        switch (c) {
+                case 'A': a = 0; break;
+                case 'C': a = 1; break;
+                case 'G': a = 2; break;
+                case 'T': a = 3; break;
+                default: break;
+        }
+        /// A $ ends the run before it and is one of its own
+        bool is_head = num_row == 0 || a != last || a < 0;
+        if (num_row > 0 && is_head) {
+                tails.push_back(std::make_pair(Key(last_sa), sa));
+        }
+        if (a >= 0) {
+                if (is_head) {
+                        head[a].push_back(num_row);
+                        before[a].push_back(before[a].empty() ? 0 : before[a].back());
+                        head_sa[a].push_back(sa);
+                }
+                /// before[a].back() counts the a's so far until Finish
+                ++before[a].back();
+        }
+        last = a;
+        last_sa = sa;
+        ++num_row;
+}
+
+template <typename TOffset>
+void RunLengthIndex<TOffset>::Finish()
+{
+        /// before[a][k] is the count up to the end of run k so far: shift
+        /// it to the count before run k, the total last
+        for (uint32_t a = 0; a != 4; ++a) {
+                before[a].insert(before[a].begin(), 0);
+        }
+        std::sort(tails.begin(), tails.end());
+        tail_key.resize(tails.size());
+        tail_next.resize(tails.size());
+        for (size_t k = 0; k < tails.size(); ++k) {
+                tail_key[k] = tails[k].first;
+                tail_next[k] = tails[k].second;
+        }
+        std::vector<std::pair<TOffset, TOffset> >().swap(tails);
+}
+
+template <typename TOffset>
+uint64_t RunLengthIndex<TOffset>::Bytes() const
+{
+        uint64_t bytes = (tail_key.size() + tail_next.size()) * sizeof(TOffset);
+        for (uint32_t a = 0; a != 4; ++a) {
+                bytes += (head[a].size() + before[a].size() + head_sa[a].size()) * sizeof(TOffset);
+        }
+        return bytes;
+}
+
+/// The length and the period, for every base the number of its runs and
+/// their heads, counts before (and the total) and SA, then the tails
+template <typename TOffset>
+bool RunLengthIndex<TOffset>::Save(std::ostream &fout) const
+{
+        uint64_t length64 = length;
+        WriteArray(fout, &length64, 1);
+        WriteArray(fout, &period, 1);
+        for (uint32_t a = 0; a != 4; ++a) {
+                uint64_t num_run = head[a].size();
+                WriteArray(fout, &num_run, 1);
+                WriteArray(fout, head[a].data(), num_run);
+                WriteArray(fout, before[a].data(), num_run + 1);
+                WriteArray(fout, head_sa[a].data(), num_run);
+        }
+        uint64_t num_tail = tail_key.size();
+        WriteArray(fout, &num_tail, 1);
+        WriteArray(fout, tail_key.data(), num_tail);
+        WriteArray(fout, tail_next.data(), num_tail);
+        return (bool)fout;
+}
+
+template <typename TOffset>
+bool RunLengthIndex<TOffset>::Load(std::istream &fin)
+{
+        uint64_t length64 = 0;
+        fin.read((char*)&length64, sizeof(length64));
+        fin.read((char*)&period, sizeof(period));
+        if (!fin || period == 0) {
+                return false;
+        }
+        length = length64;
+        auto ReadVector = [&fin](std::vector<TOffset> &vec, uint64_t size) -> bool {
+                vec.resize(size);
+                fin.read((char*)vec.data(), size * sizeof(TOffset));
+                return (bool)fin;
+        };
+        for (uint32_t a = 0; a != 4; ++a) {
+                uint64_t num_run = 0;
+                fin.read((char*)&num_run, sizeof(num_run));
+                if (!fin || num_run > length64
+                    || !ReadVector(head[a], num_run)
+                    || !ReadVector(before[a], num_run + 1)
+                    || !ReadVector(head_sa[a], num_run)) {
+                        return false;
+                }
+        }
+        uint64_t num_tail = 0;
+        fin.read((char*)&num_tail, sizeof(num_tail));
+        return fin && num_tail <= length64
+               && ReadVector(tail_key, num_tail)
+               && ReadVector(tail_next, num_tail);
+}
+
+template class RunLengthIndex<uint32_t>;
+template class RunLengthIndex<uint64_t>;
+
+} /* namespace sbwt */
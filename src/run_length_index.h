@@ -0,0 +1,113 @@
+#ifndef SBWT_RUN_LENGTH_INDEX_H
+#define SBWT_RUN_LENGTH_INDEX_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace sbwt {
+
+/**
+ * The spaced BWT run-length encoded, with SA sampled at the ends of the
+ * runs (r-index style) instead of stored in full: its size goes with the
+ * number r of runs, not with the length, which is what a collection of
+ * near-identical genomes has few of.
+ *
+ * The runs of every base are kept apart: the row of their head, the number
+ * of the base before them and SA at the head. Occ(a, i) is a binary search
+ * of the heads of a. Every $ of the BWT is a run of its own.
+ *
+ * Locating works on the toehold SA[L] of the backward search: a step by a
+ * moves L to the first a at L or after, i.e. to LF(L) if BWT[L] is a, SA
+ * going down by p, and to the LF of the head of the next run of a
+ * otherwise. The range is then walked down with SA[i + 1] = Next(SA[i]):
+ * within a run LF keeps rows i and i + 1 adjacent, so Next(t) = Next(t - p)
+ * + p down to the last row of a run, where SA of the next row is sampled.
+ * The spaced LF steps p back in the reference, so the walk stays in the
+ * residue class of t mod p, and the tails are searched by class.
+ */
+template <typename TOffset>
+class RunLengthIndex {
+public:
+        RunLengthIndex(): length(0), period(1), num_row(0), last(-1), last_sa(0) { }
+        /// An empty index for a BWT of length characters, to Append to
+        RunLengthIndex(TOffset length, uint32_t period);
+
+        /// Occ(a, i): the occurrences of base a in BWT[0, i]
+        TOffset Rank(uint32_t a, TOffset i) const
+        {
+                const std::vector<TOffset> &h = head[a];
+                size_t k = std::upper_bound(h.begin(), h.end(), i) - h.begin();
+                if (k == 0) {
+                        return 0;
+                }
+                --k;
+                const TOffset run = before[a][k + 1] - before[a][k];
+                const TOffset into = i - h[k];
+                return before[a][k] + (into < run ? into + 1 : run);
+        }
+
+        /// SA of the row C[a], the first one starting with a
+        TOffset First(uint32_t a) const
+        {
+                return head_sa[a].empty() ? 0 : head_sa[a][0] - period;
+        }
+        /// SA of the row the backward search moves L to by a, sa being SA[L]
+        TOffset Step(uint32_t a, TOffset L, TOffset sa) const
+        {
+                const std::vector<TOffset> &h = head[a];
+                size_t k = std::upper_bound(h.begin(), h.end(), L) - h.begin();
+                if (k != 0 && L - h[k - 1] < before[a][k] - before[a][k - 1]) {
+                        /* BWT[L] is a */
+                        return sa - period;
+                }
+                return k < h.size() ? head_sa[a][k] - period : 0;
+        }
+        /// SA[i + 1] from t = SA[i], for every row i but the last one
+        TOffset Next(TOffset t) const
+        {
+                const TOffset key = Key(t);
+                size_t k = std::upper_bound(tail_key.begin(), tail_key.end(), key) - tail_key.begin();
+                if (k == 0) {
+                        return 0;
+                }
+                --k;
+                return tail_next[k] + (key - tail_key[k]) * period;
+        }
+
+        /// Give the BWT character c of the next row and its SA, in order
+        void Append(char c, TOffset sa);
+        /// Close the runs once the last row is given
+        void Finish();
+
+        /// The runs of the BWT, the $s included
+        uint64_t NumRun() const { return tail_key.size() + 1; }
+        uint64_t Bytes() const;
+        bool Save(std::ostream&) const;
+        bool Load(std::istream&);
+
+private:
+        /// Order of the tails: by residue class, then by position
+        TOffset Key(TOffset t) const { return t % period * (length / period) + t / period; }
+
+        TOffset length;
+        uint32_t period;
+        std::vector<TOffset> head[4];           /* row of the head of every run of a base */
+        std::vector<TOffset> before[4];         /* the base before every run, then its total */
+        std::vector<TOffset> head_sa[4];        /* SA at the head of every run */
+        std::vector<TOffset> tail_key;          /* Key of SA at the last row of every run, sorted */
+        std::vector<TOffset> tail_next;         /* SA of the row after it */
+
+        /// State of Append
+        TOffset num_row;
+        int last;                               /* base of the last row, -1 for a $ */
+        TOffset last_sa;
+        std::vector<std::pair<TOffset, TOffset> > tails;
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_RUN_LENGTH_INDEX_H */
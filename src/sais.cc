@@ -0,0 +1,177 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "sais.h"
+
+namespace sbwt {
+
+using std::vector;
+
+
+/// Suffix types, one bit each: S-type (1) or L-type (0).
+template <typename TIndex>
+class SuffixTypes {
+public:
+        static const TIndex kEmpty = ~(TIndex)0;
+
+        explicit SuffixTypes(TIndex n): bits((n + 63) / 64, 0) { }
+        bool Get(TIndex i) const { return (bits[i >> 6] >> (i & 63)) & 1; }
+        void Set(TIndex i, bool b)
+        {
+                if (b) {
+                        bits[i >> 6] |= (uint64_t)1 << (i & 63);
+                } else {
+                        bits[i >> 6] &= ~((uint64_t)1 << (i & 63));
+                }
+        }
+        /// Leftmost S-type: i is S-type and i-1 is L-type.
+        bool IsLms(TIndex i) const { return i > 0 && i != kEmpty && Get(i) && !Get(i - 1); }
+private:
+        vector<uint64_t> bits;
+};
+
+/// Start (end == false) or end of every bucket.
+template <typename TChar, typename TIndex>
+static void GetBuckets(const TChar *s, TIndex n, vector<TIndex> &bkt, bool end)
+{
+        std::fill(bkt.begin(), bkt.end(), 0);
+        for (TIndex i = 0; i < n; ++i) {
+                ++bkt[s[i]];
+        }
+        TIndex sum = 0;
+        for (size_t c = 0; c < bkt.size(); ++c) {
+                sum += bkt[c];
+                bkt[c] = end ? sum : sum - bkt[c];
+        }
+}
+
+/// Induce the L-type suffixes from left to right, then the S-type ones from
+/// right to left.
+template <typename TChar, typename TIndex>
+static void InduceSa(const TChar *s, TIndex *SA, TIndex n,
+                     const SuffixTypes<TIndex> &t, vector<TIndex> &bkt)
+{
+        const TIndex kEmpty = SuffixTypes<TIndex>::kEmpty;
+        GetBuckets(s, n, bkt, false);
+        for (TIndex i = 0; i < n; ++i) {
+                TIndex j = SA[i];
+                if (j != kEmpty && j > 0 && !t.Get(j - 1)) {
+                        SA[bkt[s[j - 1]]++] = j - 1;
+                }
+        }
+        GetBuckets(s, n, bkt, true);
+        for (TIndex i = n; i-- > 0; ) {
+                TIndex j = SA[i];
+                if (j != kEmpty && j > 0 && t.Get(j - 1)) {
+                        SA[--bkt[s[j - 1]]] = j - 1;
+                }
+        }
+}
+
+template <typename TChar, typename TIndex>
+void SaIs(const TChar *s, TIndex *SA, TIndex n, TIndex K)
+{
+        const TIndex kEmpty = SuffixTypes<TIndex>::kEmpty;
+        if (n == 0) {
+                return;
+        }
+        if (n == 1) {
+                SA[0] = 0;
+                return;
+        }
+
+        /// Classify the suffixes
+        SuffixTypes<TIndex> t(n);
+        t.Set(n - 1, true);
+        t.Set(n - 2, false);
+        for (TIndex i = n - 2; i-- > 0; ) {
+                t.Set(i, s[i] < s[i + 1] || (s[i] == s[i + 1] && t.Get(i + 1)));
+        }
+
+        /// Stage 1: sort the LMS substrings
+        vector<TIndex> bkt(K);
+        GetBuckets(s, n, bkt, true);
+        std::fill(SA, SA + n, kEmpty);
+        for (TIndex i = 1; i < n; ++i) {
+                if (t.IsLms(i)) {
+                        SA[--bkt[s[i]]] = i;
+                }
+        }
+        InduceSa(s, SA, n, t, bkt);
+
+        /// Compact the sorted LMS substrings into SA[0, n1)
+        TIndex n1 = 0;
+        for (TIndex i = 0; i < n; ++i) {
+                if (t.IsLms(SA[i])) {
+                        SA[n1++] = SA[i];
+                }
+        }
+
+        /// Name the LMS substrings; no two LMS positions are adjacent, so the
+        /// name of position pos goes to SA[n1 + pos/2]
+        std::fill(SA + n1, SA + n, kEmpty);
+        TIndex name = 0, prev = kEmpty;
+        for (TIndex i = 0; i < n1; ++i) {
+                TIndex pos = SA[i];
+                bool diff = false;
+                for (TIndex d = 0; d < n; ++d) {
+                        if (prev == kEmpty
+                            || s[pos + d] != s[prev + d]
+                            || t.Get(pos + d) != t.Get(prev + d)) {
+                                diff = true;
+                                break;
+                        } else if (d > 0 && (t.IsLms(pos + d) || t.IsLms(prev + d))) {
+                                break;
+                        }
+                }
+                if (diff) {
+                        ++name;
+                        prev = pos;
+                }
+                SA[n1 + pos / 2] = name - 1;
+        }
+        for (TIndex i = n, j = n; i-- > n1; ) {
+                if (SA[i] != kEmpty) {
+                        SA[--j] = SA[i];
+                }
+        }
+
+        /// Stage 2: sort the reduced string, recursing unless the names are unique
+        TIndex *s1 = SA + n - n1;
+        TIndex *SA1 = SA;
+        if (name < n1) {
+                SaIs<TIndex, TIndex>(s1, SA1, n1, name);
+        } else {
+                for (TIndex i = 0; i < n1; ++i) {
+                        SA1[s1[i]] = i;
+                }
+        }
+
+        /// Stage 3: induce the full order from the sorted LMS suffixes
+        GetBuckets(s, n, bkt, true);
+        for (TIndex i = 1, j = 0; i < n; ++i) {
+                if (t.IsLms(i)) {
+                        s1[j++] = i;
+                }
+        }
+        for (TIndex i = 0; i < n1; ++i) {
+                SA1[i] = s1[SA1[i]];
+        }
+        std::fill(SA + n1, SA + n, kEmpty);
+        for (TIndex i = n1; i-- > 0; ) {
+                TIndex j = SA[i];
+                SA[i] = kEmpty;
+                SA[--bkt[s[j]]] = j;
+        }
+        InduceSa(s, SA, n, t, bkt);
+}
+
+template void SaIs<uint8_t, uint32_t>(const uint8_t*, uint32_t*, uint32_t, uint32_t);
+template void SaIs<uint32_t, uint32_t>(const uint32_t*, uint32_t*, uint32_t, uint32_t);
+template void SaIs<uint8_t, uint64_t>(const uint8_t*, uint64_t*, uint64_t, uint64_t);
+template void SaIs<uint32_t, uint64_t>(const uint32_t*, uint64_t*, uint64_t, uint64_t);
+template void SaIs<uint64_t, uint64_t>(const uint64_t*, uint64_t*, uint64_t, uint64_t);
+
+} /* namespace sbwt */
@@ -0,0 +1,24 @@
+#ifndef SBWT_SAIS_H
+#define SBWT_SAIS_H
+
+#include <stdint.h>
+
+namespace sbwt {
+
+/**
+ * Suffix array by induced sorting (SA-IS, Nong, Zhang & Chan 2009).
+ *
+ * s:   text of length n over the alphabet [0, K). Its last character must be
+ *      0 and 0 must not occur anywhere else (the sentinel).
+ * SA:  output, n entries of TIndex (uint32_t, or uint64_t for n >= 4G).
+ *
+ * Linear time; besides SA it needs n bits for the suffix types and K words
+ * for the buckets per level of recursion. Instantiated for uint8_t and
+ * uint32_t characters with either index, and for uint64_t characters (the
+ * recursion of the 64-bit one).
+ */
+template <typename TChar, typename TIndex>
+void SaIs(const TChar *s, TIndex *SA, TIndex n, TIndex K);
+
+} /* namespace sbwt */
+#endif /* SBWT_SAIS_H */
@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <limits>
+
+#include "sampled_occ.h"
+#include "io_build_index.h"
+
+namespace sbwt {
+
+template <typename TOffset>
+bool SampledOcc<TOffset>::Load(std::istream &fin, TOffset length)
+{
+        num_block = NumBlock(length);
+        delete[] buffer;
+        buffer = new uint8_t[num_block * sizeof(Block) + kBlockBytes];
+        blocks = (Block*)(((uintptr_t)buffer + kBlockBytes - 1) & ~(uintptr_t)(kBlockBytes - 1));
+        fin.read((char*)blocks, num_block * sizeof(Block));
+
+        uint64_t num_other = 0;
+        fin.read((char*)&num_other, sizeof(num_other));
+        if (!fin || num_other > length) {
+                return false;
+        }
+        other.resize(num_other + 1);
+        fin.read((char*)other.data(), num_other * sizeof(TOffset));
+        other[num_other] = std::numeric_limits<TOffset>::max();
+        return (bool)fin;
+}
+
+template <typename TOffset>
+SampledOccWriter<TOffset>::SampledOccWriter(std::ostream &out):
+        fout(out),
+        length(0)
+{
+        memset(&block, 0, sizeof(block));
+}
+
+template <typename TOffset>
+void SampledOccWriter<TOffset>::Append(char c)
+{
+        const uint32_t kBlockChars = SampledOcc<TOffset>::kBlockChars;
+        uint32_t r = length % kBlockChars;
+        uint64_t code = 0;
+        switch (c) {
+                case 'A': code = 0; break;
+                case 'C': code = 1; break;
+                case 'G': code = 2; break;
+                case 'T': code = 3; break;
+                default: other.push_back(length); break;
+        }
+        block.bwt[r / 32] |= code << (2 * (r % 32));
+        ++length;
+        if (r + 1 == kBlockChars) {
+                /// The next block starts from the counts of this one
+                Block next;
+                memset(&next, 0, sizeof(next));
+                for (uint32_t a = 0; a != 4; ++a) {
+                        next.count[a] = block.count[a];
+                }
+                for (uint32_t k = 0; k != kBlockChars; ++k) {
+                        uint32_t a = (block.bwt[k / 32] >> (2 * (k % 32))) & 3;
+                        ++next.count[a];
+                }
+                /// The others of the block were packed as A
+                TOffset beg = length - kBlockChars;
+                for (auto it = other.rbegin(); it != other.rend() && *it >= beg; ++it) {
+                        --next.count[0];
+                }
+                WriteArray(fout, &block, 1);
+                block = next;
+        }
+}
+
+template <typename TOffset>
+bool SampledOccWriter<TOffset>::Finish()
+{
+        WriteArray(fout, &block, 1);
+        uint64_t num_other = other.size();
+        WriteArray(fout, &num_other, 1);
+        WriteArray(fout, other.data(), other.size());
+        return (bool)fout;
+}
+
+template class SampledOcc<uint32_t>;
+template class SampledOcc<uint64_t>;
+template class SampledOccWriter<uint32_t>;
+template class SampledOccWriter<uint64_t>;
+
+} /* namespace sbwt */
@@ -0,0 +1,115 @@
+#ifndef SBWT_SAMPLED_OCC_H
+#define SBWT_SAMPLED_OCC_H
+
+#include <stdint.h>
+
+#include <istream>
+#include <ostream>
+#include <vector>
+
+namespace sbwt {
+
+/**
+ * Occ sampled in cache lines: the BWT packed 2 bits per character (A=0,
+ * C=1, G=2, T=3, from the low bits), and in front of every kBlockChars of
+ * them the counts of A/C/G/T before them, in one 64-byte block. Occ(a, i)
+ * is the count of its block plus a masked popcount of the characters of
+ * the block up to i: one cache line per rank, where the four full columns
+ * take 4 * sizeof(TOffset) bytes per character.
+ *
+ * The other characters of the BWT (the $s) are packed as A, and their
+ * positions kept aside: the counts of a block tell how many come before
+ * it, so Occ of A only looks at the ones in its block.
+ */
+template <typename TOffset>
+class SampledOcc {
+public:
+        static const uint32_t kBlockBytes = 64;
+        static const uint32_t kBlockWords = (kBlockBytes - 4 * sizeof(TOffset)) / 8;
+        /// 192 characters a block with 32-bit offsets, 128 with 64-bit ones
+        static const uint32_t kBlockChars = kBlockWords * 32;
+        struct Block {
+                TOffset count[4];               /* A/C/G/T before the block */
+                uint64_t bwt[kBlockWords];
+        };
+
+        SampledOcc(): blocks(nullptr), num_block(0), buffer(nullptr) { }
+        ~SampledOcc() { delete[] buffer; }
+
+        /// Occ(a, i): the occurrences of base a in BWT[0, i]
+        TOffset Rank(uint32_t a, TOffset i) const
+        {
+                const Block &block = blocks[i / kBlockChars];
+                const uint32_t r = i % kBlockChars;
+                const uint64_t pattern = a * 0x5555555555555555ull;
+                TOffset occ = block.count[a];
+                uint32_t w = 0;
+                for (; w != r / 32; ++w) {
+                        occ += CountZeroCodes(block.bwt[w] ^ pattern);
+                }
+                occ += CountZeroCodes((block.bwt[w] ^ pattern) | (~0ull << 1 << (2 * (r % 32) + 1)));
+                if (a == 0) {
+                        /// The $s of the block up to i were counted as A
+                        TOffset beg = i - r;
+                        TOffset k = beg - (block.count[0] + block.count[1] + block.count[2] + block.count[3]);
+                        for (; other[k] <= i; ++k) {
+                                --occ;
+                        }
+                }
+                return occ;
+        }
+
+        /// The base of BWT[i], a $ read as A
+        uint32_t Access(TOffset i) const
+        {
+                const uint32_t r = i % kBlockChars;
+                return (blocks[i / kBlockChars].bwt[r / 32] >> (2 * (r % 32))) & 3;
+        }
+
+        /// Bytes of the blocks and of the other positions
+        uint64_t Bytes() const { return num_block * sizeof(Block) + other.size() * sizeof(TOffset); }
+        /// The section SampledOccWriter wrote for a BWT of length characters
+        bool Load(std::istream&, TOffset/*length*/);
+
+        static uint64_t NumBlock(TOffset length) { return (uint64_t)length / kBlockChars + 1; }
+
+private:
+        /// Characters coded 0 among the 32 of x
+        static uint32_t CountZeroCodes(uint64_t x)
+        {
+                return __builtin_popcountll(~(x | (x >> 1)) & 0x5555555555555555ull);
+        }
+
+        SampledOcc(const SampledOcc&);
+        SampledOcc &operator=(const SampledOcc&);
+
+        Block *blocks;                  /* 64-byte aligned in buffer */
+        uint64_t num_block;
+        uint8_t *buffer;
+        std::vector<TOffset> other;     /* positions of the other characters, then a sentinel */
+};
+
+/**
+ * Writer of the section of SampledOcc, from the BWT given character by
+ * character in order: the blocks as they fill up, then the number of the
+ * other characters and their positions.
+ */
+template <typename TOffset>
+class SampledOccWriter {
+public:
+        SampledOccWriter(std::ostream&);
+        void Append(char);
+        /// Write the last block and the other positions; false on an error
+        bool Finish();
+
+private:
+        typedef typename SampledOcc<TOffset>::Block Block;
+
+        std::ostream &fout;
+        Block block;
+        TOffset length;
+        std::vector<TOffset> other;
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_SAMPLED_OCC_H */
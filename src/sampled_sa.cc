@@ -0,0 +1,48 @@
+#include <stdint.h>
+
+#include "sampled_sa.h"
+#include "io_build_index.h"
+
+namespace sbwt {
+
+template <typename TOffset>
+SampledSa<TOffset>::SampledSa(uint32_t per, uint32_t r):
+        period(per),
+        rate(r)
+{
+}
+
+template <typename TOffset>
+bool SampledSa<TOffset>::Save(std::ostream &fout) const
+{
+        uint64_t num_sample = samples.size();
+        WriteArray(fout, &period, 1);
+        WriteArray(fout, &rate, 1);
+        marks.Save(fout);
+        WriteArray(fout, &num_sample, 1);
+        WriteArray(fout, samples.data(), num_sample);
+        return (bool)fout;
+}
+
+template <typename TOffset>
+bool SampledSa<TOffset>::Load(std::istream &fin)
+{
+        uint64_t num_sample = 0;
+        fin.read((char*)&period, sizeof(period));
+        fin.read((char*)&rate, sizeof(rate));
+        if (!fin || period == 0 || rate == 0 || !marks.Load(fin)) {
+                return false;
+        }
+        fin.read((char*)&num_sample, sizeof(num_sample));
+        if (!fin || num_sample > marks.Size()) {
+                return false;
+        }
+        samples.resize(num_sample);
+        fin.read((char*)samples.data(), num_sample * sizeof(TOffset));
+        return (bool)fin;
+}
+
+template class SampledSa<uint32_t>;
+template class SampledSa<uint64_t>;
+
+} /* namespace sbwt */
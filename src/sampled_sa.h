@@ -0,0 +1,67 @@
+#ifndef SBWT_SAMPLED_SA_H
+#define SBWT_SAMPLED_SA_H
+
+#include <stdint.h>
+
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "rank_bits.h"
+
+namespace sbwt {
+
+/**
+ * SA sampled at every rate-th position of the reference: the rows whose
+ * SA t has t / p a multiple of rate are marked in a bit vector, and their
+ * SA kept in row order, Rank1 of the mark giving its place. The rows whose
+ * BWT character is not a base (the $s) are kept too.
+ *
+ * Any other row is located by walking LF: the spaced LF steps p back in
+ * the reference, so at most rate - 1 steps reach a marked row, and SA is
+ * its sample plus p a step. The samples take sizeof(TOffset) / rate bytes
+ * a character and the marks 1/7 more than a bit, against sizeof(TOffset)
+ * for SA in full.
+ */
+template <typename TOffset>
+class SampledSa {
+public:
+        SampledSa(): period(1), rate(1) { }
+        SampledSa(uint32_t period, uint32_t rate);
+
+        /// SA of row i if it is sampled
+        bool Find(TOffset i, TOffset &sa) const
+        {
+                if (!marks.Get(i)) {
+                        return false;
+                }
+                sa = samples[marks.Rank1(i)];
+                return true;
+        }
+
+        /// Give the BWT character c of the next row and its SA, in order
+        void Append(char c, TOffset sa)
+        {
+                bool is_base = c == 'A' || c == 'C' || c == 'G' || c == 'T';
+                bool is_sampled = !is_base || sa / period % rate == 0;
+                marks.PushBack(is_sampled);
+                if (is_sampled) {
+                        samples.push_back(sa);
+                }
+        }
+
+        uint64_t NumSample() const { return samples.size(); }
+        uint64_t Bytes() const { return marks.Bytes() + samples.size() * sizeof(TOffset); }
+        /// The period and the rate, the marks, then the samples
+        bool Save(std::ostream&) const;
+        bool Load(std::istream&);
+
+private:
+        uint32_t period;
+        uint32_t rate;
+        RankBits marks;                 /* rows sampled */
+        std::vector<TOffset> samples;   /* SA of the marked rows, in order */
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_SAMPLED_SA_H */
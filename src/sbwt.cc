@@ -1,18 +1,23 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <bitset>
 #include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
+#include <stdexcept>
 #include <memory>
 #include <iomanip>
 #include <vector>
 #include <string>
-#include <unordered_map>
 
 #include "sbwt.h"
 #include "log.h"
@@ -21,21 +26,45 @@
 #include "word_io.h"
 #include "sequence_pack.h"
 #include "utility.h"
+#include "thread_pool.h"
+#include "sais.h"
+#include "io_build_index.h"
+#include "packed_reference.h"
+#include "sampled_occ.h"
+#include "wavelet_occ.h"
+#include "run_length_index.h"
+#include "sampled_sa.h"
+#include "packed_sa.h"
+#include "checkpoint.h"
+#include "build_report.h"
 
 namespace sbwt {
 using std::vector;
-using std::unordered_map;
 using namespace utility;
 
-BuildIndexRawData::BuildIndexRawData():
+template <typename TOffset>
+BasicIndexRawData<TOffset>::BasicIndexRawData():
 	seq_raw(nullptr),
-	seq_transformed(nullptr),
 	occurrence(nullptr),
+        occ_sampled(nullptr),
+        occ_wavelet(nullptr),
+        run_length(nullptr),
+        sa_sampled(nullptr),
+        sa_packed(nullptr),
 	suffix_array(nullptr),
 	length_ref(0),
 	num_block_sort(4),
 	num_dollar(2),
-	period(2)
+	period(2),
+	num_threads(1),
+	is_ref_shared(false),
+        occ_format(kOccFull),
+        sa_sample_rate(1),
+        is_sa_packed(false),
+        bin_8bit(nullptr),
+        size_bin_8bit(0),
+        checkpoint(nullptr),
+        report(nullptr)
 {
 	for (int i = 0; i < 4; ++i) {
 		first_column[i] = 0;
@@ -43,117 +72,130 @@ BuildIndexRawData::BuildIndexRawData():
 }
 
 
-BuildIndexRawData::BuildIndexRawData(char *file_name, const uint32_t &per, const uint32_t &nb):
+template <typename TOffset>
+BasicIndexRawData<TOffset>::BasicIndexRawData(char *file_name, const uint32_t &per, const uint32_t &nb):
         seq_raw(nullptr),
+        occurrence(nullptr),
+        occ_sampled(nullptr),
+        occ_wavelet(nullptr),
+        run_length(nullptr),
+        sa_sampled(nullptr),
+        sa_packed(nullptr),
+        suffix_array(nullptr),
+        num_threads(1),
+        is_ref_shared(false),
+        occ_format(kOccFull),
+        sa_sample_rate(1),
+        is_sa_packed(false),
         bin_8bit(nullptr),
-        size_bin_8bit(0)
+        size_bin_8bit(0),
+        checkpoint(nullptr),
+        report(nullptr)
 {
         period = per;
         num_block_sort = nb;
 
-        uint32_t read_length = 0;
-
-        /// Read raw sequence file in fasta format
-        char *buffer = nullptr;
-        {
-                uint32_t string_length;
-		FILE *handler = fopen(file_name, "r");
-
-		if (!handler) {
-                        logger::LogError("failure to open");
-		}
-                fseek(handler, 0, SEEK_END);    /* Seek the last byte */
-                string_length = ftell(handler); /* Calculate the offset from head to tail */
-                rewind(handler);                /* Back to the head */
-
-                //buffer = (char *) malloc(sizeof(char) * (string_length + 1));
-                buffer = new char[sizeof(char) * (string_length + 1)];
-                read_length = fread(buffer, sizeof(char), string_length, handler);
-
-                buffer[string_length] = '\0';
-
-                if (read_length != string_length) {
-                        delete []buffer;
-                        logger::LogDebug("Errors in fread");
-                        return;
-                }
+        /// Stream the FASTA file into a 2-bit packed reference, then
+        /// unpack it once into seq_raw: the file is never held in memory
+        PackedReference ref;
+        if (!ReadFastaPacked(file_name, ref)) {
+                LOGERROR("Cannot read " << file_name);
+                throw std::runtime_error("BasicIndexRawData");
         }
+        AllocateSequence(ref.Length());
+        ref.UnpackAndRelease(seq_raw);
+        AppendDollars();
+}
 
-        /// Extract pure DNA nucleotides (A/C/G/T)
-        {
-                uint32_t total_num = 0;
-                char *ptr = buffer;
-                for (uint32_t i = 0; i < read_length; ++i) {
-                        if (IsDNA(*ptr)) {
-                                ++total_num;
-                        }
-                        ++ptr;
-                }
-
-                /// enough memory for $s and "boarder case"
-                /// And the period must be less than 1024
-                /// In case the boarder of sequence array will be reached.
-                uint32_t n_alloc = ((total_num/1024)+4)*1024;
-                seq_raw = new char[n_alloc]();
-                //for (uint32_t i = 0; i != n_alloc; ++i) { seq_raw[i] = 0; }
-
-                char *ptr0 = seq_raw;
-                ptr = buffer;
-                for (uint32_t i = 0; i < read_length; ++i) {
-                        if (IsDNA(*ptr)) {
-                                *ptr0 = *ptr;
-                                ++ptr0;
-                        }
-                        ++ptr;
-                }
+template <typename TOffset>
+BasicIndexRawData<TOffset>::BasicIndexRawData(const PackedReference &ref, const uint32_t &per, const uint32_t &nb):
+        seq_raw(nullptr),
+        occurrence(nullptr),
+        occ_sampled(nullptr),
+        occ_wavelet(nullptr),
+        run_length(nullptr),
+        sa_sampled(nullptr),
+        sa_packed(nullptr),
+        suffix_array(nullptr),
+        num_block_sort(nb),
+        period(per),
+        num_threads(1),
+        is_ref_shared(false),
+        occ_format(kOccFull),
+        sa_sample_rate(1),
+        is_sa_packed(false),
+        bin_8bit(nullptr),
+        size_bin_8bit(0),
+        checkpoint(nullptr),
+        report(nullptr)
+{
+        AllocateSequence(ref.Length());
+        ref.Unpack(seq_raw);
+        AppendDollars();
+}
 
-                length_ref = total_num;
+template <typename TOffset>
+void BasicIndexRawData<TOffset>::AllocateSequence(uint64_t total_num)
+{
+        /// the $s take up to 2*period more, and the period is at most 1024
+        if (total_num + 2 * 1024 > std::numeric_limits<TOffset>::max()) {
+                LOGERROR("Reference of " << total_num << " characters is too long for "
+                         << sizeof(TOffset) * 8 << "-bit offsets");
+                throw std::length_error("BasicIndexRawData");
         }
 
-        /// Init
-        {
-                if (period > 1024) {
-                        period = 1024;
-                        logger::LogError("The period must be less than 1024.");
-                }
-
-		num_dollar = period - (length_ref % period);
-                if (length_ref % period) {
-                        num_dollar += period;
-                }
-		length_ref += num_dollar;
-
-		for (uint32_t i = 0; i < num_dollar; ++i) {
-			seq_raw[length_ref-i-1] = '$';
-		}
-
-		for (int i = 0; i < 4; ++i) { first_column[i] = 0; }
+        /// enough memory for $s and "boarder case"
+        /// And the period must be less than 1024
+        /// In case the boarder of sequence array will be reached.
+        size_t n_alloc = ((total_num/1024)+4)*1024;
+        seq_raw = new char[n_alloc]();
+        length_ref = total_num;
+}
 
-		occurrence = new uint32_t*[4];
-		for (int i = 0; i != 4; ++i)
-		{
-			occurrence[i] = new uint32_t[length_ref]();
-			occurrence[i][0] = 0;
-		}
+template <typename TOffset>
+void BasicIndexRawData<TOffset>::AppendDollars()
+{
+        if (period > 1024) {
+                period = 1024;
+                logger::LogError("The period must be less than 1024.");
+        }
 
-		seq_transformed = new char[length_ref];
+        num_dollar = period - (length_ref % period);
+        if (length_ref % period) {
+                num_dollar += period;
+        }
+        length_ref += num_dollar;
 
-		suffix_array = new uint32_t[length_ref];
-		/* initialize suffix_array with 0,1,...,N-1 */
-		for (size_t i = 0; i != length_ref; ++i) suffix_array[i] = i;
+        for (uint32_t i = 0; i < num_dollar; ++i) {
+                seq_raw[length_ref-i-1] = '$';
         }
 
-        delete[] buffer;
+        for (int i = 0; i < 4; ++i) { first_column[i] = 0; }
 }
 
 
-BuildIndexRawData::BuildIndexRawData (char *seq_dna, size_t n, const uint32_t &per = 2, const uint32_t &nb = 4):
+template <typename TOffset>
+BasicIndexRawData<TOffset>::BasicIndexRawData (char *seq_dna, size_t n, const uint32_t &per, const uint32_t &nb):
 	seq_raw(seq_dna),
+        occurrence(nullptr),
+        occ_sampled(nullptr),
+        occ_wavelet(nullptr),
+        run_length(nullptr),
+        sa_sampled(nullptr),
+        sa_packed(nullptr),
+        suffix_array(nullptr),
         length_ref(n),
         num_block_sort(nb),
         period(per),
+        num_threads(1),
+        is_ref_shared(false),
+        occ_format(kOccFull),
+        sa_sample_rate(1),
+        is_sa_packed(false),
         bin_8bit(nullptr),
-        size_bin_8bit(0)
+        size_bin_8bit(0),
+        checkpoint(nullptr),
+        report(nullptr)
 {
 
         if (period > 1024) {
@@ -179,22 +221,28 @@ BuildIndexRawData::BuildIndexRawData (char *seq_dna, size_t n, const uint32_t &p
 
 	for (int i = 0; i < 4; ++i) { first_column[i] = 0; }
 
-	occurrence = new uint32_t*[4];
-	for (int i = 0; i != 4; ++i)
-	{
-		occurrence[i] = new uint32_t[length_ref]();
-		occurrence[i][0] = 0;
-	}
-
-	seq_transformed = new char[length_ref];
-
-	suffix_array = new uint32_t[length_ref];
-	/* initialize suffix_array with 0,1,...,N-1 */
-	for (size_t i = 0; i != length_ref; ++i) suffix_array[i] = i;
-
 }
 
-BuildIndexRawData::BuildIndexRawData(const string &prefix_filename)
+template <typename TOffset>
+BasicIndexRawData<TOffset>::BasicIndexRawData(const string &prefix_filename, bool is_arrays):
+        seq_raw(nullptr),
+        occurrence(nullptr),
+        occ_sampled(nullptr),
+        occ_wavelet(nullptr),
+        run_length(nullptr),
+        sa_sampled(nullptr),
+        sa_packed(nullptr),
+        suffix_array(nullptr),
+        length_ref(0),
+        num_threads(1),
+        is_ref_shared(false),
+        occ_format(kOccFull),
+        sa_sample_rate(1),
+        is_sa_packed(false),
+        bin_8bit(nullptr),
+        size_bin_8bit(0),
+        checkpoint(nullptr),
+        report(nullptr)
 {
 
         string file_array_filename = prefix_filename + ".array.sbwt";
@@ -225,6 +273,40 @@ BuildIndexRawData::BuildIndexRawData(const string &prefix_filename)
                 first_column[i] = readU32(meta_fin, is_big_endian);
         }
 
+        /// The trailer of versioned meta files: the width of the offsets
+        /// and the 64-bit lengths; files without one are 32-bit
+        uint32_t offset_bits = 32;
+        uint32_t version = readU32(meta_fin, is_big_endian);
+        if (meta_fin && version >= 2) {
+                offset_bits = readU32(meta_fin, is_big_endian);
+                length_ref = readU64(meta_fin, is_big_endian);
+                size_bin_8bit = readU64(meta_fin, is_big_endian);
+                for (int i = 0; i != 4; ++i) {
+                        first_column[i] = readU64(meta_fin, is_big_endian);
+                }
+        }
+        if (meta_fin && version >= 3) {
+                uint32_t flags = readU32(meta_fin, is_big_endian);
+                is_ref_shared = flags & kIndexFlagSharedRef;
+                is_sa_packed = flags & kIndexFlagPackedSa;
+                occ_format = flags & kIndexFlagRunLength ? kOccRunLength
+                             : flags & kIndexFlagWaveletOcc ? kOccWavelet
+                             : flags & kIndexFlagSampledOcc ? kOccSampled : kOccFull;
+        }
+        if (meta_fin && version >= 4) {
+                sa_sample_rate = readU32(meta_fin, is_big_endian);
+        }
+        if (offset_bits != sizeof(TOffset) * 8) {
+                LOGERROR("Index files " << prefix_filename << " have " << offset_bits
+                         << "-bit offsets, " << sizeof(TOffset) * 8 << "-bit expected");
+                length_ref = 0;
+                return;
+        }
+        auto ReadOffset = [&array_fin, is_big_endian]() -> TOffset {
+                return sizeof(TOffset) == 8 ? readU64(array_fin, is_big_endian)
+                                            : readU32(array_fin, is_big_endian);
+        };
+
         /**
          * Array and sequence
          */
@@ -241,39 +323,120 @@ BuildIndexRawData::BuildIndexRawData(const string &prefix_filename)
         }
 #endif
 
-        /// 8-bit version
-        /// Watch out for the boarder
-        bin_8bit = new uint8_t[(size_bin_8bit * 4) + 1024];
-        array_fin.read((char*) bin_8bit, size_bin_8bit*4);
+        if (is_ref_shared) {
+                /// The sequence is in the reference shared by the periods,
+                /// "fa.ref.sbwt" for the index files "fa.period": unpack it
+                /// and pack the four 8-bit copies as the builder did
+                string prefix_ref = prefix_filename;
+                string suffix_period = "." + std::to_string(period);
+                if (prefix_ref.size() > suffix_period.size()
+                    && prefix_ref.compare(prefix_ref.size() - suffix_period.size(), string::npos, suffix_period) == 0) {
+                        prefix_ref.resize(prefix_ref.size() - suffix_period.size());
+                }
+                string file_ref_filename = ReferenceFilename(prefix_ref);
+                std::ifstream ref_fin(file_ref_filename.c_str(), std::ios_base::in | ios::binary);
+                PackedReference ref;
+                if (!ref_fin.is_open() || !ref.Load(ref_fin) || ref.Length() + num_dollar != length_ref) {
+                        LOGERROR("Cannot read the reference of " << prefix_filename << ": " << file_ref_filename);
+                        length_ref = 0;
+                        return;
+                }
+                AllocateSequence(ref.Length());
+                ref.Unpack(seq_raw);
+                for (uint32_t i = 0; i < num_dollar; ++i) {
+                        seq_raw[length_ref++] = '$';
+                }
 
-        /// The raw sequence
-        /// TODO map directly the memory to files
-        seq_raw = new char[length_ref];
-        array_fin.read(seq_raw, length_ref);
+                if (is_arrays) {
+                        bin_8bit = new uint8_t[(size_bin_8bit * 4) + 1024];
+                        for (int i = 0; i != 4; ++i) {
+                                sbwtio::BaseChar2Binary8B(seq_raw + i, size_bin_8bit, bin_8bit + i * size_bin_8bit);
+                        }
+                }
+        } else if (!is_arrays) {
+                /// The raw sequence only, after the packed one
+                array_fin.seekg(size_bin_8bit * 4, ios::cur);
+                seq_raw = new char[length_ref];
+                array_fin.read(seq_raw, length_ref);
+        } else {
+                /// 8-bit version
+                /// Watch out for the boarder
+                bin_8bit = new uint8_t[(size_bin_8bit * 4) + 1024];
+                array_fin.read((char*) bin_8bit, size_bin_8bit*4);
+
+                /// The raw sequence
+                /// TODO map directly the memory to files
+                seq_raw = new char[length_ref];
+                array_fin.read(seq_raw, length_ref);
+        }
+        if (!is_arrays) {
+                if (!array_fin) {
+                        LOGERROR("Cannot read the sequence of " << prefix_filename);
+                        length_ref = 0;
+                }
+                return;
+        }
 
-        seq_transformed = nullptr;
-        //seq_transformed = new char[length_ref];
-        //array_fin.read(seq_transformed, length_ref);
 
         /// Occurrence
-        occurrence = new uint32_t*[4];
-        for (int i = 0; i != 4; ++i) {
-                occurrence[i] = new uint32_t[length_ref];
-                uint32_t *beg = occurrence[i];
-                uint32_t *end = beg+length_ref;
+        if (occ_format == kOccFull) {
+                occurrence = new TOffset*[4];
+                for (int i = 0; i != 4; ++i) {
+                        occurrence[i] = new TOffset[length_ref];
+                        TOffset *beg = occurrence[i];
+                        TOffset *end = beg+length_ref;
+                        while (beg != end) {
+                                *beg = ReadOffset();
+                                ++beg;
+                        }
+                }
+        }
+
+        /// suffix array, sampled at the runs of the BWT in their place, or
+        /// every few positions at the end, or bit-packed
+        bool is_sa_sampled = sa_sample_rate > 1;
+        if (occ_format == kOccRunLength) {
+                run_length = new RunLengthIndex<TOffset>();
+                if (!run_length->Load(array_fin)) {
+                        LOGERROR("Cannot read the run-length index of " << prefix_filename);
+                        length_ref = 0;
+                }
+        } else if (is_sa_packed) {
+                sa_packed = new PackedSa<TOffset>();
+                if (!sa_packed->Load(array_fin)) {
+                        LOGERROR("Cannot read the packed SA of " << prefix_filename);
+                        length_ref = 0;
+                }
+        } else if (!is_sa_sampled) {
+                suffix_array = new TOffset[length_ref];
+                TOffset *beg = suffix_array;
+                TOffset *end = suffix_array + length_ref;
                 while (beg != end) {
-                        *beg = readU32(array_fin, is_big_endian);
+                        *beg = ReadOffset();
                         ++beg;
                 }
         }
 
-        /// suffix array
-        suffix_array = new uint32_t[length_ref];
-        uint32_t *beg = suffix_array;
-        uint32_t *end = suffix_array + length_ref;
-        while (beg != end) {
-                *beg = readU32(array_fin, is_big_endian);
-                ++beg;
+        /// Occ sampled in cache lines or as a wavelet tree, after SA
+        if (occ_format == kOccSampled) {
+                occ_sampled = new SampledOcc<TOffset>();
+                if (!occ_sampled->Load(array_fin, length_ref)) {
+                        LOGERROR("Cannot read the sampled Occ of " << prefix_filename);
+                        length_ref = 0;
+                }
+        } else if (occ_format == kOccWavelet) {
+                occ_wavelet = new WaveletOcc<TOffset>();
+                if (!occ_wavelet->Load(array_fin)) {
+                        LOGERROR("Cannot read the wavelet tree Occ of " << prefix_filename);
+                        length_ref = 0;
+                }
+        }
+        if (is_sa_sampled) {
+                sa_sampled = new SampledSa<TOffset>();
+                if (!sa_sampled->Load(array_fin)) {
+                        LOGERROR("Cannot read the sampled SA of " << prefix_filename);
+                        length_ref = 0;
+                }
         }
 
         array_fin.close();
@@ -282,7 +445,36 @@ BuildIndexRawData::BuildIndexRawData(const string &prefix_filename)
 }
 
 
-BuildIndexRawData::~BuildIndexRawData()
+/// Allocate the arrays of the in-memory build, SA (as 0,1,...,N-1) and Occ,
+/// unless allocated already. The constructors
+/// only read the reference, so a build that streams its output (see
+/// BuildIndexExternal) never holds them.
+template <typename TOffset>
+void BasicIndexRawData<TOffset>::AllocateArrays()
+{
+        if (!seq_raw) return;
+
+        if (!occurrence) {
+                occurrence = new TOffset*[4];
+                for (int i = 0; i != 4; ++i) {
+                        occurrence[i] = new TOffset[length_ref]();
+                }
+                if (report) {
+                        report->AddBytes("occurrence", period, 4 * (uint64_t)length_ref * sizeof(TOffset));
+                }
+        }
+        if (!suffix_array) {
+                suffix_array = new TOffset[length_ref];
+                /* initialize suffix_array with 0,1,...,N-1 */
+                for (size_t i = 0; i != length_ref; ++i) suffix_array[i] = i;
+                if (report) {
+                        report->AddBytes("suffix-array", period, (uint64_t)length_ref * sizeof(TOffset));
+                }
+        }
+}
+
+template <typename TOffset>
+BasicIndexRawData<TOffset>::~BasicIndexRawData()
 {
 
         delete[] seq_raw;
@@ -293,10 +485,11 @@ BuildIndexRawData::~BuildIndexRawData()
 		for (int i = 0; i != 4; ++i) { if (occurrence[i]) delete[] occurrence[i]; }
 		delete[] occurrence;
         }
-
-	if (seq_transformed) {
-                delete[] seq_transformed;
-        }
+        delete occ_sampled;
+        delete occ_wavelet;
+        delete run_length;
+        delete sa_sampled;
+        delete sa_packed;
 
         if (bin_8bit) {
                 delete[] bin_8bit;
@@ -305,9 +498,10 @@ BuildIndexRawData::~BuildIndexRawData()
 
 
 /* Swap within array seq_index*/
-void VectorSwap(uint32_t i, uint32_t j, uint32_t n, uint32_t* seq_index)
+template <typename TOffset>
+void VectorSwap(TOffset i, TOffset j, TOffset n, TOffset* seq_index)
 {
-        uint32_t tmpval = 0;
+        TOffset tmpval = 0;
         while (n-- > 0) {
                 /* swap */
                 tmpval = seq_index[i];
@@ -319,49 +513,60 @@ void VectorSwap(uint32_t i, uint32_t j, uint32_t n, uint32_t* seq_index)
         }
 }
 
-void SortSbwt(
-	char *seq,
-        uint32_t *seq_index,
-	uint32_t begin,
-        uint32_t end,
-        uint32_t depth,
-	const uint32_t &length_ref,
-        const uint32_t &step
-        )
+/// Pivot source of the sorters. The state is per thread so that concurrent
+/// sorts neither race on nor perturb each other, and SeedSortRng() is called
+/// at the start of every parallel task so that the output does not depend on
+/// which thread picked the task up.
+static thread_local uint64_t sort_rng_state = 0x9E3779B97F4A7C15ULL;
+
+/// Character of a spaced suffix beyond the end of the reference. It sorts
+/// below '$', so a suffix that runs out is smaller than every suffix it is a
+/// prefix of, and suffixes that run out together are ordered by position.
+/// This makes the sbwt order a total order that every builder reproduces.
+static const char kPastEnd = '\0';
+
+void SeedSortRng(uint64_t seed)
 {
-	/* Condition of end */
-	if (begin+1 >= end || depth >= length_ref) return;
-
-        if (end - begin == 2) {
-                bool smaller = true;
-                uint32_t i1 = seq_index[begin],
-                         i2 = seq_index[begin+1];
-                for (uint32_t i = depth; i < length_ref; i+=step) {
-                        char c1 = i1+i >= length_ref ? '$' : seq[i1+i];
-                        char c2 = i2+i >= length_ref ? '$' : seq[i2+i];
-                        if (c1 == '$' || c2 == '$') {
-                                if (c1 != '$') {
-                                        smaller = false;
-                                }
-                                break;
-                        } else if (c1 != c2) {
-                                smaller = c1 < c2;
-                                break;
-                        }
-                }
-                if (!smaller) {
-                        seq_index[begin] = i2;
-                        seq_index[begin+1] = i1;
-                }
-                return;
+        sort_rng_state = (seed + 1) * 0x9E3779B97F4A7C15ULL;
+        if (sort_rng_state == 0) {
+                sort_rng_state = 1;
         }
+}
 
+/* xorshift64* */
+static inline uint64_t NextSortRng()
+{
+        uint64_t x = sort_rng_state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        sort_rng_state = x;
+        return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * One step of the ternary quicksort on the character at `depth`:
+ * afterwards [begin, lt_end) is smaller than the pivot, [lt_end, gt_begin)
+ * is equal and [gt_begin, end) is greater. Requires end - begin >= 2.
+ */
+template <typename TOffset>
+static void PartitionSbwt(
+	char *seq,
+        TOffset *seq_index,
+	TOffset begin,
+        TOffset end,
+        TOffset depth,
+	const TOffset &length_ref,
+        TOffset &lt_end,
+        TOffset &gt_begin
+        )
+{
 	int64_t a = 0, b = 0, c = 0,
 		d = 0, r = 0, v = 0,
 		distance = 0;
 	uint64_t tmpval = 0, tmpval1 = 0;
 	distance = end - begin;
-	a = (rand() % distance) + begin;
+	a = (NextSortRng() % distance) + begin;
 
 	/* swap begin with a */
 	tmpval = seq_index[begin];
@@ -369,8 +574,8 @@ void SortSbwt(
 	seq_index[a] = tmpval;
 
 	tmpval1 = seq_index[begin] + depth;
-	/* Guarantee that: seq[index] or '$' if index > length(seq) */
-	v = tmpval1 >= length_ref ? '$' : seq[tmpval1];
+	/* Guarantee that: seq[index] or kPastEnd if index >= length(seq) */
+	v = tmpval1 >= length_ref ? kPastEnd : seq[tmpval1];
 	a = b = begin + 1;
 	c = d = end - 1;
 
@@ -382,7 +587,7 @@ void SortSbwt(
                         if (b <= c)  {
                                 tmpval1 = seq_index[b];
                                 tmpval1 += depth;
-                                r = (tmpval1 >= size_ref64) ? '$' : seq[tmpval1];
+                                r = (tmpval1 >= size_ref64) ? kPastEnd : seq[tmpval1];
                                 r -= v;
                                 if (r > 0) {
                                         break;
@@ -406,7 +611,7 @@ void SortSbwt(
                         if (b <= c) {
                                 tmpval1 = seq_index[c];
                                 tmpval1 += depth;
-                                r = (tmpval1 >= size_ref64) ? '$' : seq[tmpval1];
+                                r = (tmpval1 >= size_ref64) ? kPastEnd : seq[tmpval1];
                                 r -= v;
                                 if (r < 0) {
                                         break;
@@ -430,7 +635,7 @@ void SortSbwt(
 
 #if 0
 		while ( b <= c &&
-			(tmpval1 = seq_index[b]+depth, r = (tmpval1 >= length_ref ? '$' : seq[tmpval1]) - v) <= 0
+			(tmpval1 = seq_index[b]+depth, r = (tmpval1 >= length_ref ? kPastEnd : seq[tmpval1]) - v) <= 0
 			) {
 			if (r == 0) {
 				/* swap a with b */
@@ -445,7 +650,7 @@ void SortSbwt(
 
 		while (
 			b <= c &&
-			(tmpval1 = seq_index[c]+depth, r = (tmpval1 >= length_ref ? '$' : seq[tmpval1]) - v) >= 0
+			(tmpval1 = seq_index[c]+depth, r = (tmpval1 >= length_ref ? kPastEnd : seq[tmpval1]) - v) >= 0
 			) {
 			if (r == 0) {
 				/* swap c with d */
@@ -470,34 +675,100 @@ void SortSbwt(
         int64_t t0 = a - begin;
         int64_t t1 = b - a;
         r = t0 < t1 ? t0 : t1;
-        VectorSwap(begin, b-r, r, seq_index);
+        VectorSwap<TOffset>(begin, b-r, r, seq_index);
 
         t0 = d - c;
         t1 = end - 1 - d;
         r = t0 < t1 ? t0 : t1;
-        VectorSwap(b, end-r, r, seq_index);
-        r = b - a + begin;
+        VectorSwap<TOffset>(b, end-r, r, seq_index);
+        lt_end = b - a + begin;
+        gt_begin = end - (d - c);
+}
 
-        SortSbwt(seq, seq_index, begin, r, depth, length_ref, step);
+/**
+ * Multikey quicksort of the spaced suffixes in seq_index[begin, end) that
+ * share their first depth/step characters. Iterative: the pending ranges go
+ * on an explicit stack, so neither long repeats (one level per shared
+ * character) nor unlucky pivots can overflow the call stack.
+ */
+template <typename TOffset>
+void SortSbwt(
+	char *seq,
+        TOffset *seq_index,
+	TOffset begin,
+        TOffset end,
+        TOffset depth,
+	const TOffset &length_ref,
+        const uint32_t &step
+        )
+{
+        struct Range {
+                TOffset begin, end, depth;
+        };
+        vector<Range> stack(1, Range{begin, end, depth});
 
-        tmpval = seq_index[r] + depth;
-        if (tmpval < length_ref) {
-                SortSbwt(seq, seq_index, r, end-d+c, depth+step, length_ref, step);
-        }
+        while (!stack.empty()) {
+                Range range = stack.back();
+                stack.pop_back();
+                begin = range.begin;
+                end = range.end;
+                depth = range.depth;
 
-        r = d - c;
-        SortSbwt(seq, seq_index, end-r, end, depth, length_ref, step);
+                /* Condition of end */
+                if (begin+1 >= end) continue;
+                if (depth >= length_ref) {
+                        /* all of them ran out: ties are ordered by position */
+                        std::sort(seq_index + begin, seq_index + end);
+                        continue;
+                }
+
+                if (end - begin == 2) {
+                        bool smaller = true;
+                        TOffset i1 = seq_index[begin],
+                                i2 = seq_index[begin+1];
+                        for (uint64_t i = depth; ; i+=step) {
+                                char c1 = i1+i >= length_ref ? kPastEnd : seq[i1+i];
+                                char c2 = i2+i >= length_ref ? kPastEnd : seq[i2+i];
+                                if (c1 != c2) {
+                                        smaller = c1 < c2;
+                                        break;
+                                } else if (c1 == kPastEnd) {
+                                        /* both run out here: a tie */
+                                        smaller = i1 < i2;
+                                        break;
+                                }
+                        }
+                        if (!smaller) {
+                                seq_index[begin] = i2;
+                                seq_index[begin+1] = i1;
+                        }
+                        continue;
+                }
+
+                TOffset lt_end = 0, gt_begin = 0;
+                PartitionSbwt<TOffset>(seq, seq_index, begin, end, depth, length_ref, lt_end, gt_begin);
+
+                stack.push_back(Range{begin, lt_end, depth});
+                if ((uint64_t)seq_index[lt_end] + depth < length_ref) {
+                        stack.push_back(Range{lt_end, gt_begin, depth+step});
+                } else {
+                        /* all of them ran out: ties are ordered by position */
+                        std::sort(seq_index + lt_end, seq_index + gt_begin);
+                }
+                stack.push_back(Range{gt_begin, end, depth});
+        }
 }
 
+        template <typename TOffset>
         void SortSbwt(
                         char *seq,
-                        uint32_t *seq_index,
-                        uint32_t begin,
-                        uint32_t end,
-                        uint32_t depth,
-                        const uint32_t &length_ref,
+                        TOffset *seq_index,
+                        TOffset begin,
+                        TOffset end,
+                        TOffset depth,
+                        const TOffset &length_ref,
                         const uint32_t &step,
-                        const uint32_t &length_limited
+                        const TOffset &length_limited
         )
         {
                 /* Condition of end */
@@ -505,19 +776,18 @@ void SortSbwt(
 
                 if (end - begin == 2) {
                         bool smaller = true;
-                        uint32_t i1 = seq_index[begin],
+                        TOffset i1 = seq_index[begin],
                                         i2 = seq_index[begin+1];
-                        for (uint32_t i = depth; i < length_ref; i+=step) {
-                                char c1 = i1+i >= length_ref ? '$' : seq[i1+i];
-                                char c2 = i2+i >= length_ref ? '$' : seq[i2+i];
-                                if (c1 == '$' || c2 == '$') {
-                                        if (c1 != '$') {
-                                                smaller = false;
-                                        }
-                                        break;
-                                } else if (c1 != c2) {
+                        for (uint64_t i = depth; ; i+=step) {
+                                char c1 = i1+i >= length_ref ? kPastEnd : seq[i1+i];
+                                char c2 = i2+i >= length_ref ? kPastEnd : seq[i2+i];
+                                if (c1 != c2) {
                                         smaller = c1 < c2;
                                         break;
+                                } else if (c1 == kPastEnd) {
+                                        /* both run out here: a tie */
+                                        smaller = i1 < i2;
+                                        break;
                                 }
                         }
                         if (!smaller) {
@@ -532,7 +802,7 @@ void SortSbwt(
                                 distance = 0;
                 uint64_t tmpval = 0, tmpval1 = 0;
                 distance = end - begin;
-                a = (rand() % distance) + begin;
+                a = (NextSortRng() % distance) + begin;
 
                 /* swap begin with a */
                 tmpval = seq_index[begin];
@@ -540,8 +810,8 @@ void SortSbwt(
                 seq_index[a] = tmpval;
 
                 tmpval1 = seq_index[begin] + depth;
-                /* Guarantee that: seq[index] or '$' if index > length(seq) */
-                v = tmpval1 >= length_ref ? '$' : seq[tmpval1];
+                /* Guarantee that: seq[index] or kPastEnd if index >= length(seq) */
+                v = tmpval1 >= length_ref ? kPastEnd : seq[tmpval1];
                 a = b = begin + 1;
                 c = d = end - 1;
 
@@ -553,7 +823,7 @@ void SortSbwt(
                                 if (b <= c)  {
                                         tmpval1 = seq_index[b];
                                         tmpval1 += depth;
-                                        r = (tmpval1 >= size_ref64) ? '$' : seq[tmpval1];
+                                        r = (tmpval1 >= size_ref64) ? kPastEnd : seq[tmpval1];
                                         r -= v;
                                         if (r > 0) {
                                                 break;
@@ -577,7 +847,7 @@ void SortSbwt(
                                 if (b <= c) {
                                         tmpval1 = seq_index[c];
                                         tmpval1 += depth;
-                                        r = (tmpval1 >= size_ref64) ? '$' : seq[tmpval1];
+                                        r = (tmpval1 >= size_ref64) ? kPastEnd : seq[tmpval1];
                                         r -= v;
                                         if (r < 0) {
                                                 break;
@@ -601,7 +871,7 @@ void SortSbwt(
 
 #if 0
                         while ( b <= c &&
-			(tmpval1 = seq_index[b]+depth, r = (tmpval1 >= length_ref ? '$' : seq[tmpval1]) - v) <= 0
+			(tmpval1 = seq_index[b]+depth, r = (tmpval1 >= length_ref ? kPastEnd : seq[tmpval1]) - v) <= 0
 			) {
 			if (r == 0) {
 				/* swap a with b */
@@ -616,7 +886,7 @@ void SortSbwt(
 
 		while (
 			b <= c &&
-			(tmpval1 = seq_index[c]+depth, r = (tmpval1 >= length_ref ? '$' : seq[tmpval1]) - v) >= 0
+			(tmpval1 = seq_index[c]+depth, r = (tmpval1 >= length_ref ? kPastEnd : seq[tmpval1]) - v) >= 0
 			) {
 			if (r == 0) {
 				/* swap c with d */
@@ -641,163 +911,178 @@ void SortSbwt(
                 int64_t t0 = a - begin;
                 int64_t t1 = b - a;
                 r = t0 < t1 ? t0 : t1;
-                VectorSwap(begin, b-r, r, seq_index);
+                VectorSwap<TOffset>(begin, b-r, r, seq_index);
 
                 t0 = d - c;
                 t1 = end - 1 - d;
                 r = t0 < t1 ? t0 : t1;
-                VectorSwap(b, end-r, r, seq_index);
+                VectorSwap<TOffset>(b, end-r, r, seq_index);
                 r = b - a + begin;
 
-                SortSbwt(seq, seq_index, begin, r, depth, length_ref, step);
+                SortSbwt<TOffset>(seq, seq_index, begin, r, depth, length_ref, step);
 
                 tmpval = seq_index[r] + depth;
                 if (tmpval < length_ref) {
-                        SortSbwt(seq, seq_index, r, end-d+c, depth+step, length_ref, step);
+                        SortSbwt<TOffset>(seq, seq_index, r, end-d+c, depth+step, length_ref, step);
                 }
 
                 r = d - c;
-                SortSbwt(seq, seq_index, end-r, end, depth, length_ref, step);
+                SortSbwt<TOffset>(seq, seq_index, end-r, end, depth, length_ref, step);
         }
-void SortSbwt(BuildIndexRawData &build_index)
+template <typename TOffset>
+void SortSbwt(BasicIndexRawData<TOffset> &build_index)
 {
-        return SortSbwt(build_index.seq_raw,
+        return SortSbwt<TOffset>(build_index.seq_raw,
                         build_index.suffix_array,
                         0, build_index.length_ref,
                         0, build_index.length_ref,
                         build_index.period);
 }
 
-void Transform(BuildIndexRawData &build_index)
+/// Character before suffix t0 in the spaced BWT, i.e. the one p positions
+/// before it, wrapping around the end of the reference
+template <typename TOffset>
+static inline char SpacedBwtChar(const char *seq, TOffset N, uint32_t period, TOffset t0)
 {
-        if (!build_index.seq_transformed) {
-                logger::LogDebug("seq_transformed is empty.");
-                return;
-        }
-        uint32_t tmpval = 0;
-        auto sa = build_index.suffix_array;
-        auto seq = build_index.seq_transformed;
-        for (size_t i = 0; i != build_index.length_ref; ++i) {
-                tmpval = *sa;
-                if (tmpval < build_index.period) {
-                        /// Bug here. Feb-02
-                        //*seq = '$';
-                        *seq = build_index.seq_raw[tmpval + build_index.length_ref - build_index.period];
-                } else {
-                        *seq = build_index.seq_raw[tmpval - build_index.period];
-                }
-                ++sa;
-                ++seq;
-        }
+        return t0 < period ? seq[t0 + N - period] : seq[t0 - period];
 }
 
-void CountOccurrence(BuildIndexRawData &build_index)
+/// Suffixes per task of TransformCountOccurrence
+static const uint64_t kOccChunkSize = 1u << 16;
+/// The gathers of the BWT are prefetched this many SA entries ahead
+static const uint32_t kBwtPrefetchDistance = 32;
+
+/**Spaced BWT and Occ in one pass, without materialising the BWT.
+ *
+ * SA is split into chunks across build_index.num_threads threads. Each one
+ * gathers the BWT characters of its chunk (prefetching ahead, the gather is
+ * random over the reference), writes Occ counted from the start of the chunk
+ * and keeps the chunk's base counts. A prefix sum over the chunks then gives
+ * the count before every chunk, added to its Occ in a second, streaming pass,
+ * and C.
+ */
+template <typename TOffset>
+void TransformCountOccurrence(BasicIndexRawData<TOffset> &build_index)
 {
-        auto N = build_index.length_ref;
-        auto B = build_index.seq_transformed;
-        auto O = build_index.occurrence;
-        auto C = &build_index.first_column[0];
-        
-        if (!B) return;
-        switch (B[0]) {
-                case 'A':
-                        O[0][0] = 1;
-                        ++C[0];
-                        break;
-                case 'C':
-                        O[1][0] = 1;
-                        ++C[1];
-                        break;
-                case 'G':
-                        O[2][0] = 1;
-                        ++C[2];
-                        break;
-                case 'T':
-                        O[3][0] = 1;
-                        break;
-                default:
-                        break;
-        }
+        const char *seq = build_index.seq_raw;
+        const TOffset *SA = build_index.suffix_array;
+        TOffset **O = build_index.occurrence;
+        const TOffset N = build_index.length_ref;
+        const uint32_t period = build_index.period;
+        if (!seq || !SA || !O) return;
+        ReportPhase phase(build_index.report, "transform-count-occurrence", period);
+
+        const uint64_t num_chunk = (N + kOccChunkSize - 1) / kOccChunkSize;
+        vector<TOffset> count(4 * (num_chunk + 1), 0);
+        try {
+                ThreadPool pool(build_index.num_threads);
+                for (uint64_t c = 0; c < num_chunk; ++c) {
+                        pool.Submit([&, c]() {
+                                const TOffset beg = c * kOccChunkSize;
+                                const TOffset end = std::min<uint64_t>(N, beg + kOccChunkSize);
+                                TOffset occ[4] = {0, 0, 0, 0};
+                                for (TOffset i = beg; i < end; ++i) {
+                                        if (i + kBwtPrefetchDistance < end) {
+                                                TOffset t1 = SA[i + kBwtPrefetchDistance];
+                                                __builtin_prefetch(seq + (t1 < period ? t1 + N - period : t1 - period));
+                                        }
+                                        switch (SpacedBwtChar(seq, N, period, SA[i])) {
+                                                case 'A': ++occ[0]; break;
+                                                case 'C': ++occ[1]; break;
+                                                case 'G': ++occ[2]; break;
+                                                case 'T': ++occ[3]; break;
+                                                default: break;
+                                        }
+                                        O[0][i] = occ[0];
+                                        O[1][i] = occ[1];
+                                        O[2][i] = occ[2];
+                                        O[3][i] = occ[3];
+                                }
+                                for (int b = 0; b < 4; ++b) {
+                                        count[4 * (c + 1) + b] = occ[b];
+                                }
+                        });
+                }
+                pool.Wait();
 
-        for (size_t i = 1; i < N; ++i) {
-        switch (B[i]) {
-                case 'A':
-                        SNIPPET_COUNTOCC();
-                        ++C[0];
-                        O[0][i] = O[0][i-1] + 1;
-                        break;
-                case 'C':
-                        SNIPPET_COUNTOCC();
-                        ++C[1];
-                        O[1][i] = O[1][i-1] + 1;
-                        break;
-                case 'G':
-                        SNIPPET_COUNTOCC();
-                        ++C[2];
-                        O[2][i] = O[2][i-1] + 1;
-                        break;
-                case 'T':
-                        SNIPPET_COUNTOCC();
-                        O[3][i] = O[3][i-1] + 1;
-                        break;
-                default:
-                        SNIPPET_COUNTOCC();
-                        break;
+                /// count[4c + b]: occurrences of base b before chunk c
+                for (uint64_t c = 1; c <= num_chunk; ++c) {
+                        for (int b = 0; b < 4; ++b) {
+                                count[4 * c + b] += count[4 * (c - 1) + b];
+                        }
+                }
+                for (uint64_t c = 1; c < num_chunk; ++c) {
+                        pool.Submit([&, c]() {
+                                const TOffset beg = c * kOccChunkSize;
+                                const TOffset end = std::min<uint64_t>(N, beg + kOccChunkSize);
+                                for (int b = 0; b < 4; ++b) {
+                                        const TOffset base = count[4 * c + b];
+                                        for (TOffset i = beg; i < end; ++i) {
+                                                O[b][i] += base;
+                                        }
+                                }
+                        });
                 }
+                pool.Wait();
+        } catch (...) {
+                LOGERROR("TransformCountOccurrence");
+                throw;
         }
-        C[0] += build_index.num_dollar;
-        C[3] = C[0] + C[1] + C[2];
-        C[2] = C[0] + C[1];
-        C[1] = C[0];
-        C[0] = build_index.num_dollar;
 
+        const TOffset *total = &count[4 * num_chunk];
+        TOffset *C = &build_index.first_column[0];
+        C[0] = build_index.num_dollar;
+        C[1] = C[0] + total[0];
+        C[2] = C[1] + total[1];
+        C[3] = C[2] + total[2];
 }
 
-void BuildIndex(BuildIndexRawData &build_index) {
+template <typename TOffset>
+void BuildIndex(BasicIndexRawData<TOffset> &build_index) {
+        build_index.AllocateArrays();
         if (build_index.suffix_array && build_index.seq_raw) {
                 SortSbwt(build_index);
-                Transform(build_index);
-                CountOccurrence(build_index);
+                TransformCountOccurrence(build_index);
         }
 }
 
 
-void BuildSortedIndexBlockwise(BuildIndexRawData &build_index)
+template <typename TOffset>
+void BuildSortedIndexBlockwise(BasicIndexRawData<TOffset> &build_index)
 {
+        build_index.AllocateArrays();
          if (build_index.suffix_array && build_index.seq_raw) {
                 LOGINFO("Sort sbwt block-wise...\n")
                 SortSbwtBlockwise(build_index);
                 LOGINFO("SortSbwtBlockwise done\n");
         }
 }
-void BuildSortedIndexTransCountOcc(BuildIndexRawData &build_index)
+template <typename TOffset>
+void BuildSortedIndexTransCountOcc(BasicIndexRawData<TOffset> &build_index)
 {         if (build_index.suffix_array && build_index.seq_raw) {
-                LOGINFO("Transform...\t");
-                Transform(build_index);
-                LOGPUT("Done\n");
-                LOGINFO("CountOccurrence...\t");
-                CountOccurrence(build_index);
+                LOGINFO("Transform and CountOccurrence...\t");
+                TransformCountOccurrence(build_index);
                 LOGPUT("Done\n");
         }
 
 }
 
 
-void BuildIndexBlockwise(BuildIndexRawData &build_index) {
+template <typename TOffset>
+void BuildIndexBlockwise(BasicIndexRawData<TOffset> &build_index) {
+        build_index.AllocateArrays();
         if (build_index.suffix_array && build_index.seq_raw) {
                 LOGINFO("Sort sbwt block-wise...\n")
                 SortSbwtBlockwise(build_index);
                 LOGINFO("SortSbwtBlockwise done\n");
-                LOGINFO("Transform...\t");
-                Transform(build_index);
-                LOGPUT("Done\n");
-                LOGINFO("CountOccurrence...\t");
-                CountOccurrence(build_index);
+                LOGINFO("Transform and CountOccurrence...\t");
+                TransformCountOccurrence(build_index);
                 LOGPUT("Done\n");
         }
 }
 
-void PrintFullSearchMatrix(BuildIndexRawData &build_index)
+template <typename TOffset>
+void PrintFullSearchMatrix(BasicIndexRawData<TOffset> &build_index)
 {
         using std::endl;
         using std::cout;
@@ -806,7 +1091,6 @@ void PrintFullSearchMatrix(BuildIndexRawData &build_index)
         auto SA = build_index.suffix_array;
         auto X = build_index.seq_raw;
         auto N = build_index.length_ref;
-        auto B = build_index.seq_transformed;
         auto O = build_index.occurrence;
         auto C = &build_index.first_column[0];
         auto T = build_index.period;
@@ -838,8 +1122,8 @@ void PrintFullSearchMatrix(BuildIndexRawData &build_index)
 
         if (build_index.bin_8bit) {
                 for (int k = 0; k != 4; ++k) {
-                        uint32_t lmd_i = (k+1)*build_index.size_bin_8bit;
-                        for (uint32_t i = k*build_index.size_bin_8bit; i != lmd_i; ++i) {
+                        TOffset lmd_i = (k+1)*build_index.size_bin_8bit;
+                        for (TOffset i = k*build_index.size_bin_8bit; i != lmd_i; ++i) {
                                 cout << bitset<8>(build_index.bin_8bit[i]) << " ";
                         } cout << endl;
                 }
@@ -849,7 +1133,7 @@ void PrintFullSearchMatrix(BuildIndexRawData &build_index)
         const int print_width = 10;
         cout << "\t\t";
         std::cout.fill(' ');
-        for (uint32_t i = 0; i != N; ++i) {
+        for (TOffset i = 0; i != N; ++i) {
                 if (i % print_width == 0) {
                         std::cout.width(print_width);
                         cout << std::left << i;
@@ -858,7 +1142,7 @@ void PrintFullSearchMatrix(BuildIndexRawData &build_index)
 
         for (size_t i = 0; i != N; ++i) {
                 cout << i << "\t" << SA[i] <<"\t";
-                uint32_t j = 0;
+                TOffset j = 0;
                 for (j = 0; j <= N-1; ++j) {
                         //if (j && j%print_width == 0) cout << "\t";
                         if (j + SA[i] >= N) {
@@ -874,16 +1158,14 @@ void PrintFullSearchMatrix(BuildIndexRawData &build_index)
                 } cout << endl;
         }
         cout << "\nspaced BWT:\n";
-        if (B!= nullptr) {
-                for (uint32_t i = 0; i != N-1; ++i) { cout << B[i] << ","; }
-                cout << B[N-1] << "\n";
-        }
+        for (TOffset i = 0; i != N-1; ++i) { cout << SpacedBwtChar(X, N, T, SA[i]) << ","; }
+        cout << SpacedBwtChar(X, N, T, SA[N-1]) << "\n";
 
         cout << "Occ\nA\tC\tG\tT\n";
         for (int i = 0; i != 4; ++i)
                 cout << C[i] << "\t";
         cout << "\nOcc\nindex\tA\tC\tG\tT\n";
-        for (uint32_t i = 0; i != N; ++i) {
+        for (TOffset i = 0; i != N; ++i) {
                 cout << i << "\t";
                 for (int j = 0; j != 4; ++j)
                         cout << O[j][i] << "\t";
@@ -953,122 +1235,1283 @@ void PrintFullSearchMatrix(uint32_t *SA, char *X, uint32_t N, uint32_t period)
 }
 
 
-/**Build sbwt index blockwise for large genomes such homo, however the max length
- * should be less than 4G. Otherwise, you should split the reference into muliple
- * partation.
- */
-/// TODO The way to build index of huge reference. Distribution system?
-void SortSbwtBlockwise(BuildIndexRawData &build_index)
+/// The length k of the spaced k-mers of the radix pass is chosen so that an
+/// average bucket (N / 4^k suffixes, 4 bytes each) fits in a typical L2
+/// cache. The histograms take 4^k words per thread, hence the cap.
+static const uint32_t kRadixBucketSize = 1u << 15;
+static const uint32_t kRadixMaxK = 10;
+
+static uint32_t ChooseRadixK(uint64_t length_ref)
 {
-	char *seq = build_index.seq_raw;
-        uint32_t *seq_index = build_index.suffix_array;
-        const uint32_t &length_ref = build_index.length_ref;
-        const uint32_t &num_block_sort = build_index.num_block_sort;
-        uint32_t N = length_ref;
-        const uint32_t &period = build_index.period;
+        uint32_t k = 1;
+        while (k < kRadixMaxK && ((uint64_t)length_ref >> (2 * k)) > kRadixBucketSize) {
+                ++k;
+        }
+        return k;
+}
 
-        /// Firstly, split the sequence rotation matrix into 4^num_block blocks
-        LOGINFO("Firstly, split the sequence rotation matrix into 4^"<< num_block_sort << " blocks\n");
-        try {
-                SortSbwtBlockwise( seq, seq_index, 0, N, 0, length_ref, period, num_block_sort );
-        } catch (...) {
-                LOGERROR("SortSbwtBlockwise");
-                throw;
+/// A/C/G/T to 0/1/2/3, i.e. in lexicographic order
+static inline uint32_t RadixCode(char ch)
+{
+        return ((ch >> 1) & 3) ^ ((ch >> 2) & 1);
+}
+
+/**
+ * Run f(i, key) for every position i in [begin, end), in descending order,
+ * where key is the spaced k-mer X[i] X[i+p] ... X[i+(k-1)p] packed with the
+ * first character in the most significant bits. The keys are rolled along
+ * the residue classes, key(i) = X[i] : key(i+p) without its last character,
+ * with a ring of the last p keys, so X is read sequentially. The k-mers of
+ * [begin, end) must not reach the '$'s.
+ */
+template <typename TOffset, typename TFunc>
+static void ForEachRadixKey(const char *X, TOffset N, uint32_t p, uint32_t k,
+                            TOffset begin, TOffset end, TFunc f)
+{
+        vector<uint32_t> ring(p, 0);
+        uint32_t shift = 2 * (k - 1);
+        uint64_t warm = (uint64_t)end + (uint64_t)(k - 1) * p;
+        TOffset i = warm < N ? (TOffset)warm : N;
+        uint32_t r = i % p;
+        while (i > begin) {
+                --i;
+                r = r == 0 ? p - 1 : r - 1;
+                uint32_t key = (RadixCode(X[i]) << shift) | (ring[r] >> 2);
+                ring[r] = key;
+                if (i < end) {
+                        f(i, key);
+                }
         }
+}
 
-        {
-                /**
-                 * Splitting blocks:
-                 * The segments in range [beg0, end0) share with same
-                 * spaced prefix (length: num_block_sort * period).
-                 * Those blocks sharing with same prefix are sorted
-                 * again according to their suffixes.
-                 */
-                LOGINFO("Splitting blocks...\n");
-                vector<char> tmpcv(num_block_sort, '\0');
-                uint32_t j = 0;
-                uint32_t t0 = 0;
-                bool flg;
-                uint32_t beg0 = 0, end0 = 1;
-                for (j = 0; j < num_block_sort; ++j) {
-                       tmpcv[j] = seq[(j*period+seq_index[0])%N];
-                }
-                for (uint32_t i = 1; i < N; ++i) {
-                        flg = true;
-                        for (j = 0; j < num_block_sort; ++j) {
-                                t0 = (j*period+seq_index[i]) % N;
-                                if (seq[t0] != tmpcv[j] && flg) {
-                                        flg = false;
-                                }
-                                tmpcv[j] = seq[t0];
-                        }
-                        if (!flg) {
-                                end0 = i;
-                                if (end0 > 1 + beg0) {
-                                        try {
-                                                LOGINFO("Sort block in [" << beg0 << ",\t" << end0 << ")...\t");
-                                                SortSbwt(seq, seq_index, beg0, end0, num_block_sort*period, N, period);
-                                                LOGPUT("Done\n");
-                                        } catch (...) {
-                                                LOGERROR("[" << beg0 << ",\t" << end0 << ")\n");
-                                                throw;
-                                        }
+/// First suffix whose k-mer (k = num_block_sort) reaches the '$'s
+template <typename TOffset>
+static TOffset RadixDirtyBegin(const BasicIndexRawData<TOffset> &build_index)
+{
+        int64_t tmp_begin = (int64_t)build_index.length_ref - build_index.num_dollar
+                            - (int64_t)(build_index.num_block_sort - 1) * build_index.period;
+        return tmp_begin > 0 ? (TOffset)tmp_begin : 0;
+}
 
-                                }
-                                beg0 = i;
+template <typename TOffset>
+static inline TOffset RadixSliceBegin(TOffset dirty_begin, uint32_t s, uint32_t num_slice)
+{
+        return dirty_begin / num_slice * s + dirty_begin % num_slice * s / num_slice;
+}
+
+/// Histograms of the k-mers of the clean suffixes [0, dirty_begin), one per
+/// thread of pool and slice of the reference, counted in parallel.
+template <typename TOffset>
+static void HistogramRadixKeys(ThreadPool &pool, const char *seq, TOffset N,
+                               uint32_t period, uint32_t k, TOffset dirty_begin,
+                               vector<vector<TOffset> > &hist)
+{
+        const uint32_t num_slice = pool.Size();
+        hist.assign(num_slice, vector<TOffset>());
+        for (uint32_t s = 0; s < num_slice; ++s) {
+                pool.Submit([&, s]() {
+                        vector<TOffset> &h = hist[s];
+                        h.assign(1u << (2 * k), 0);
+                        ForEachRadixKey<TOffset>(seq, N, period, k,
+                                        RadixSliceBegin(dirty_begin, s, num_slice),
+                                        RadixSliceBegin(dirty_begin, s + 1, num_slice),
+                                        [&h](TOffset, uint32_t key) { ++h[key]; });
+                });
+        }
+        pool.Wait();
+}
+
+/// Sort the dirty suffixes [dirty_begin, N), whose k-mers reach the '$'s,
+/// and count them per bucket: the one of their prefix before the first '$'
+/// padded with A's.
+template <typename TOffset>
+static void SortDirtySuffixes(char *seq, TOffset N, uint32_t period, uint32_t k,
+                              TOffset dirty_begin, vector<TOffset> &dirty,
+                              vector<TOffset> &count_dirty)
+{
+        for (TOffset i = dirty_begin; i < N; ++i) {
+                dirty.push_back(i);
+        }
+        SeedSortRng(0);
+        SortSbwt<TOffset>(seq, dirty.data(), 0, dirty.size(), 0, N, period);
+        for (auto i : dirty) {
+                uint32_t key = 0, j = 0;
+                for (; j < k; ++j) {
+                        uint64_t t0 = (uint64_t)i + (uint64_t)j * period;
+                        if (t0 >= N || seq[t0] == '$') {
+                                break;
                         }
+                        key = (key << 2) | RadixCode(seq[t0]);
                 }
-                /// tail
-                LOGINFO("Tail case...\t");
-                if (N > 1 + beg0) {
-                        try {
-                                SortSbwt(seq, seq_index, beg0, N, num_block_sort*period, N, period);
-                        } catch (...) {
-                                LOGERROR("SortSbwt");
-                                throw;
-                        }
+                ++count_dirty[key << (2 * (k - j))];
+        }
+}
+
+/// Rounds a checkpointed sort is journaled in
+static const uint32_t kCheckpointRounds = 256;
 
+/// The whole suffix array from the checkpoint, once its sort is journaled
+template <typename TOffset>
+static bool ResumeSuffixArray(BasicIndexRawData<TOffset> &build_index)
+{
+        BuildCheckpoint<TOffset> *checkpoint = build_index.checkpoint;
+        TOffset *SA = build_index.suffix_array;
+        const TOffset N = build_index.length_ref;
+        if (!checkpoint || !checkpoint->IsDone("suffix-array")) {
+                return false;
+        }
+        if (checkpoint->LoadSorted(SA, 0, N)) {
+                /// a permutation of [0, N)
+                vector<bool> seen(N, false);
+                TOffset i = 0;
+                for (; i < N && !seen[SA[i]]; ++i) {
+                        seen[SA[i]] = true;
+                }
+                if (i == N) {
+                        LOGINFO("Suffix array from the checkpoint\n");
+                        return true;
                 }
-                LOGPUT("Done\n");
         }
+        LOGINFO("Suffix array of the checkpoint is corrupt, sorting again\n");
+        return false;
 }
 
-void SortSbwtBlockwise(
-	char *seq,                      /* sequence */
-        uint32_t *seq_index,            /* suffix array */
-	uint32_t begin,
-        uint32_t end,
-        uint32_t depth,
-	const uint32_t &length_ref,
-        const uint32_t &step,           /* a.k.a period*/
-        const uint32_t &num_block
-        )
+/// Whether a and b hold the same n suffixes, as far as a checksum tells
+template <typename TOffset>
+static bool SameSuffixes(const TOffset *a, const TOffset *b, TOffset n)
 {
-	/* Condition of end */
-        ///Bug: depth >= num_block
-	if (depth >= step*num_block /* Condition for blockwise-building */|| begin+1 >= end || depth >= length_ref) return;
-
-	int64_t a = 0, b = 0, c = 0,
-		d = 0, r = 0, v = 0,
-		distance = 0;
-	uint32_t tmpval = 0, tmpval1 = 0;
-	distance = end - begin;
-	a = (rand() % distance) + begin;
+        uint64_t sum_a = 0, sum_b = 0, xor_a = 0, xor_b = 0;
+        for (TOffset i = 0; i < n; ++i) {
+                sum_a += a[i];
+                sum_b += b[i];
+                xor_a ^= (uint64_t)a[i] * 0x9E3779B97F4A7C15ull;
+                xor_b ^= (uint64_t)b[i] * 0x9E3779B97F4A7C15ull;
+        }
+        return sum_a == sum_b && xor_a == xor_b;
+}
 
-	/* swap begin with a */
-	tmpval = seq_index[begin];
-	seq_index[begin] = seq_index[a];
+/**
+ * SortSbwtBlocks in rounds of consecutive blocks, each a range of SA of at
+ * least N/kCheckpointRounds suffixes (with the dirty and single ones between
+ * the blocks), saved in the checkpoint once sorted. A resumed build loads the
+ * rounds journaled already instead of sorting them, if they hold the
+ * suffixes the radix pass put there.
+ */
+template <typename TOffset>
+static void SortSbwtRounds(BasicIndexRawData<TOffset> &build_index,
+                           const vector<std::pair<TOffset, TOffset> > &blocks, TOffset depth)
+{
+        BuildCheckpoint<TOffset> &checkpoint = *build_index.checkpoint;
+        TOffset *SA = build_index.suffix_array;
+        const TOffset N = build_index.length_ref;
+        const TOffset size_round = std::max<TOffset>(N / kCheckpointRounds, 1);
+        DifferenceCover<TOffset> dc(build_index.seq_raw, N, build_index.period);
+
+        uint32_t num_round = 0, num_loaded = 0;
+        vector<TOffset> loaded;
+        size_t i = 0;
+        for (TOffset beg = 0, end = 0; beg < N; beg = end) {
+                /// blocks [first, i) of the round [beg, end)
+                size_t first = i;
+                while (i < blocks.size() && end < beg + size_round) {
+                        end = blocks[i++].second;
+                }
+                if (i == blocks.size()) {
+                        end = N;
+                }
+                ++num_round;
+
+                if (checkpoint.IsSorted(beg, end)) {
+                        loaded.resize(end - beg);
+                        if (checkpoint.LoadSorted(loaded.data(), beg, end)
+                            && SameSuffixes<TOffset>(SA + beg, loaded.data(), end - beg)) {
+                                std::copy(loaded.begin(), loaded.end(), SA + beg);
+                                ++num_loaded;
+                                continue;
+                        }
+                }
+                vector<std::pair<TOffset, TOffset> > round(blocks.begin() + first, blocks.begin() + i);
+                SortSbwtBlocks<TOffset>(build_index, SA, round, depth, &dc);
+                checkpoint.SaveSorted(SA + beg, beg, end);
+        }
+        checkpoint.Done("suffix-array");
+        LOGPUT(num_round << " rounds, " << num_loaded << " from the checkpoint...\t");
+}
+
+/**Build sbwt index blockwise for large genomes such homo; references of 4G
+ * characters and more need 64-bit offsets (TOffset = uint64_t).
+ *
+ * Suffixes are first bucketed by their spaced k-mer (k = num_block_sort, 0 to
+ * choose it from N) with one counting pass, then every bucket is sorted from
+ * depth k*p on. A suffix whose k-mer reaches the '$'s, i.e. one of the last
+ * (k-1)p + num_dollar, is dirty: its prefix w before the first '$' is shorter
+ * than k. All dirty suffixes are sorted up front and go in front of the clean
+ * ones of bucket w:A...A, which is exactly where they belong since '$' sorts
+ * below A and above nothing else on that prefix.
+ */
+/// TODO The way to build index of huge reference. Distribution system?
+template <typename TOffset>
+void SortSbwtBlockwise(BasicIndexRawData<TOffset> &build_index)
+{
+	char *seq = build_index.seq_raw;
+        TOffset *seq_index = build_index.suffix_array;
+        const TOffset N = build_index.length_ref;
+        const uint32_t period = build_index.period;
+
+        if (build_index.num_block_sort == 0 || build_index.num_block_sort > kRadixMaxK) {
+                build_index.num_block_sort = ChooseRadixK(N);
+        }
+        const uint32_t k = build_index.num_block_sort;
+        const uint32_t num_bucket = 1u << (2 * k);
+        const TOffset dirty_begin = RadixDirtyBegin(build_index);
+        if (ResumeSuffixArray(build_index)) {
+                return;
+        }
+        ReportPhase phase_bucket(build_index.report, "bucket-sort", period);
+
+        /// Firstly, split the sequence rotation matrix into 4^num_block blocks
+        LOGINFO("Firstly, split the sequence rotation matrix into 4^"<< k << " blocks\n");
+
+        /// Dirty suffixes, fully sorted
+        vector<TOffset> dirty;
+        vector<TOffset> count_dirty(num_bucket, 0);
+        SortDirtySuffixes(seq, N, period, k, dirty_begin, dirty, count_dirty);
+
+        /// Histograms of the clean suffixes, one per thread and slice of [0, dirty_begin)
+        const uint32_t num_slice = build_index.num_threads;
+        vector<vector<TOffset> > hist;
+        auto slice_begin = [&](uint32_t s) -> TOffset {
+                return RadixSliceBegin(dirty_begin, s, num_slice);
+        };
+        try {
+                ThreadPool pool(num_slice);
+                HistogramRadixKeys(pool, seq, N, period, k, dirty_begin, hist);
+
+                /// Bucket K: its dirty suffixes (in sorted order, which
+                /// visits the buckets in order too), then the clean ones of
+                /// slices 0, 1, ...; hist[s][K] becomes the end of the range
+                /// of slice s, filled backwards
+                vector<std::pair<TOffset, TOffset> > blocks;
+                TOffset pos = 0, pos_dirty = 0;
+                for (uint32_t key = 0; key < num_bucket; ++key) {
+                        for (TOffset c = 0; c < count_dirty[key]; ++c) {
+                                seq_index[pos++] = dirty[pos_dirty++];
+                        }
+                        TOffset beg0 = pos;
+                        for (uint32_t s = 0; s < num_slice; ++s) {
+                                pos += hist[s][key];
+                                hist[s][key] = pos;
+                        }
+                        if (pos > 1 + beg0) {
+                                blocks.push_back(std::make_pair(beg0, pos));
+                        }
+                }
+
+                for (uint32_t s = 0; s < num_slice; ++s) {
+                        pool.Submit([&, s]() {
+                                vector<TOffset> &h = hist[s];
+                                ForEachRadixKey<TOffset>(seq, N, period, k, slice_begin(s), slice_begin(s+1),
+                                                [&h, seq_index](TOffset i, uint32_t key) { seq_index[--h[key]] = i; });
+                        });
+                }
+                pool.Wait();
+                phase_bucket.End();
+                if (build_index.report) {
+                        SizeHistogram sizes;
+                        for (auto &block : blocks) {
+                                sizes.Add(block.second - block.first);
+                        }
+                        build_index.report->AddHistogram("block-size", period, sizes);
+                        build_index.report->AddBytes("radix-histograms", period,
+                                                     (uint64_t)num_slice * num_bucket * sizeof(TOffset));
+                        build_index.report->AddBytes("dirty-suffixes", period, dirty.size() * sizeof(TOffset));
+                }
+
+                ReportPhase phase_sort(build_index.report, "sort-blocks", period);
+                LOGINFO("Sort " << blocks.size() << " blocks with "
+                        << build_index.num_threads << " thread(s)...\t");
+                if (build_index.checkpoint) {
+                        SortSbwtRounds<TOffset>(build_index, blocks, (TOffset)k*period);
+                } else {
+                        SortSbwtBlocks<TOffset>(build_index, blocks, (TOffset)k*period);
+                }
+                LOGPUT("Done\n");
+        } catch (...) {
+                LOGERROR("SortSbwtBlockwise");
+                throw;
+        }
+}
+
+/// Blocks smaller than this are sorted byte by byte
+static const uint32_t kPackedMinSize = 8;
+/// Spaced characters cached per suffix by SortSbwtPacked
+static const uint32_t kPackedChars = 32;
+
+/// The next kPackedChars spaced characters of a suffix, 2 bits each with the
+/// first one in the most significant bits, and how many of them come before
+/// the first '$' (or the end). (word, len) orders suffixes like SortSbwt does
+/// as far as they go: a suffix that stops early is padded with A's in word
+/// but is smaller by len.
+template <typename TOffset>
+struct PackedSuffix {
+        uint64_t word;
+        uint32_t len;
+        TOffset pos;
+};
+
+template <typename TOffset>
+static inline void FillPackedSuffix(const char *seq, uint64_t depth,
+                                    TOffset length_ref, uint32_t step,
+                                    PackedSuffix<TOffset> &suf)
+{
+        uint64_t word = 0;
+        uint64_t t0 = suf.pos + depth;
+        uint32_t j = 0;
+        for (; j < kPackedChars; ++j, t0 += step) {
+                if (t0 >= length_ref || seq[t0] == '$') {
+                        break;
+                }
+                word = (word << 2) | RadixCode(seq[t0]);
+        }
+        suf.word = (j == 0 || j == kPackedChars) ? word : word << (2 * (kPackedChars - j));
+        suf.len = j;
+}
+
+template <typename TOffset>
+DifferenceCover<TOffset>::DifferenceCover(const char *seq, TOffset length_ref, uint32_t period):
+        seq(seq),
+        length_ref(length_ref),
+        period(period),
+        size_cover(0),
+        cover_index(kCover, 0xFF),
+        delta_table(kCover * kCover, 0)
+{
+        for (uint32_t d = 0; d < kCover; ++d) {
+                if (d <= 8 || d % 8 == 0) {
+                        cover_index[d] = size_cover++;
+                }
+        }
+        for (uint32_t x = 0; x < kCover; ++x) {
+                for (uint32_t y = 0; y < kCover; ++y) {
+                        uint32_t delta = 0;
+                        while (cover_index[(x + delta) % kCover] == 0xFF
+                               || cover_index[(y + delta) % kCover] == 0xFF) {
+                                ++delta;
+                        }
+                        delta_table[x * kCover + y] = delta;
+                }
+        }
+}
+
+template <typename TOffset>
+void DifferenceCover<TOffset>::Prepare()
+{
+        std::call_once(built, [this]() { Build(); });
+}
+
+template <typename TOffset>
+void DifferenceCover<TOffset>::Build()
+{
+        const TOffset L = length_ref / period;
+
+        /// Samples in the order of the reduced string: class by class, cover
+        /// residue by residue, then by m. A run of samples of one residue
+        /// spells the spaced suffix of its first one kCover characters at a
+        /// time, and the last sample of every run reaches the '$'s.
+        segment_offset.assign(period * size_cover, 0);
+        TOffset n = 0;
+        for (uint32_t r = 0; r < period; ++r) {
+                for (uint32_t d = 0; d < kCover; ++d) {
+                        if (cover_index[d] == 0xFF) continue;
+                        segment_offset[r * size_cover + cover_index[d]] = n;
+                        n += d < L ? (L - d + kCover - 1) / kCover : 0;
+                }
+        }
+        LOGINFO("Rank " << n << " difference cover samples...\n");
+
+        /// Sort the samples by their first kCover characters; those reaching
+        /// the '$'s (dirty) are few, sort them completely and give each its
+        /// own name
+        struct Sample {
+                uint64_t word[2];
+                uint32_t len[2];
+                TOffset dirty_rank;
+                TOffset id;
+        };
+        vector<Sample> samples(n);
+        vector<TOffset> dirty;
+        TOffset id = 0;
+        for (uint32_t r = 0; r < period; ++r) {
+                for (uint32_t d = 0; d < kCover; ++d) {
+                        if (cover_index[d] == 0xFF) continue;
+                        for (TOffset m = d; m < L; m += kCover, ++id) {
+                                Sample &sample = samples[id];
+                                PackedSuffix<TOffset> suf = {0, 0, r + m * period};
+                                FillPackedSuffix(seq, 0, length_ref, period, suf);
+                                sample.word[0] = suf.word;
+                                sample.len[0] = suf.len;
+                                sample.word[1] = 0;
+                                sample.len[1] = 0;
+                                if (suf.len == kPackedChars) {
+                                        FillPackedSuffix(seq, (uint64_t)kPackedChars * period, length_ref, period, suf);
+                                        sample.word[1] = suf.word;
+                                        sample.len[1] = suf.len;
+                                }
+                                sample.dirty_rank = 0;
+                                sample.id = id;
+                                if (sample.len[0] + sample.len[1] < kCover) {
+                                        dirty.push_back(suf.pos);
+                                }
+                        }
+                }
+        }
+        SortSbwt<TOffset>(const_cast<char*>(seq), dirty.data(), 0, dirty.size(), 0, length_ref, period);
+        for (TOffset k = 0; k < dirty.size(); ++k) {
+                TOffset m = dirty[k] / period, r = dirty[k] % period;
+                samples[segment_offset[r * size_cover + cover_index[m % kCover]] + m / kCover].dirty_rank = k + 1;
+        }
+        std::sort(samples.begin(), samples.end(), [](const Sample &a, const Sample &b) {
+                return std::tie(a.word[0], a.len[0], a.word[1], a.len[1], a.dirty_rank)
+                        < std::tie(b.word[0], b.len[0], b.word[1], b.len[1], b.dirty_rank);
+        });
+
+        /// Reduced string of names, 0 is the sentinel
+        vector<TOffset> names(n + 1, 0);
+        TOffset name = 0;
+        for (TOffset j = 0; j < n; ++j) {
+                const Sample &a = samples[j];
+                if (j == 0 || a.dirty_rank
+                    || std::tie(a.word[0], a.len[0], a.word[1], a.len[1])
+                       != std::tie(samples[j-1].word[0], samples[j-1].len[0],
+                                   samples[j-1].word[1], samples[j-1].len[1])) {
+                        ++name;
+                }
+                names[a.id] = name;
+        }
+        vector<Sample>().swap(samples);
+
+        vector<TOffset> sa(n + 1);
+        SaIs<TOffset, TOffset>(names.data(), sa.data(), n + 1, name + 1);
+        vector<TOffset>().swap(names);
+        rank.resize(n);
+        for (TOffset j = 1; j <= n; ++j) {
+                rank[sa[j]] = j - 1;
+        }
+}
+
+/**
+ * Same result as SortSbwt, but every suffix caches its next kPackedChars
+ * spaced characters in one word: the range is sorted on whole words and the
+ * words are refilled kPackedChars characters deeper only for groups that
+ * tie, so a long shared prefix costs one pass per 32 characters instead of
+ * one partition (and one cache miss per suffix) per character. Groups that
+ * tie up to the '$'s are finished by SortSbwt, and groups sharing more than
+ * DifferenceCover::kMinShared characters are ordered by dc, if given.
+ */
+template <typename TOffset>
+void SortSbwtPacked(
+                char *seq,
+                TOffset *seq_index,
+                TOffset begin,
+                TOffset end,
+                TOffset depth,
+                const TOffset &length_ref,
+                const uint32_t &step,
+                DifferenceCover<TOffset> *dc)
+{
+        if (end - begin < kPackedMinSize) {
+                SortSbwt<TOffset>(seq, seq_index, begin, end, depth, length_ref, step);
+                return;
+        }
+
+        typedef PackedSuffix<TOffset> TPackedSuffix;
+        TOffset n = end - begin;
+        vector<TPackedSuffix> suf(n);
+        for (TOffset i = 0; i < n; ++i) {
+                suf[i].pos = seq_index[begin + i];
+                FillPackedSuffix(seq, depth, length_ref, step, suf[i]);
+        }
+
+        auto less = [](const TPackedSuffix &a, const TPackedSuffix &b) {
+                return a.word < b.word || (a.word == b.word && a.len < b.len);
+        };
+        struct Range {
+                TOffset begin, end;
+                uint64_t depth;
+        };
+        vector<Range> stack(1, Range{0, n, depth});
+        vector<Range> tail;             /* ties at the '$'s, for SortSbwt */
+        vector<Range> deep;             /* long shared prefixes, for dc */
+        while (!stack.empty()) {
+                Range r = stack.back();
+                stack.pop_back();
+                std::sort(suf.begin() + r.begin, suf.begin() + r.end, less);
+
+                for (TOffset i = r.begin, j; i < r.end; i = j) {
+                        for (j = i + 1; j < r.end
+                             && suf[j].word == suf[i].word
+                             && suf[j].len == suf[i].len; ++j) { }
+                        if (j - i < 2) {
+                                continue;
+                        }
+                        uint64_t d = r.depth + (uint64_t)suf[i].len * step;
+                        if (suf[i].len < kPackedChars) {
+                                tail.push_back(Range{i, j, d < length_ref ? d : length_ref});
+                                continue;
+                        }
+                        if (dc && d / step >= DifferenceCover<TOffset>::kMinShared) {
+                                deep.push_back(Range{i, j, d});
+                                continue;
+                        }
+                        for (TOffset k = i; k < j; ++k) {
+                                FillPackedSuffix(seq, d, length_ref, step, suf[k]);
+                        }
+                        stack.push_back(Range{i, j, d});
+                }
+        }
+
+        for (TOffset i = 0; i < n; ++i) {
+                seq_index[begin + i] = suf[i].pos;
+        }
+        for (auto &r : tail) {
+                SortSbwt<TOffset>(seq, seq_index, begin + r.begin, begin + r.end, r.depth, length_ref, step);
+        }
+        if (!deep.empty()) {
+                dc->Prepare();
+                for (auto &r : deep) {
+                        std::sort(seq_index + begin + r.begin, seq_index + begin + r.end,
+                                  [dc](TOffset a, TOffset b) { return dc->Less(a, b); });
+                }
+        }
+}
+
+/// Blocks larger than this are split into sub-tasks by one partition step,
+/// so that a single repeat-heavy block cannot serialize the build.
+static const uint32_t kParallelSplitSize = 1u << 16;
+/// Small blocks are batched into tasks of at least this many suffixes.
+static const uint32_t kParallelBatchSize = 1u << 14;
+
+template <typename TOffset>
+static void SortSbwtTask(
+                ThreadPool &pool,
+                DifferenceCover<TOffset> *dc,
+                char *seq,
+                TOffset *seq_index,
+                TOffset begin,
+                TOffset end,
+                TOffset depth,
+                TOffset length_ref,
+                uint32_t step)
+{
+        SeedSortRng(((uint64_t)begin << 32) ^ depth);
+        if (end - begin <= kParallelSplitSize || depth >= length_ref) {
+                SortSbwtPacked<TOffset>(seq, seq_index, begin, end, depth, length_ref, step, dc);
+                return;
+        }
+        if (dc && depth / step >= DifferenceCover<TOffset>::kMinShared) {
+                /* a big block deep in a repeat */
+                dc->Prepare();
+                std::sort(seq_index + begin, seq_index + end,
+                          [dc](TOffset a, TOffset b) { return dc->Less(a, b); });
+                return;
+        }
+
+        TOffset lt_end = 0, gt_begin = 0;
+        PartitionSbwt<TOffset>(seq, seq_index, begin, end, depth, length_ref, lt_end, gt_begin);
+
+        pool.Submit([&pool, dc, seq, seq_index, begin, lt_end, depth, length_ref, step]() {
+                SortSbwtTask<TOffset>(pool, dc, seq, seq_index, begin, lt_end, depth, length_ref, step);
+        });
+        if ((uint64_t)seq_index[lt_end] + depth < length_ref) {
+                pool.Submit([&pool, dc, seq, seq_index, lt_end, gt_begin, depth, length_ref, step]() {
+                        SortSbwtTask<TOffset>(pool, dc, seq, seq_index, lt_end, gt_begin, depth+step, length_ref, step);
+                });
+        } else {
+                std::sort(seq_index + lt_end, seq_index + gt_begin);
+        }
+        pool.Submit([&pool, dc, seq, seq_index, gt_begin, end, depth, length_ref, step]() {
+                SortSbwtTask<TOffset>(pool, dc, seq, seq_index, gt_begin, end, depth, length_ref, step);
+        });
+}
+
+/**
+ * Sort the independent blocks [first, second) of the suffix array, whose
+ * suffixes already agree on their first `depth` characters, on
+ * build_index.num_threads threads. The result does not depend on the number
+ * of threads.
+ */
+template <typename TOffset>
+void SortSbwtBlocks(
+                BasicIndexRawData<TOffset> &build_index,
+                const vector<std::pair<TOffset, TOffset> > &blocks,
+                TOffset depth)
+{
+        DifferenceCover<TOffset> dc(build_index.seq_raw, build_index.length_ref, build_index.period);
+        SortSbwtBlocks<TOffset>(build_index, build_index.suffix_array, blocks, depth, &dc);
+}
+
+/// Same as above on the blocks of seq_index, any part of a suffix array,
+/// with the difference cover dc (may be nullptr).
+template <typename TOffset>
+void SortSbwtBlocks(
+                BasicIndexRawData<TOffset> &build_index,
+                TOffset *seq_index,
+                const vector<std::pair<TOffset, TOffset> > &blocks,
+                TOffset depth,
+                DifferenceCover<TOffset> *dc)
+{
+        char *seq = build_index.seq_raw;
+        TOffset N = build_index.length_ref;
+        uint32_t period = build_index.period;
+
+        ThreadPool pool(build_index.num_threads);
+
+        size_t i = 0;
+        while (i < blocks.size()) {
+                if (blocks[i].second - blocks[i].first > kParallelSplitSize) {
+                        TOffset begin = blocks[i].first, end = blocks[i].second;
+                        pool.Submit([&pool, dc, seq, seq_index, begin, end, depth, N, period]() {
+                                SortSbwtTask<TOffset>(pool, dc, seq, seq_index, begin, end, depth, N, period);
+                        });
+                        ++i;
+                        continue;
+                }
+
+                /// batch of small blocks
+                size_t first = i;
+                uint64_t batch_size = 0;
+                while (i < blocks.size()
+                       && batch_size < kParallelBatchSize
+                       && blocks[i].second - blocks[i].first <= kParallelSplitSize) {
+                        batch_size += blocks[i].second - blocks[i].first;
+                        ++i;
+                }
+                size_t last = i;
+                const vector<std::pair<TOffset, TOffset> > *pblocks = &blocks;
+                pool.Submit([pblocks, first, last, dc, seq, seq_index, depth, N, period]() {
+                        for (size_t k = first; k != last; ++k) {
+                                SeedSortRng(((uint64_t)(*pblocks)[k].first << 32) ^ depth);
+                                SortSbwtPacked<TOffset>(seq, seq_index, (*pblocks)[k].first, (*pblocks)[k].second, depth, N, period, dc);
+                        }
+                });
+        }
+
+        pool.Wait();
+}
+
+/**
+ * The spaced suffixes of one residue class r (positions r, r+p, r+2p, ...)
+ * are the plain suffixes of X_r = X[r] X[r+p] X[r+2p] ..., so the spaced
+ * suffix array is the suffix array of
+ *
+ *      X_0 sep_0 X_1 sep_1 ... X_{p-1} sep_{p-1} 0
+ *
+ * with the separators sep_r = r+1 sorting below every character and the
+ * sentinel 0 at the end, with the separator and sentinel positions removed.
+ * A suffix that runs out of its class meets its separator, which sorts below
+ * everything it could be compared with, and equal spaced suffixes are
+ * ordered by their class, i.e. by position: the order of SortSbwt.
+ */
+template <typename TChar, typename TOffset>
+static void SortSbwtSais(BasicIndexRawData<TOffset> &build_index, uint32_t num_symbol)
+{
+        const char *X = build_index.seq_raw;
+        TOffset *SA = build_index.suffix_array;
+        const TOffset N = build_index.length_ref;
+        const uint32_t p = build_index.period;
+        const TOffset L = N / p;                /* length of every class, N is a multiple of p */
+        const TOffset n = N + p + 1;
+
+        TChar rank[256] = {0};
+        rank['$'] = p + 1;
+        rank['A'] = p + 2;
+        rank['C'] = p + 3;
+        rank['G'] = p + 4;
+        rank['T'] = p + 5;
+
+        vector<TOffset> sa_concat(n);
+        if (build_index.report) {
+                build_index.report->AddBytes("sais-workspace", p, (uint64_t)n * (sizeof(TOffset) + sizeof(TChar)));
+        }
+        {
+                vector<TChar> text(n);
+                TChar *ptr = &text[0];
+                for (uint32_t r = 0; r < p; ++r) {
+                        for (TOffset i = r; i < N; i += p) {
+                                *ptr++ = rank[(uint8_t)X[i]];
+                        }
+                        *ptr++ = r + 1;
+                }
+                *ptr = 0;
+
+                SaIs<TChar, TOffset>(&text[0], &sa_concat[0], n, num_symbol);
+        }
+
+        TOffset k = 0;
+        for (TOffset j = 0; j < n; ++j) {
+                TOffset r = sa_concat[j] / (L + 1);
+                TOffset m = sa_concat[j] % (L + 1);
+                if (m == L || r == p) {
+                        continue;       /* separator or sentinel */
+                }
+                SA[k++] = r + m * p;
+        }
+}
+
+template <typename TOffset>
+void SortSbwtSais(BasicIndexRawData<TOffset> &build_index)
+{
+        const TOffset N = build_index.length_ref;
+        const uint32_t p = build_index.period;
+        if ((uint64_t)N + p + 1 >= std::numeric_limits<TOffset>::max()) {
+                LOGERROR("Reference is too long for SA-IS: " << N);
+                throw std::length_error("SortSbwtSais");
+        }
+
+        if (ResumeSuffixArray(build_index)) {
+                return;
+        }
+
+        ReportPhase phase(build_index.report, "sort-sais", p);
+
+        /// separators 1..p, '$' and A/C/G/T, and the sentinel
+        uint32_t num_symbol = p + 6;
+        LOGINFO("Sort sbwt by SA-IS over " << p << " residue classes...\t");
+        if (num_symbol <= 256) {
+                SortSbwtSais<uint8_t, TOffset>(build_index, num_symbol);
+        } else {
+                SortSbwtSais<uint32_t, TOffset>(build_index, num_symbol);
+        }
+        LOGPUT("Done\n");
+        phase.End();
+        /// SA-IS has no partial state worth saving: only the result is
+        if (build_index.checkpoint) {
+                build_index.checkpoint->SaveSorted(build_index.suffix_array, 0, N);
+                build_index.checkpoint->Done("suffix-array");
+        }
+}
+
+template <typename TOffset>
+void BuildIndexSais(BasicIndexRawData<TOffset> &build_index) {
+        build_index.AllocateArrays();
+        if (build_index.suffix_array && build_index.seq_raw) {
+                SortSbwtSais(build_index);
+                LOGINFO("Transform and CountOccurrence...\t");
+                TransformCountOccurrence(build_index);
+                LOGPUT("Done\n");
+        }
+}
+
+/// Memory of the external build per suffix of a chunk: its spilled
+/// (position, k-mer) record, SA entry, packed sort key, BWT character and
+/// Occ output word
+template <typename TOffset>
+static uint64_t ExternalBytesPerSuffix()
+{
+        return 2 * sizeof(TOffset) + sizeof(TOffset) + sizeof(PackedSuffix<TOffset>) + 1 + sizeof(TOffset);
+}
+/// Size of a file, 0 if there is none
+static uint64_t SizeFile(const string &file_name)
+{
+        std::ifstream fin(file_name.c_str(), std::ios::binary | std::ios::ate);
+        return fin ? (uint64_t)fin.tellg() : 0;
+}
+
+/// Words buffered per spill file
+static const uint32_t kSpillBufferWords = 1u << 12;
+/// At most this many spill files are open at once
+static const uint32_t kMaxSpillFiles = 512;
+
+/**
+ * Out-of-core build for references whose arrays do not fit in memory. Only
+ * the reference (N bytes) is held whole; everything else stays within
+ * max_mem bytes, and SA, Occ and C go straight to the index files.
+ *
+ * 1. The radix pass of SortSbwtBlockwise counts the suffixes per spaced
+ *    k-mer; runs of consecutive buckets form the chunks, each of at most
+ *    the suffixes the budget holds at once.
+ * 2. One scan spills every clean suffix with its k-mer to its chunk's file.
+ * 3. Chunk by chunk in order: read it back, counting-sort it by k-mer with
+ *    the dirty suffixes in front of their bucket, sort the buckets, and
+ *    write its slices of SA and of the four Occ columns into the array
+ *    file. Occ carries its counts from one chunk to the next.
+ *
+ * The array file is byte-identical to the one of the in-memory build; the meta
+ * file records the spaced k-mer length used for the chunks.
+ */
+template <typename TOffset>
+void BuildIndexExternal(BasicIndexRawData<TOffset> &build_index, const string &prefix_filename, uint64_t max_mem)
+{
+        char *seq = build_index.seq_raw;
+        if (!seq) return;
+        const TOffset N = build_index.length_ref;
+        const uint32_t period = build_index.period;
+
+        /// Budget: the reference and the spill buffers are fixed, the
+        /// difference cover gets its share if there is room
+        uint64_t size_fixed = (uint64_t)N + (uint64_t)kMaxSpillFiles * kSpillBufferWords * sizeof(TOffset);
+        if (max_mem <= size_fixed) {
+                LOGERROR("--max-mem " << max_mem << " is too small, at least "
+                         << size_fixed << " bytes are needed");
+                throw std::length_error("BuildIndexExternal");
+        }
+        uint64_t size_room = max_mem - size_fixed;
+        std::unique_ptr<DifferenceCover<TOffset> > dc;
+        if (size_room / 2 > DifferenceCover<TOffset>::MemoryBound(N)) {
+                dc.reset(new DifferenceCover<TOffset>(seq, N, period));
+                size_room -= DifferenceCover<TOffset>::MemoryBound(N);
+        }
+
+        const uint64_t kBytesPerSuffix = ExternalBytesPerSuffix<TOffset>();
+        /// k as in memory, but long enough that an average bucket is a
+        /// small part of a chunk
+        if (build_index.num_block_sort == 0 || build_index.num_block_sort > kRadixMaxK) {
+                uint32_t k = ChooseRadixK(N);
+                while (k < kRadixMaxK
+                       && ((uint64_t)N >> (2 * k)) > size_room / kBytesPerSuffix / 16) {
+                        ++k;
+                }
+                build_index.num_block_sort = k;
+        }
+        const uint32_t k = build_index.num_block_sort;
+        const uint32_t num_bucket = 1u << (2 * k);
+        const TOffset dirty_begin = RadixDirtyBegin(build_index);
+
+        uint64_t size_hist = (uint64_t)num_bucket * sizeof(TOffset) * (build_index.num_threads + 3);
+        if (size_room <= size_hist + kBytesPerSuffix) {
+                LOGERROR("--max-mem " << max_mem << " is too small, at least "
+                         << size_fixed + size_hist + kBytesPerSuffix << " bytes are needed");
+                throw std::length_error("BuildIndexExternal");
+        }
+        const uint64_t capacity = (size_room - size_hist) / kBytesPerSuffix;
+
+        /// 1. Count the suffixes per bucket and cut the buckets into chunks
+        ReportPhase phase_bucket(build_index.report, "bucket-sort", period);
+        vector<TOffset> dirty;
+        vector<TOffset> count_dirty(num_bucket, 0);
+        SortDirtySuffixes(seq, N, period, k, dirty_begin, dirty, count_dirty);
+
+        vector<TOffset> count(num_bucket, 0);
+        {
+                vector<vector<TOffset> > hist;
+                ThreadPool pool(build_index.num_threads);
+                HistogramRadixKeys(pool, seq, N, period, k, dirty_begin, hist);
+                for (auto &h : hist) {
+                        for (uint32_t key = 0; key < num_bucket; ++key) {
+                                count[key] += h[key];
+                        }
+                }
+        }
+
+        vector<uint32_t> chunk_of_key(num_bucket);
+        vector<uint32_t> chunk_first_key;
+        uint64_t size_chunk = 0;
+        for (uint32_t key = 0; key < num_bucket; ++key) {
+                uint64_t size_bucket = (uint64_t)count[key] + count_dirty[key];
+                if (chunk_first_key.empty() || (size_chunk > 0 && size_chunk + size_bucket > capacity)) {
+                        chunk_first_key.push_back(key);
+                        size_chunk = 0;
+                }
+                /// A bucket is sorted whole: no chunk holds one larger
+                /// than the room (a long repeat of its k-mer)
+                if (size_bucket > capacity) {
+                        LOGERROR("--max-mem " << max_mem << " is too small: a bucket of "
+                                 << size_bucket << " suffixes, chunks of " << capacity << " suffixes");
+                        throw std::length_error("BuildIndexExternal");
+                }
+                chunk_of_key[key] = chunk_first_key.size() - 1;
+                size_chunk += size_bucket;
+        }
+        const uint32_t num_chunk = chunk_first_key.size();
+        chunk_first_key.push_back(num_bucket);
+        if (num_chunk > kMaxSpillFiles) {
+                LOGERROR("--max-mem " << max_mem << " is too small: " << num_chunk
+                         << " chunks of " << capacity << " suffixes");
+                throw std::length_error("BuildIndexExternal");
+        }
+        LOGINFO("External build: " << num_chunk << " chunk(s) of up to "
+                << capacity << " suffixes\n");
+        phase_bucket.End();
+        if (build_index.report) {
+                build_index.report->AddBytes("radix-histograms", period, size_hist);
+                build_index.report->AddBytes("dirty-suffixes", period, dirty.size() * sizeof(TOffset));
+                build_index.report->AddBytes("spill-buffers", period,
+                                             (uint64_t)num_chunk * kSpillBufferWords * sizeof(TOffset));
+                build_index.report->AddBytes("chunk", period, capacity * kBytesPerSuffix);
+                if (dc) {
+                        build_index.report->AddBytes("difference-cover", period,
+                                                     DifferenceCover<TOffset>::MemoryBound(N));
+                }
+        }
+
+        /// 2. Spill (position, k-mer) of the clean suffixes
+        vector<string> spill_filename(num_chunk);
+        for (uint32_t c = 0; c < num_chunk; ++c) {
+                spill_filename[c] = IndexFilename(build_index, prefix_filename,
+                                                  ".chunk." + std::to_string(c) + ".tmp");
+        }
+
+        /// A resumed build goes on from the last chunk journaled, if the
+        /// spill files of the next ones and the array file are all there
+        BuildCheckpoint<TOffset> *checkpoint = build_index.checkpoint;
+        string file_array_filename = IndexFilename(build_index, prefix_filename, ".array.sbwt");
+        TOffset occ[4] = {0, 0, 0, 0};
+        TOffset pos_sa = 0, pos_dirty = 0;
+        uint32_t chunk_begin = 0;
+        if (checkpoint && checkpoint->IsDone("spilled")) {
+                chunk_begin = checkpoint->LoadChunk(pos_sa, occ);
+                bool is_valid = chunk_begin <= num_chunk
+                                && (chunk_begin == 0
+                                    || SizeFile(file_array_filename) >= OffsetSuffixArray(build_index)
+                                                                        + (uint64_t)pos_sa * sizeof(TOffset));
+                for (uint32_t c = chunk_begin; c < num_chunk && is_valid; ++c) {
+                        uint64_t num_clean = 0;
+                        for (uint32_t key = chunk_first_key[c]; key < chunk_first_key[c+1]; ++key) {
+                                num_clean += count[key];
+                        }
+                        is_valid = SizeFile(spill_filename[c]) == 2 * num_clean * sizeof(TOffset);
+                }
+                if (is_valid) {
+                        LOGINFO("Resume from chunk " << chunk_begin + 1 << "/" << num_chunk << "\n");
+                } else {
+                        LOGINFO("Spill files of the checkpoint are missing, starting over\n");
+                        checkpoint->Restart();
+                        chunk_begin = 0;
+                        pos_sa = 0;
+                        std::fill(occ, occ + 4, 0);
+                }
+        }
+        for (uint32_t key = 0; key < chunk_first_key[chunk_begin]; ++key) {
+                pos_dirty += count_dirty[key];
+        }
+
+        if (!checkpoint || !checkpoint->IsDone("spilled")) {
+                ReportPhase phase(build_index.report, "spill", period);
+                try {
+                        vector<std::unique_ptr<std::ofstream> > spill_fout(num_chunk);
+                        vector<vector<TOffset> > spill_buffer(num_chunk);
+                        for (uint32_t c = 0; c < num_chunk; ++c) {
+                                spill_fout[c].reset(new std::ofstream(spill_filename[c].c_str(), std::ios::binary));
+                                spill_buffer[c].reserve(kSpillBufferWords);
+                        }
+                        auto flush = [&](uint32_t c) {
+                                WriteArray(*spill_fout[c], spill_buffer[c].data(), spill_buffer[c].size());
+                                spill_buffer[c].clear();
+                                if (!*spill_fout[c]) {
+                                        LOGERROR("Cannot write " << spill_filename[c]);
+                                        throw std::runtime_error("BuildIndexExternal");
+                                }
+                        };
+                        LOGINFO("Spill suffixes...\t");
+                        ForEachRadixKey<TOffset>(seq, N, period, k, 0, dirty_begin, [&](TOffset i, uint32_t key) {
+                                uint32_t c = chunk_of_key[key];
+                                spill_buffer[c].push_back(i);
+                                spill_buffer[c].push_back(key);
+                                if (spill_buffer[c].size() >= kSpillBufferWords) {
+                                        flush(c);
+                                }
+                        });
+                        for (uint32_t c = 0; c < num_chunk; ++c) {
+                                flush(c);
+                        }
+                        for (auto &fout : spill_fout) {
+                                fout->close();
+                        }
+                        if (checkpoint) {
+                                checkpoint->Done("spilled");
+                        }
+                        LOGPUT("Done\n");
+                } catch (...) {
+                        LOGERROR("BuildIndexExternal");
+                        throw;
+                }
+        }
+        vector<uint32_t>().swap(chunk_of_key);
+
+        /// 3. Sort the chunks in order and stream SA and Occ out
+        ReportPhase phase_chunks(build_index.report, "sort-write-chunks", period);
+        SizeHistogram block_sizes;
+        std::fstream array_fout;
+        if (chunk_begin > 0) {
+                array_fout.open(file_array_filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        } else {
+                array_fout.open(file_array_filename.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+                WriteIntoDiskBuildIndexSequence(build_index, array_fout);
+        }
+
+        for (uint32_t c = chunk_begin; c < num_chunk; ++c) {
+                const uint32_t key_begin = chunk_first_key[c], key_end = chunk_first_key[c+1];
+                LOGINFO("Chunk " << c + 1 << "/" << num_chunk << "...\t");
+
+                vector<TOffset> records;
+                {
+                        std::ifstream spill_fin(spill_filename[c].c_str(), std::ios::binary | std::ios::ate);
+                        records.resize((uint64_t)spill_fin.tellg() / sizeof(TOffset));
+                        spill_fin.seekg(0);
+                        spill_fin.read((char*)records.data(), records.size() * sizeof(TOffset));
+                        if (!spill_fin) {
+                                LOGERROR("Cannot read " << spill_filename[c]);
+                                throw std::runtime_error("BuildIndexExternal");
+                        }
+                }
+
+                /// Layout like SortSbwtBlockwise: dirty suffixes, then the clean ones
+                TOffset size = 0;
+                for (uint32_t key = key_begin; key < key_end; ++key) {
+                        size += count[key] + count_dirty[key];
+                }
+                vector<TOffset> chunk_sa(size);
+                vector<TOffset> offset(key_end - key_begin);
+                vector<std::pair<TOffset, TOffset> > blocks;
+                TOffset pos = 0;
+                for (uint32_t key = key_begin; key < key_end; ++key) {
+                        for (TOffset j = 0; j < count_dirty[key]; ++j) {
+                                chunk_sa[pos++] = dirty[pos_dirty++];
+                        }
+                        offset[key - key_begin] = pos;
+                        if (count[key] > 1) {
+                                blocks.push_back(std::make_pair(pos, pos + count[key]));
+                                block_sizes.Add(count[key]);
+                        }
+                        pos += count[key];
+                }
+                for (size_t j = 0; j < records.size(); j += 2) {
+                        chunk_sa[offset[records[j+1] - key_begin]++] = records[j];
+                }
+                vector<TOffset>().swap(records);
+
+                SortSbwtBlocks<TOffset>(build_index, chunk_sa.data(), blocks, (TOffset)k*period, dc.get());
+
+                array_fout.seekp(OffsetSuffixArray(build_index) + (uint64_t)pos_sa * sizeof(TOffset));
+                WriteArray(array_fout, chunk_sa.data(), size);
+
+                /// BWT of the chunk, then its Occ slices
+                vector<char> bwt(size);
+                for (TOffset j = 0; j < size; ++j) {
+                        TOffset t0 = chunk_sa[j];
+                        bwt[j] = SpacedBwtChar(seq, N, period, t0);
+                }
+                vector<TOffset>().swap(chunk_sa);
+                vector<TOffset> occ_slice(build_index.occ_format == kOccFull ? size : 0);
+                const char kBase[4] = {'A', 'C', 'G', 'T'};
+                for (int b = 0; b < 4; ++b) {
+                        if (build_index.occ_format != kOccFull) {
+                                occ[b] += std::count(bwt.begin(), bwt.end(), kBase[b]);
+                                continue;
+                        }
+                        for (TOffset j = 0; j < size; ++j) {
+                                occ[b] += bwt[j] == kBase[b];
+                                occ_slice[j] = occ[b];
+                        }
+                        array_fout.seekp(OffsetOccurrence(build_index, b) + (uint64_t)pos_sa * sizeof(TOffset));
+                        WriteArray(array_fout, occ_slice.data(), size);
+                }
+                array_fout.flush();
+                if (!array_fout) {
+                        LOGERROR("Cannot write " << file_array_filename);
+                        throw std::runtime_error("BuildIndexExternal");
+                }
+                pos_sa += size;
+                if (checkpoint) {
+                        checkpoint->SaveChunk(c + 1, pos_sa, occ);
+                }
+                std::remove(spill_filename[c].c_str());
+                LOGPUT("Done\n");
+        }
+        array_fout.flush();
+        array_fout.close();
+        phase_chunks.End();
+        if (build_index.report) {
+                build_index.report->AddHistogram("block-size", period, block_sizes);
+        }
+
+        /// SA bit-packed in its place: the words are written behind the
+        /// entries read, fewer bits a suffix
+        uint64_t size_sa = (uint64_t)N * sizeof(TOffset);
+        if (build_index.is_sa_packed) {
+                ReportPhase phase(build_index.report, "pack-suffix-array", period);
+                LOGINFO("Pack suffix array...\t");
+                std::ifstream sa_fin(file_array_filename.c_str(), std::ios::binary);
+                array_fout.open(file_array_filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+                sa_fin.seekg(OffsetSuffixArray(build_index));
+                array_fout.seekp(OffsetSuffixArray(build_index));
+                /// SA is overwritten from here: a build killed now starts over
+                if (checkpoint) {
+                        checkpoint->Restart();
+                }
+                PackedSaWriter<TOffset> writer(array_fout, N);
+                vector<TOffset> sa_block(std::min<uint64_t>(N, capacity));
+                for (TOffset i = 0; i < N && sa_fin; i += sa_block.size()) {
+                        size_t size = std::min<uint64_t>(sa_block.size(), N - i);
+                        sa_fin.read((char*)sa_block.data(), size * sizeof(TOffset));
+                        for (size_t j = 0; j < size; ++j) {
+                                writer.Append(sa_block[j]);
+                        }
+                }
+                bool is_written = sa_fin && writer.Finish();
+                size_sa = (uint64_t)array_fout.tellp() - OffsetSuffixArray(build_index);
+                array_fout.close();
+                if (!is_written || !array_fout
+                    || truncate(file_array_filename.c_str(), OffsetSuffixArray(build_index) + size_sa) != 0) {
+                        LOGERROR("Cannot pack the suffix array of " << file_array_filename);
+                        throw std::runtime_error("BuildIndexExternal");
+                }
+                if (build_index.report) {
+                        build_index.report->AddBytes("packed-suffix-array", period, size_sa);
+                }
+                LOGPUT("Done\n");
+        }
+
+        /// The sampled Occ or the wavelet tree goes after SA, which is
+        /// read back in blocks of the size of a chunk. The wavelet tree is
+        /// built in memory (H0 bits a character) before it is written, as
+        /// is the run-length index, which then replaces SA in the file. SA
+        /// sampled every few positions is built in memory too and written
+        /// last, the Occ section taking the place of SA: it is written
+        /// behind the blocks read, a few bits a character against the
+        /// bytes of SA.
+        const bool is_sa_sampled = build_index.sa_sample_rate > 1;
+        if (build_index.occ_format != kOccFull || is_sa_sampled) {
+                ReportPhase phase(build_index.report, "write-occurrence", period);
+                LOGINFO("Write occurrence after SA...\t");
+                std::ifstream sa_fin(file_array_filename.c_str(), std::ios::binary);
+                array_fout.open(file_array_filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+                sa_fin.seekg(OffsetSuffixArray(build_index));
+                array_fout.seekp(OffsetSuffixArray(build_index) + (is_sa_sampled ? 0 : size_sa));
+                SaReader<TOffset> sa_reader(sa_fin, build_index.is_sa_packed);
+                std::unique_ptr<SampledOccWriter<TOffset> > writer;
+                std::unique_ptr<WaveletOcc<TOffset> > wavelet;
+                std::unique_ptr<RunLengthIndex<TOffset> > runs;
+                std::unique_ptr<SampledSa<TOffset> > samples;
+                if (build_index.occ_format == kOccSampled) {
+                        writer.reset(new SampledOccWriter<TOffset>(array_fout));
+                } else if (build_index.occ_format == kOccWavelet) {
+                        uint64_t count_base[4] = {occ[0], occ[1], occ[2], occ[3]};
+                        wavelet.reset(new WaveletOcc<TOffset>(count_base));
+                } else if (build_index.occ_format == kOccRunLength) {
+                        runs.reset(new RunLengthIndex<TOffset>(N, period));
+                }
+                if (is_sa_sampled) {
+                        samples.reset(new SampledSa<TOffset>(period, build_index.sa_sample_rate));
+                        /// SA is overwritten from here: a build killed now
+                        /// starts over
+                        if (checkpoint) {
+                                checkpoint->Restart();
+                        }
+                }
+                vector<TOffset> sa_block(std::min<uint64_t>(N, capacity));
+                for (TOffset i = 0; i < N; i += sa_block.size()) {
+                        size_t size = std::min<uint64_t>(sa_block.size(), N - i);
+                        if (!sa_reader.Read(sa_block.data(), size)) {
+                                break;
+                        }
+                        for (size_t j = 0; j < size; ++j) {
+                                char c = SpacedBwtChar(seq, N, period, sa_block[j]);
+                                if (runs) {
+                                        runs->Append(c, sa_block[j]);
+                                } else if (wavelet) {
+                                        wavelet->Append(c);
+                                } else if (writer) {
+                                        writer->Append(c);
+                                }
+                                if (samples) {
+                                        samples->Append(c, sa_block[j]);
+                                }
+                        }
+                }
+                bool is_written = (bool)sa_fin;
+                if (runs && is_written) {
+                        runs->Finish();
+                        if (build_index.report) {
+                                build_index.report->AddBytes("run-length-index", period, runs->Bytes());
+                        }
+                        /// SA is overwritten from here: a build killed now
+                        /// starts over
+                        if (checkpoint) {
+                                checkpoint->Restart();
+                        }
+                        array_fout.seekp(OffsetSuffixArray(build_index));
+                        is_written = runs->Save(array_fout);
+                        uint64_t size_array = array_fout.tellp();
+                        array_fout.close();
+                        is_written = is_written && array_fout
+                                     && truncate(file_array_filename.c_str(), size_array) == 0;
+                } else if (is_written) {
+                        if (wavelet) {
+                                is_written = wavelet->Save(array_fout);
+                        } else if (writer) {
+                                is_written = writer->Finish();
+                        }
+                        uint64_t size_array = 0;
+                        if (samples && is_written) {
+                                if (build_index.report) {
+                                        build_index.report->AddBytes("sampled-suffix-array", period, samples->Bytes());
+                                }
+                                is_written = samples->Save(array_fout);
+                                size_array = array_fout.tellp();
+                        }
+                        array_fout.close();
+                        is_written = is_written && array_fout
+                                     && (!samples || truncate(file_array_filename.c_str(), size_array) == 0);
+                }
+                if (!is_written) {
+                        LOGERROR("Cannot write the Occ of " << file_array_filename);
+                        throw std::runtime_error("BuildIndexExternal");
+                }
+                LOGPUT("Done\n");
+                if (runs) {
+                        LOGINFO("Runs of the BWT: " << runs->NumRun() << "\n");
+                }
+                if (samples) {
+                        LOGINFO("SA samples: " << samples->NumSample() << "\n");
+                }
+        }
+
+        /// C as TransformCountOccurrence computes it
+        TOffset *C = &build_index.first_column[0];
+        C[0] = build_index.num_dollar;
+        C[1] = C[0] + occ[0];
+        C[2] = C[1] + occ[1];
+        C[3] = C[2] + occ[2];
+        WriteIntoDiskBuildIndexMeta(build_index, prefix_filename);
+}
+
+void SortSbwtBlockwise(
+	char *seq,                      /* sequence */
+        uint32_t *seq_index,            /* suffix array */
+	uint32_t begin,
+        uint32_t end,
+        uint32_t depth,
+	const uint32_t &length_ref,
+        const uint32_t &step,           /* a.k.a period*/
+        const uint32_t &num_block
+        )
+{
+	/* Condition of end */
+        ///Bug: depth >= num_block
+	if (depth >= step*num_block /* Condition for blockwise-building */|| begin+1 >= end || depth >= length_ref) return;
+
+	int64_t a = 0, b = 0, c = 0,
+		d = 0, r = 0, v = 0,
+		distance = 0;
+	uint32_t tmpval = 0, tmpval1 = 0;
+	distance = end - begin;
+	a = (NextSortRng() % distance) + begin;
+
+	/* swap begin with a */
+	tmpval = seq_index[begin];
+	seq_index[begin] = seq_index[a];
 	seq_index[a] = tmpval;
 
 	tmpval1 = seq_index[begin] + depth;
-	/* Guarantee that: seq[index] or '$' if index > length(seq) */
-	v = tmpval1 >= length_ref ? '$' : seq[tmpval1];
+	/* Guarantee that: seq[index] or kPastEnd if index >= length(seq) */
+	v = tmpval1 >= length_ref ? kPastEnd : seq[tmpval1];
 	a = b = begin + 1;
 	c = d = end - 1;
 
 	for (;;) {
 		while ( b <= c &&
-			(tmpval1 = seq_index[b]+depth, r = (tmpval1 >= length_ref ? '$' : seq[tmpval1]) - v) <= 0
+			(tmpval1 = seq_index[b]+depth, r = (tmpval1 >= length_ref ? kPastEnd : seq[tmpval1]) - v) <= 0
 			) {
 			if (r == 0) {
 				/* swap a with b */
@@ -1083,7 +2526,7 @@ void SortSbwtBlockwise(
 
 		while (
 			b <= c &&
-			(tmpval1 = seq_index[c]+depth, r = (tmpval1 >= length_ref ? '$' : seq[tmpval1]) - v) >= 0
+			(tmpval1 = seq_index[c]+depth, r = (tmpval1 >= length_ref ? kPastEnd : seq[tmpval1]) - v) >= 0
 			) {
 			if (r == 0) {
 				/* swap c with d */
@@ -1108,12 +2551,12 @@ void SortSbwtBlockwise(
         int64_t t0 = a - begin;
         int64_t t1 = b - a;
         r = t0 < t1 ? t0 : t1;
-        VectorSwap(begin, b-r, r, seq_index);
+        VectorSwap<uint32_t>(begin, b-r, r, seq_index);
 
         t0 = d - c;
         t1 = end - 1 - d;
         r = t0 < t1 ? t0 : t1;
-        VectorSwap(b, end-r, r, seq_index);
+        VectorSwap<uint32_t>(b, end-r, r, seq_index);
         r = b - a + begin;
 
         SortSbwtBlockwise(seq, seq_index, begin, r, depth, length_ref, step, num_block);
@@ -1128,10 +2571,12 @@ void SortSbwtBlockwise(
 }
 
 
-SecondIndex::SecondIndex(): array_ptr(nullptr), size(0) { }
+SecondIndex::SecondIndex(): array_ptr(nullptr), size(0), array_wide(nullptr), size_wide(0),
+        size_min(kSizeMinDefault), tune_max_bytes(0), layout(kLayoutSorted) { }
 
 SecondIndex::SecondIndex(const string &prefix_filename)
-                : array_ptr(nullptr)
+                : array_ptr(nullptr), size(0), array_wide(nullptr), size_wide(0), size_min(kSizeMinDefault),
+                  tune_max_bytes(0), layout(kLayoutSorted)
 {
         string file_second_filename = prefix_filename + ".second.sbwt";
         std::ifstream second_fin(file_second_filename.c_str(), std::ios_base::in | ios::binary);
@@ -1147,42 +2592,357 @@ SecondIndex::SecondIndex(const string &prefix_filename)
         if (is_big_endian) {
                 LOGERROR("Current platform is big endian."
                          << " SBWT will not work on big-endian platform.");
-        } else {
-                this->size = readU64(second_fin, is_big_endian);
-                this->size_min = readU32(second_fin, is_big_endian);
-                this->size_seed = readU32(second_fin, is_big_endian);
-
-                if (size > 0) {
-                        this->array_ptr = new uint16_t[size];
-                }
-
-                if (this->array_ptr != nullptr) {
-                        uint16_t *ptr = array_ptr;
+                return;
+        }
 
-                        for (uint32_t i = 0; i < size; ++i) {
-                                *ptr = readU16(second_fin);
-                                ++ptr;
-                        }
+        /// the size of the version 1 array, 0 since
+        uint64_t size_v1 = readU64(second_fin, is_big_endian);
+        this->size_min = readU32(second_fin, is_big_endian);
+        this->size_seed = readU32(second_fin, is_big_endian);
+        uint32_t version = readU32(second_fin, is_big_endian);
+        if (!second_fin || size_v1 != 0 || version < 2 || version > kSecondIndexVersion) {
+                LOGERROR("The second index " << file_second_filename
+                         << " is of another version, build the index again");
+                return;
+        }
+        /// version 2 is sorted
+        if (version >= 3) {
+                this->layout = readU32(second_fin, is_big_endian);
+                if (layout != kLayoutSorted && layout != kLayoutEytzinger) {
+                        LOGERROR("The second index " << file_second_filename
+                                 << " has an unknown layout " << layout);
+                        layout = kLayoutSorted;
+                        return;
                 }
         }
 
-        second_fin.close();
+        uint64_t num_segment = readU64(second_fin, is_big_endian);
+        this->size = readU64(second_fin, is_big_endian);
+        this->size_wide = readU64(second_fin, is_big_endian);
+        vector<uint64_t> begs(num_segment), offsets(num_segment);
+        vector<uint32_t> counts(num_segment);
+        second_fin.read((char*)begs.data(), num_segment * sizeof(uint64_t));
+        second_fin.read((char*)counts.data(), num_segment * sizeof(uint32_t));
+        second_fin.read((char*)offsets.data(), num_segment * sizeof(uint64_t));
+        this->array_ptr = new uint16_t[size];
+        this->array_wide = new uint32_t[size_wide];
+        second_fin.read((char*)array_ptr, size * sizeof(uint16_t));
+        second_fin.read((char*)array_wide, size_wide * sizeof(uint32_t));
+        if (!second_fin) {
+                LOGERROR("Cannot read the second index " << file_second_filename);
+                delete []array_ptr;
+                delete []array_wide;
+                array_ptr = nullptr;
+                array_wide = nullptr;
+                size = size_wide = 0;
+                return;
+        }
+        segments.resize(num_segment);
+        for (uint64_t k = 0; k < num_segment; ++k) {
+                segments[k] = Segment{begs[k], counts[k], offsets[k]};
+        }
 }
 
-uint32_t SecondIndex::size_min = 200;
+const uint32_t SecondIndex::kSizeMinDefault;
 
 SecondIndex::~SecondIndex()
 {
         delete []array_ptr;
+        delete []array_wide;
 }
 
 
-void SecondIndex::RebuildIndex(BuildIndexRawData &build_index) {
-        std::string str_iter(size_seed, 0);
+/// Characters of a rank key, 3 bits each
+static const uint32_t kRankChars = 21;
+/// Segments are ranked in tasks of at least this many suffixes
+static const uint32_t kRankBatchSize = 1u << 15;
+
+/// 3-bit codes of the characters, in the order of SortSbwt: past the end
+/// (0) < '$' < A < C < G < T
+struct RankCodeTable {
+        RankCodeTable()
+        {
+                for (int ch = 0; ch < 256; ++ch) {
+                        code[ch] = ch == '$' ? 1 : RadixCode((char)ch) + 2;
+                }
+        }
+        uint8_t code[256];
+};
+static const RankCodeTable kRankCode;
+
+static inline uint64_t RankCode(char ch)
+{
+        return kRankCode.code[(uint8_t)ch];
+}
+
+/// The kRankChars characters of the plain suffix at t, the first one in the
+/// most significant bits
+static inline uint64_t PackRankKey(const char *seq, uint64_t N, uint64_t t)
+{
+        uint64_t key = 0;
+        if (t + kRankChars <= N) {
+                for (uint32_t k = 0; k < kRankChars; ++k) {
+                        key = (key << 3) | RankCode(seq[t + k]);
+                }
+                return key;
+        }
+        for (uint32_t k = 0; k < kRankChars; ++k, ++t) {
+                key = (key << 3) | (t < N ? RankCode(seq[t]) : 0);
+        }
+        return key;
+}
+
+/**
+ * Ranks the suffixes of a second-index segment by their plain (step 1)
+ * suffixes some depth further, as SortSbwt orders them, up to the span the
+ * search compares: the keys of their next kRankChars characters are radix
+ * sorted, and runs of equal keys are ranked again on the following ones, or
+ * against a pivot once they hardly split. Suffixes that all run out, or tie
+ * over the whole span, are ordered by position: a tandem repeat is not
+ * compared past the span. The buffers are kept from one segment to the
+ * next.
+ */
+template <typename TOffset>
+class SegmentRanker {
+public:
+        /// out[r]: the index in pos[0, count) of the suffix of rank r on
+        /// [depth, depth + span), or out[k - 1] for the node k of rank r in
+        /// the Eytzinger layout
+        template <typename TEntry>
+        void Rank(const char *seq, TOffset N, const TOffset *pos, uint32_t count, uint64_t depth,
+                  uint32_t span, uint32_t layout, TEntry *out)
+        {
+                depth_end = depth + span;
+                key.resize(count);
+                idx.resize(count);
+                for (uint32_t j = 0; j < count; ++j) {
+                        idx[j] = j;
+                }
+                stack.assign(1, Run{0, count, depth, false});
+                while (!stack.empty()) {
+                        Run run = stack.back();
+                        stack.pop_back();
+                        if (run.is_repeat) {
+                                RankOnPivot(seq, N, pos, run);
+                                continue;
+                        }
+                        for (uint32_t r = run.beg; r < run.end; ++r) {
+                                key[r] = PackRankKey(seq, N, (uint64_t)pos[idx[r]] + run.depth);
+                        }
+                        SortKeys(run.beg, run.end);
+                        for (uint32_t r = run.beg, e = 0; r < run.end; r = e) {
+                                for (e = r + 1; e < run.end && key[e] == key[r]; ++e) {}
+                                SplitTies(pos, r, e, run.depth + kRankChars, run.end - run.beg);
+                        }
+                }
+                if (layout == SecondIndex::kLayoutEytzinger) {
+                        uint64_t k = SecondIndex::EytzingerFirst(count);
+                        for (uint32_t r = 0; r < count; ++r, k = SecondIndex::EytzingerNext(k, count)) {
+                                out[k - 1] = idx[r];
+                        }
+                } else {
+                        std::copy(idx.begin(), idx.end(), out);
+                }
+        }
+
+private:
+        struct Run {
+                uint32_t beg, end;
+                uint64_t depth;
+                bool is_repeat;         /* most of its parent run tied */
+        };
+
+        /// Ties [r, e) of a run of size_run are ranked on from depth, unless
+        /// they all ran out or depth is past the span
+        void SplitTies(const TOffset *pos, uint32_t r, uint32_t e, uint64_t depth, uint32_t size_run)
+        {
+                if (e - r < 2) {
+                        return;
+                }
+                if ((key[r] & 7) == 0 || depth >= depth_end) {
+                        /* all of them ran out, or tie on the span: ordered by position */
+                        std::sort(idx.begin() + r, idx.begin() + e,
+                                  [pos](uint32_t a, uint32_t b) { return pos[a] < pos[b]; });
+                } else {
+                        stack.push_back(Run{r, e, depth, e - r >= 64 && (e - r) * 8 >= size_run * 7});
+                }
+        }
+
+        /**
+         * The run is most of its parent run, as in long repeats: rather than
+         * going on kRankChars at a time, every suffix is compared word by
+         * word with the middle one (the pivot), up to l, the length they
+         * share within the span. Those below it come first, by increasing
+         * l, then the pivot and those sharing the rest of the span with it,
+         * then those above it, by decreasing l; ties of l and of the
+         * character at l are ranked on past it.
+         */
+        void RankOnPivot(const char *seq, TOffset N, const TOffset *pos, const Run &run)
+        {
+                const uint64_t depth = run.depth;
+                const uint64_t pivot = (uint64_t)pos[idx[run.beg + (run.end - run.beg) / 2]] + depth;
+                const uint64_t max_l = (1ull << 56) - 1;
+                const uint64_t size_rest = depth_end - depth;
+                for (uint32_t r = run.beg; r < run.end; ++r) {
+                        uint64_t t = (uint64_t)pos[idx[r]] + depth;
+                        uint64_t l = t == pivot ? size_rest : SharedLength(seq, N, pivot, t, size_rest);
+                        if (l == size_rest) {
+                                key[r] = 1ull << 62;
+                                continue;
+                        }
+                        uint64_t code = t + l < N ? RankCode(seq[t + l]) : 0;
+                        uint64_t code_pivot = pivot + l < N ? RankCode(seq[pivot + l]) : 0;
+                        key[r] = code < code_pivot ? (l << 3) | code
+                                                   : (2ull << 62) | ((max_l - l) << 3) | code;
+                }
+                SortKeys(run.beg, run.end);
+                for (uint32_t r = run.beg, e = 0; r < run.end; r = e) {
+                        for (e = r + 1; e < run.end && key[e] == key[r]; ++e) {}
+                        if (key[r] == 1ull << 62) {
+                                SplitTies(pos, r, e, depth_end, run.end - run.beg);
+                                continue;
+                        }
+                        uint64_t l = (key[r] >> 3) & max_l;
+                        SplitTies(pos, r, e, depth + ((key[r] >> 62) ? max_l - l : l) + 1, run.end - run.beg);
+                }
+        }
+
+        /// Length of the common prefix of the plain suffixes at a and b, up
+        /// to max_length
+        static uint64_t SharedLength(const char *seq, uint64_t N, uint64_t a, uint64_t b, uint64_t max_length)
+        {
+                uint64_t l = 0;
+                for (uint64_t x, y; l + 8 <= max_length && a + l + 8 <= N && b + l + 8 <= N; l += 8) {
+                        memcpy(&x, seq + a + l, 8);
+                        memcpy(&y, seq + b + l, 8);
+                        if (x != y) {
+                                break;
+                        }
+                }
+                while (l < max_length && a + l < N && b + l < N && seq[a + l] == seq[b + l]) {
+                        ++l;
+                }
+                return l;
+        }
+
+        /// Sort (key, idx)[beg, end) by key: LSD radix on bytes, skipping
+        /// the bytes all keys share; insertion sort for a few keys
+        void SortKeys(uint32_t beg, uint32_t end)
+        {
+                const uint32_t n = end - beg;
+                if (n < 32) {
+                        for (uint32_t r = beg + 1; r < end; ++r) {
+                                uint64_t k = key[r];
+                                uint32_t j = idx[r];
+                                uint32_t s = r;
+                                for (; s > beg && key[s - 1] > k; --s) {
+                                        key[s] = key[s - 1];
+                                        idx[s] = idx[s - 1];
+                                }
+                                key[s] = k;
+                                idx[s] = j;
+                        }
+                        return;
+                }
+                hist.assign(8 * 256, 0);
+                for (uint32_t r = beg; r < end; ++r) {
+                        for (uint32_t d = 0; d < 8; ++d) {
+                                ++hist[d * 256 + ((key[r] >> (8 * d)) & 0xFF)];
+                        }
+                }
+                key_tmp.resize(key.size());
+                idx_tmp.resize(idx.size());
+                uint64_t *src_key = &key[beg], *dst_key = &key_tmp[beg];
+                uint32_t *src_idx = &idx[beg], *dst_idx = &idx_tmp[beg];
+                for (uint32_t d = 0; d < 8; ++d) {
+                        uint32_t *h = &hist[d * 256];
+                        if (h[(src_key[0] >> (8 * d)) & 0xFF] == n) {
+                                continue;
+                        }
+                        uint32_t sum = 0;
+                        for (uint32_t b = 0; b < 256; ++b) {
+                                uint32_t c = h[b];
+                                h[b] = sum;
+                                sum += c;
+                        }
+                        for (uint32_t r = 0; r < n; ++r) {
+                                uint32_t to = h[(src_key[r] >> (8 * d)) & 0xFF]++;
+                                dst_key[to] = src_key[r];
+                                dst_idx[to] = src_idx[r];
+                        }
+                        std::swap(src_key, dst_key);
+                        std::swap(src_idx, dst_idx);
+                }
+                if (src_key != &key[beg]) {
+                        std::copy(src_key, src_key + n, &key[beg]);
+                        std::copy(src_idx, src_idx + n, &idx[beg]);
+                }
+        }
+
+        vector<uint64_t> key, key_tmp;
+        vector<uint32_t> idx, idx_tmp;
+        vector<uint32_t> hist;
+        vector<Run> stack;
+        uint64_t depth_end;             /* end of the span ranked */
+};
+
+/**
+ * The segments of the second index saved in the checkpoint, checked against
+ * the ones RebuildIndexInit found (positions and sizes of their entries).
+ * Returns the number of segments done, 0 if there is nothing (valid) to
+ * resume; size_done and size_wide_done are the entries they fill.
+ */
+template <typename TOffset>
+static size_t ResumeSecondIndex(BasicIndexRawData<TOffset> &build_index, SecondIndex &second,
+                                vector<TOffset> &seg_begin, uint64_t &size_done, uint64_t &size_wide_done)
+{
+        const vector<SecondIndex::Segment> &segments = second.segments;
+        uint64_t size_saved = 0, size_wide_saved = 0;
+        TOffset i = 0;
+        size_done = size_wide_done = 0;
+        if (!build_index.checkpoint
+            || !build_index.checkpoint->LoadSecond(second.array_ptr, second.size, size_saved,
+                                                   second.array_wide, second.size_wide, size_wide_saved,
+                                                   seg_begin, i)) {
+                seg_begin.clear();
+                return 0;
+        }
+
+        const size_t num_done = seg_begin.size();
+        bool is_valid = num_done <= segments.size();
+        for (size_t k = 0; k < num_done && is_valid; ++k) {
+                const SecondIndex::Segment &seg = segments[k];
+                (SecondIndex::IsWide(seg.count) ? size_wide_done : size_done)
+                        += (uint64_t)seg.count * build_index.period;
+                is_valid = seg_begin[k] == seg.beg;
+        }
+        if (!is_valid || size_done != size_saved || size_wide_done != size_wide_saved) {
+                LOGINFO("Second index of the checkpoint is corrupt, building it again\n");
+                seg_begin.clear();
+                size_done = size_wide_done = 0;
+                return 0;
+        }
+        LOGINFO("Second index from the checkpoint, " << num_done << " of "
+                << segments.size() << " segments\n");
+        return num_done;
+}
 
+/**
+ * Every segment (a group of at least size_min suffixes sharing their seed,
+ * the spaced k-mer of size_seed characters) gets, for every
+ * tau < period, the ranks of its suffixes on their plain characters
+ * [tau*size_seed, (tau+1)*size_seed), ties by position, as indexes in the
+ * segment: SearchSecondIndex compares no further.
+ * SA is left as it is.
+ *
+ * RebuildIndexInit found the segments and their offsets, so they are ranked
+ * in parallel, straight into their place. With a checkpoint they go in
+ * rounds of N/kCheckpointRounds suffixes, each saved once done.
+ */
+template <typename TOffset>
+void SecondIndex::RebuildIndex(BasicIndexRawData<TOffset> &build_index) {
         auto seq = build_index.seq_raw;
         auto SA = build_index.suffix_array;
-        auto X = build_index.seq_raw;
         auto N = build_index.length_ref;
         auto period = build_index.period;
 
@@ -1190,281 +2950,306 @@ void SecondIndex::RebuildIndex(BuildIndexRawData &build_index) {
                 std::cerr << "The length is less than " << size_seed << std::endl;
                 return;
         }
+        ReportPhase phase(build_index.report, "second-index", period);
 
-        uint32_t count;
-        uint32_t loop_end = size_seed * period;
-        /// Build second index
-        count = 0;
-        uint32_t index_array = 0;
-        uint32_t beg0 = 0;
-        uint32_t end0 = 0;
-        uint32_t depth0 = 0;
-        for (uint32_t i = 0; i < N; ++i) {
-                for (uint32_t j = 0; j < loop_end; j+=period) {
-                        if (str_iter[j/period] != X[(j+SA[i])%N]) {
-                                if (count != 0) {
-                                        /// Sort blockwise
-                                        if (count >= size_min && count < 65536) {
-                                                beg0 = i - count;
-                                                end0 = i;
-                                                uint32_t pos_saved = SA[beg0];
-#if DEBUG_SECONDINDEX
-                                                cout << "beg0: " << beg0
-                                                     << ",end0: " << end0
-                                                     <<  ",count: " << count
-                                                     << ",SA[beg0]: " << SA[beg0]
-                                                     << ",index_array: " << index_array
-                                                     << endl;
-#endif
-                                                unordered_map<uint32_t, uint16_t > mmap;
-                                                /// to restore SA[beg0, end0)
-                                                vector<uint32_t > index_backup(count,0);
-                                                uint16_t tmp0 = 0;
-                                                for (uint32_t u = beg0; u < end0; ++u) {
-                                                        mmap[SA[u]] = tmp0;
-                                                        index_backup[tmp0] = SA[u];
-                                                        ++tmp0;
-                                                }
-
-                                                for (uint32_t tau = 0; tau != period; ++tau) {
-                                                        depth0 = tau * size_seed;
-                                                        SortSbwt(seq, SA, beg0, end0, depth0, N, 1, depth0 + size_seed);
-#if DEBUG_SECONDINDEX
-                                                        for (uint32_t u = beg0; u < end0; ++u) {
-                                                                for (uint32_t k0 = 0; k0 < loop_end; ++k0) {
-                                                                        if (k0 % period == 0) {
-                                                                                cout << "\033[1;31m" << X[(SA[u] + k0) % N] << "\033[0m";
-                                                                        }
-                                                                        else {
-                                                                                cout << X[(SA[u] + k0) % N];
-                                                                        }
-                                                                        if (k0 % size_seed == (size_seed-1)) {
-                                                                                cout << " ";
-                                                                        }
-                                                                }
-                                                                cout << endl;
-                                                        }
-#endif
-                                                        for (uint32_t u = beg0; u < end0; ++u) {
-                                                                uint32_t i_shift = (u-beg0) + index_array + 3 + tau*count;
-                                                                *(this->array_ptr + i_shift) = mmap[SA[u]];
-#if DEBUG_SECONDINDEX
-                                                                cout << *(array_ptr +i_shift) << " ";
-#endif
-                                                        }
-#if DEBUG_SECONDINDEX
-                                                        cout << endl;
-#endif
-                                                }
-
-                                                /// exchange
-                                                uint16_t *p16 = this->array_ptr + index_array;
-                                                uint32_t *p32 = (uint32_t*) p16;
-                                                *p32 = pos_saved;
-                                                /// restore SA
-                                                for (uint32_t u = beg0; u < end0; ++u) {
-                                                        SA[u] = index_backup[u - beg0];
-                                                }
-                                                /// change the first element of SA
-                                                SA[beg0] = index_array;
-                                                *(this->array_ptr+index_array+2) = (uint16_t)count;
-
-                                                index_array += count*period + 3;
-                                        }
-                                }
+        BuildCheckpoint<TOffset> *checkpoint = build_index.checkpoint;
+        vector<TOffset> seg_begin;      /* SA position of every segment done */
+        uint64_t size_done = 0, size_wide_done = 0;
+        size_t seg = ResumeSecondIndex(build_index, *this, seg_begin, size_done, size_wide_done);
+        const uint64_t size_round = checkpoint ? std::max<uint64_t>(N / kCheckpointRounds, 1) : (uint64_t)N;
 
-                                count = 0;
-                                for (uint32_t k = 0; k != size_seed; ++k) {
-                                        str_iter[k] = X[(k*period+SA[i])%N];
-                                }
-                                break;
-                        }
-                } /* j */
-                ++count;
-        } /* i */
-
-        /// tail case
-        if (count != 0) {
-                if (count >= size_min && count < 65536) {
-                        beg0 = N-count;
-                        end0 = N;
-                        uint32_t pos_saved = SA[beg0];
-#if DEBUG_SECONDINDEX
-                        cout << beg0 << ", " << end0 <<  "   " << count << endl;
-#endif
-                        unordered_map<uint32_t, uint16_t > mmap;
-                        /// to restore SA[beg0, end0)
-                        vector<uint32_t > index_backup(count,0);
-                        uint16_t tmp0 = 0;
-                        for (uint32_t u = beg0; u < end0; ++u) {
-                                mmap[SA[u]] = tmp0;
-                                index_backup[tmp0] = SA[u];
-                                ++tmp0;
-                        }
-
-                        for (uint32_t tau = 0; tau != period; ++tau) {
-                                depth0 = tau * size_seed;
-                                SortSbwt(seq, SA, beg0, end0, depth0, N, 1, depth0 + size_seed);
-                                for (uint32_t u = beg0; u < end0; ++u) {
-                                        uint32_t i_shift = (u-beg0) + index_array + 3 + tau*count;
-                                        *(this->array_ptr + i_shift) = mmap[SA[u]];
-                                }
+        try {
+                ThreadPool pool(build_index.num_threads);
+                while (seg < segments.size()) {
+                        /// segments [seg, round_end)
+                        size_t round_end = seg;
+                        while (round_end < segments.size()
+                               && segments[round_end].beg < segments[seg].beg + size_round) {
+                                ++round_end;
                         }
+                        RankSegments(pool, seq, N, period, SA, 0, seg, round_end);
 
-                        /// exchange
-                        uint16_t *p16 = this->array_ptr + index_array;
-                        uint32_t *p32 = (uint32_t*) p16;
-                        *p32 = pos_saved;
-                        /// restore SA
-                        for (uint32_t u = beg0; u < end0; ++u) {
-                                SA[u] = index_backup[u - beg0];
+                        for (; seg < round_end; ++seg) {
+                                seg_begin.push_back(segments[seg].beg);
+                                (IsWide(segments[seg].count) ? size_wide_done : size_done)
+                                        += (uint64_t)segments[seg].count * period;
+                        }
+                        if (checkpoint) {
+                                checkpoint->SaveSecond(array_ptr, size_done, array_wide, size_wide_done, seg_begin,
+                                                       seg < segments.size() ? (TOffset)segments[seg].beg : N);
                         }
-                        /// change the first element of SA
-                        SA[beg0] = index_array;
-                        *(this->array_ptr + index_array + 2) = (uint16_t)count;
                 }
+        } catch (...) {
+                LOGERROR("RebuildIndex");
+                throw;
         }
-
-        /*
-         * Cannot show it. Because the BuildIndexRawData is disordered.
-         */
-#if 0
-        /// visualization in array
-        this->PrintSecondIndex(build_index);
-#endif
 }
 
 
-void SecondIndex::PrintSecondIndex(BuildIndexRawData &build_index)
+/// Rank the segments [first, last) on pool, in batches of kRankBatchSize
+/// suffixes; sa holds SA from the position base on
+template <typename TOffset>
+void SecondIndex::RankSegments(ThreadPool &pool, const char *seq, TOffset N, uint32_t period,
+                               const TOffset *sa, uint64_t base, size_t first, size_t last)
 {
-        if (this->array_ptr == nullptr) {
-                return;
+        while (first < last) {
+                size_t batch_end = first;
+                uint64_t batch_size = 0;
+                while (batch_end < last && batch_size < kRankBatchSize) {
+                        batch_size += segments[batch_end++].count;
+                }
+                pool.Submit([this, first, batch_end, seq, sa, base, N, period]() {
+                        SegmentRanker<TOffset> ranker;
+                        for (size_t k = first; k < batch_end; ++k) {
+                                const Segment &s = segments[k];
+                                const TOffset *pos = sa + (s.beg - base);
+                                for (uint32_t tau = 0; tau != period; ++tau) {
+                                        uint64_t offset = s.offset + (uint64_t)tau * s.count;
+                                        if (IsWide(s.count)) {
+                                                ranker.Rank(seq, N, pos, s.count, (uint64_t)tau * size_seed,
+                                                            size_seed, layout, array_wide + offset);
+                                        } else {
+                                                ranker.Rank(seq, N, pos, s.count, (uint64_t)tau * size_seed,
+                                                            size_seed, layout, array_ptr + offset);
+                                        }
+                                }
+                        }
+                });
+                first = batch_end;
         }
+        pool.Wait();
+}
 
-        std::string str_iter(size_seed, 0);
 
+template <typename TOffset>
+void SecondIndex::PrintSecondIndex(BasicIndexRawData<TOffset> &build_index)
+{
         auto SA = build_index.suffix_array;
         auto X = build_index.seq_raw;
         auto N = build_index.length_ref;
         auto period = build_index.period;
+        uint32_t loop_end = size_seed * period;
 
-        if (N <= size_seed) {
-                std::cerr << "The length is less than " << size_seed << std::endl;
-                return;
+        /// A suffix, its seed in red
+        auto PrintSuffix = [&](TOffset p0) {
+                for (uint32_t j0 = 0; j0 < loop_end; ++j0) {
+                        if (j0 % period == 0) {
+                                cout << "\033[1;31m" << X[(j0 + p0) % N] << "\033[0m";
+                        }
+                        else {
+                                cout << X[(j0 + p0) % N];
+                        }
+                        if (j0 % size_seed == (size_seed-1)) {
+                                cout << " ";
+                        }
+                }
+                cout << endl;
+        };
+
+        for (const Segment &seg : segments) {
+                cout << "beg0: "        << seg.beg
+                     << ",end0: "       << seg.beg + seg.count
+                     << ",SA[beg0]: "   << SA[seg.beg]
+                     << ",seg_size: "   << seg.count
+                     << ",period: "     << period
+                     << endl;
+                cout << "Before second index" << endl;
+                for (uint32_t i0 = 0; i0 < seg.count; ++i0) {
+                        PrintSuffix(SA[seg.beg + i0]);
+                }
+                cout << "Second index" << endl;
+                for (uint32_t tau = 0; tau < period; ++tau) {
+                        uint64_t offset = seg.offset + (uint64_t)tau * seg.count;
+                        auto entry = [&](uint32_t i0) -> uint32_t {
+                                return IsWide(seg.count) ? array_wide[offset + i0] : array_ptr[offset + i0];
+                        };
+                        cout << endl;
+                        for (uint32_t i0 = 0; i0 < seg.count; ++i0) {
+                                cout << entry(i0) << " ";
+                        }
+                        cout << endl;
+                        for (uint32_t i0 = 0; i0 < seg.count; ++i0) {
+                                PrintSuffix(SA[seg.beg + entry(i0)]);
+                        }
+                }
         }
+}
 
-        uint32_t count;
-        uint32_t loop_end = size_seed * period;
 
-        count = 0;
-        for (uint32_t i = 0; i < N; ++i) {
-                for (uint32_t j = 0; j < loop_end; j+=period) {
-                        if (str_iter[j/period] != X[(j+SA[i])%N]) {
-                                if (count != 0) {
-                                        /// Sort blockwise
-                                        if (count >= size_min && count < 65536) {
-                                                /// Caution: may bring into SEGERROR
-                                                /// because SA[i] in "if (str_iter[j/period] != X[(j+SA[i])%N])" is
-                                                /// changed into index of array.
-                                                uint32_t beg0 = i - count - 1;
-                                                uint32_t end0 = i;
-                                                uint32_t index_array = SA[beg0];
-                                                uint16_t *p16 = this->array_ptr + index_array;
-                                                uint32_t *p32 = (uint32_t*) p16;
-                                                uint32_t pos = *p32;
-                                                cout << "beg0: "        << beg0
-                                                     << ",end0: "       << end0
-                                                     << ",SA[beg0]: "   << SA[beg0]
-                                                     << ",seg_size: "   << p16[2]
-                                                     << ",pos: "        << pos
-                                                     << ",period: "     << period
-                                                     << endl;
-                                                uint16_t size_seg = p16[2];
-                                                cout << "Before second index" << endl;
-                                                for (uint32_t i0 = beg0; i0 < end0; ++i0) {
-                                                        uint32_t p0 = SA[i0];
-                                                        if (i0 == beg0) {
-                                                                p0 = pos;
-                                                        }
-                                                        for (uint32_t j0 = 0; j0 < loop_end; ++j0) {
-                                                                if (j0 % period == 0) {
-                                                                        cout << "\033[1;31m" << X[(j0 + p0) % N] << "\033[0m";
-                                                                }
-                                                                else {
-                                                                        cout << X[(j0 + p0) % N];
-                                                                }
-                                                                if (j0 % size_seed == (size_seed-1)) {
-                                                                        cout << " ";
-                                                                }
-                                                        }
-                                                        cout << endl;
-                                                }
-                                                cout << "Second index" << endl;
-                                                p16 += 3;
-                                                for (uint32_t tau = 0; tau < period; ++tau) {
-                                                        cout << endl;
-                                                        for (uint32_t i0 = 0; i0 < size_seg; ++i0) {
-                                                                cout << p16[i0] << " ";
-                                                        }
-                                                        cout << endl;
-
-                                                        for (uint32_t i0 = 0; i0 < size_seg; ++i0) {
-                                                                uint32_t p0 = SA[p16[i0] + beg0];
-                                                                if (p0 == 0) {
-                                                                        p0 = pos;
-                                                                }
-
-                                                                for (uint32_t j0 = 0; j0 < loop_end; ++j0) {
-                                                                        if (j0 % period == 0) {
-                                                                                cout << "\033[1;31m" << X[(j0 + p0) % N] << "\033[0m";
-                                                                        }
-                                                                        else {
-                                                                                cout << X[(j0 + p0) % N];
-                                                                        }
-                                                                        if (j0 % size_seed == (size_seed-1)) {
-                                                                                cout << " ";
-                                                                        }
-                                                                }
-                                                                cout << endl;
-                                                        }
-                                                        p16 += size_seg;
-                                                }
-                                        }
-                                }
 
-                                count = 0;
-                                for (uint32_t k = 0; k != size_seed; ++k) {
-                                        str_iter[k] = X[(k*period+SA[i])%N];
-                                }
-                                break;
-                        }
-                } /* j */
-                ++count;
-        } /* i */
+bool SecondIndex::Empty()
+{
+        return segments.empty();
+}
+
+/// Binary search without branches: base narrows down to the last segment
+/// starting at beg or before
+const SecondIndex::Segment *SecondIndex::Find(uint64_t beg) const
+{
+        if (segments.empty()) {
+                return nullptr;
+        }
+        const Segment *base = segments.data();
+        for (size_t n = segments.size(); n > 1; ) {
+                size_t half = n / 2;
+                base = base[half].beg <= beg ? base + half : base;
+                n -= half;
+        }
+        return base->beg == beg ? base : nullptr;
+}
 
-        /// tail case
-        if (count != 0) {
-                if (count >= size_min && count < 65536) {
-                        /// Ignore
+
+/// Whether the suffixes a and b share their seed, the spaced k-mer of
+/// size_seed characters (wrapping around the end)
+template <typename TOffset>
+static inline bool SameSeed(const char *X, TOffset N, uint32_t period, uint32_t size_seed, TOffset a, TOffset b)
+{
+        uint64_t last = (uint64_t)(size_seed - 1) * period;
+        if (a + last < N && b + last < N) {
+                for (uint64_t j = 0; j <= last; j += period) {
+                        if (X[a + j] != X[b + j]) {
+                                return false;
+                        }
+                }
+                return true;
+        }
+        for (uint64_t j = 0; j <= last; j += period) {
+                if (X[(a + j) % N] != X[(b + j) % N]) {
+                        return false;
                 }
         }
+        return true;
+}
 
+/// The groups of at least size_found consecutive suffixes sharing their
+/// seed that start in SA[base, end), found by slices in parallel and
+/// appended in SA order, and the sizes of all of them added to groups; sa
+/// holds SA[base, end), and no group goes on past end
+template <typename TOffset>
+static void FindSegments(ThreadPool &pool, const char *X, TOffset N, uint32_t period, uint32_t size_seed,
+                         uint64_t size_found, const TOffset *sa, TOffset base, TOffset end,
+                         vector<SecondIndex::Segment> &found, SizeHistogram &groups)
+{
+        /// A slice takes the groups starting in it, up to their end
+        const uint32_t num_slice = pool.Size();
+        vector<vector<SecondIndex::Segment> > slice_segments(num_slice);
+        vector<SizeHistogram> slice_groups(num_slice);
+        for (uint32_t s = 0; s < num_slice; ++s) {
+                pool.Submit([&, s]() {
+                        const TOffset slice_begin = base + RadixSliceBegin<TOffset>(end - base, s, num_slice);
+                        const TOffset slice_end = base + RadixSliceBegin<TOffset>(end - base, s + 1, num_slice);
+                        TOffset i = slice_begin;
+                        while (i < slice_end && i > base
+                               && SameSeed(X, N, period, size_seed, sa[i-1-base], sa[i-base])) {
+                                ++i;
+                        }
+                        while (i < slice_end) {
+                                TOffset j = i + 1;
+                                while (j < end && SameSeed(X, N, period, size_seed, sa[j-1-base], sa[j-base])) {
+                                        ++j;
+                                }
+                                TOffset count = j - i;
+                                if (count >= size_found && count <= UINT32_MAX) {
+                                        slice_segments[s].push_back(SecondIndex::Segment{i, (uint32_t)count, 0});
+                                }
+                                slice_groups[s].Add(count);
+                                i = j;
+                        }
+                });
+        }
+        pool.Wait();
+        for (uint32_t s = 0; s < num_slice; ++s) {
+                found.insert(found.end(), slice_segments[s].begin(), slice_segments[s].end());
+                const SizeHistogram &sg = slice_groups[s];
+                if (groups.count.size() < sg.count.size()) {
+                        groups.count.resize(sg.count.size(), 0);
+                        groups.total.resize(sg.count.size(), 0);
+                }
+                for (size_t b = 0; b < sg.count.size(); ++b) {
+                        groups.count[b] += sg.count[b];
+                        groups.total[b] += sg.total[b];
+                }
+        }
 }
 
+/// Cost of a probe of the second index, in verifications of the range
+/// scan: both make about a random access into SA and one into the
+/// reference, and a probe also packs and compares the key
+static const uint32_t kProbeCost = 2;
 
+/// A read in a group of c suffixes costs up to c verifications by the range
+/// scan, and period binary searches of log2(c) + 1 probes through the
+/// second index: the least power of two c where the latter is cheaper
+uint64_t SecondIndex::SizeMinCrossover(uint32_t period)
+{
+        uint64_t c = 2;
+        for (uint32_t k = 1; c < (uint64_t)period * kProbeCost * (k + 1); ++k) {
+                c *= 2;
+        }
+        return c;
+}
 
-bool SecondIndex::Empty()
+/**
+ * A read falls in a group of c suffixes with a probability of c/N, so the
+ * cost it saves per byte of segment grows with c, and the best segments
+ * under a cap on their bytes are the groups from some size on: the
+ * crossover of the costs, or the least power of two above it whose
+ * segments (entries and directory) fit into max_bytes. Powers of two only,
+ * where the histogram of the sizes is exact.
+ */
+void SecondIndex::TuneSizeMin(const SizeHistogram &groups, uint32_t period, uint64_t max_bytes)
 {
-        return this->array_ptr == nullptr;
+        uint64_t c = SizeMinCrossover(period);
+        for (; c <= UINT32_MAX / 2; c *= 2) {
+                uint64_t bytes = 0;
+                for (uint32_t b = 63 - __builtin_clzll(c); b < groups.count.size(); ++b) {
+                        uint64_t size_entry = IsWide(1ull << b) ? sizeof(uint32_t) : sizeof(uint16_t);
+                        bytes += groups.total[b] * period * size_entry + groups.count[b] * sizeof(Segment);
+                }
+                if (bytes <= max_bytes) {
+                        break;
+                }
+        }
+        size_min = (uint32_t)c;
 }
 
+void SecondIndex::SelectSegments(vector<Segment> &found, const SizeHistogram &groups, uint32_t period,
+                                 BuildReport *report)
+{
+        if (report) {
+                report->AddHistogram("seed-group-size", period, groups);
+        }
+        if (!tune_max_bytes) {
+                return;
+        }
+        TuneSizeMin(groups, period, tune_max_bytes);
+        LOGINFO("Least size of a second index segment: " << size_min << " (crossover "
+                << SizeMinCrossover(period) << ", at most " << tune_max_bytes << " bytes)\n");
+        found.erase(std::remove_if(found.begin(), found.end(),
+                                   [this](const Segment &seg) { return seg.count < size_min; }),
+                    found.end());
+}
+
+void SecondIndex::AppendSegments(const vector<Segment> &found, uint32_t period)
+{
+        for (Segment seg : found) {
+                uint64_t &size_array = IsWide(seg.count) ? size_wide : size;
+                seg.offset = size_array;
+                size_array += (uint64_t)seg.count * period;
+                segments.push_back(seg);
+        }
+}
 
-/// Init SecondIndex data structure
-void SecondIndex::RebuildIndexInit(BuildIndexRawData &build_index, uint32_t size_seed)
+/// Init SecondIndex data structure: the segments, i.e. the groups of
+/// consecutive suffixes of SA sharing their seed with at least size_min of
+/// them (chosen from all the groups if tuned), and their offsets in
+/// array_ptr or array_wide
+template <typename TOffset>
+void SecondIndex::RebuildIndexInit(BasicIndexRawData<TOffset> &build_index, uint32_t size_seed)
 {
         this->size_seed = size_seed;
-        std::string str_iter(size_seed, 0);
-        size = 0;
+        size = size_wide = 0;
+        segments.clear();
 
         auto SA = build_index.suffix_array;
         auto X = build_index.seq_raw;
@@ -1475,42 +3260,166 @@ void SecondIndex::RebuildIndexInit(BuildIndexRawData &build_index, uint32_t size
                 std::cerr << "The length is less than " << size_seed << std::endl;
                 return;
         }
+        ReportPhase phase(build_index.report, "second-index-init", period);
 
-        uint32_t count;
-        uint32_t loop_end = size_seed * period;
+        vector<Segment> found;
+        SizeHistogram groups;
+        try {
+                ThreadPool pool(build_index.num_threads);
+                FindSegments(pool, X, N, period, size_seed, tune_max_bytes ? SizeMinCrossover(period) : size_min,
+                             SA, (TOffset)0, N, found, groups);
+        } catch (...) {
+                LOGERROR("RebuildIndexInit");
+                throw;
+        }
+        SelectSegments(found, groups, period, build_index.report);
+        AppendSegments(found, period);
 
-        count = 0;
-        for (uint32_t i = 0; i < N; ++i) {
-                for (uint32_t j = 0; j < loop_end; j+=period) {
-                        if (str_iter[j/period] != X[(j+SA[i])%N]) {
-                                if (count != 0) {
-                                        /// Sort blockwise
-                                        //cout << (i - count) << "," << (i) << endl;
-                                        if (count >= size_min && count < 65536/* TODO */) {
-                                                size += 3 + count*period;
-                                        }
-                                }
+        array_ptr = new uint16_t[size];
+        array_wide = new uint32_t[size_wide];
+        if (build_index.report) {
+                build_index.report->AddBytes("second-index", period,
+                                             size * sizeof(uint16_t) + size_wide * sizeof(uint32_t));
+                build_index.report->AddBytes("second-index-segments", period, segments.size() * sizeof(Segment));
+        }
+}
+
+/// Suffixes of SA read at a time by RebuildIndexFromFiles
+static const uint32_t kStreamBlockSize = 1u << 22;
+
+/**
+ * The second index of index files already built, which may have one or
+ * not: build_index holds their reference only (see BasicIndexRawData), and
+ * their SA, bit-packed or not, is streamed from the array file in blocks of
+ * kStreamBlockSize suffixes. A block is cut before its last group of
+ * suffixes sharing their seed, which is carried over to the next one, so
+ * that every segment is whole in a block. The segments are found in a
+ * first pass, which sizes the entries, and ranked in a second one, in
+ * parallel as RebuildIndexInit and RebuildIndex do.
+ */
+template <typename TOffset>
+void SecondIndex::RebuildIndexFromFiles(BasicIndexRawData<TOffset> &build_index, const string &prefix_filename,
+                                        uint32_t size_seed)
+{
+        this->size_seed = size_seed;
+        size = size_wide = 0;
+        segments.clear();
+        delete []array_ptr;
+        delete []array_wide;
+        array_ptr = nullptr;
+        array_wide = nullptr;
 
-                                count = 0;
-                                for (uint32_t k = 0; k != size_seed; ++k) {
-                                        str_iter[k] = X[(k*period+SA[i])%N];
+        auto X = build_index.seq_raw;
+        auto N = build_index.length_ref;
+        auto period = build_index.period;
+
+        if (N <= size_seed) {
+                std::cerr << "The length is less than " << size_seed << std::endl;
+                return;
+        }
+        string file_array_filename = IndexFilename(build_index, prefix_filename, ".array.sbwt");
+
+        /// Visit the blocks: visit(sa, base, end) with sa holding
+        /// SA[base, end), the groups starting there ending by end
+        vector<TOffset> buffer;
+        auto StreamSuffixArray = [&](const std::function<void(const TOffset*, TOffset, TOffset)> &visit) {
+                std::ifstream array_fin(file_array_filename.c_str(), std::ios_base::in | ios::binary);
+                array_fin.seekg(OffsetSuffixArray(build_index));
+                SaReader<TOffset> sa_fin(array_fin, build_index.is_sa_packed);
+                TOffset base = 0, end = 0;
+                while (end < N) {
+                        TOffset size_block = std::min<TOffset>(kStreamBlockSize, N - end);
+                        buffer.resize(end - base + size_block);
+                        if (!sa_fin.Read(buffer.data() + (end - base), size_block)) {
+                                LOGERROR("Cannot read the suffix array of " << file_array_filename);
+                                throw std::runtime_error("RebuildIndexFromFiles");
+                        }
+                        end += size_block;
+                        TOffset cut = end;
+                        if (end < N) {
+                                for (--cut; cut > base
+                                     && SameSeed(X, N, period, size_seed, buffer[cut-1-base], buffer[cut-base]); --cut) {}
+                                if (cut == base) {
+                                        /* one group so far */
+                                        continue;
                                 }
-                                break;
                         }
-                } /* j */
-                ++count;
-        } /* i */
-
-        /// tail case
-        if (count != 0) {
-                if (count >= size_min && count < 65536) {
-                        size += 3 + count*period;
+                        visit(buffer.data(), base, cut);
+                        buffer.erase(buffer.begin(), buffer.begin() + (cut - base));
+                        base = cut;
                 }
-        }
+        };
 
-        array_ptr = new uint16_t[size];
+        try {
+                ThreadPool pool(build_index.num_threads);
+                {
+                        ReportPhase phase(build_index.report, "second-index-init", period);
+                        vector<Segment> found;
+                        SizeHistogram groups;
+                        StreamSuffixArray([&](const TOffset *sa, TOffset base, TOffset end) {
+                                FindSegments(pool, X, N, period, size_seed,
+                                             tune_max_bytes ? SizeMinCrossover(period) : size_min,
+                                             sa, base, end, found, groups);
+                        });
+                        SelectSegments(found, groups, period, build_index.report);
+                        AppendSegments(found, period);
+                }
+                array_ptr = new uint16_t[size];
+                array_wide = new uint32_t[size_wide];
+                if (build_index.report) {
+                        build_index.report->AddBytes("second-index", period,
+                                                     size * sizeof(uint16_t) + size_wide * sizeof(uint32_t));
+                        build_index.report->AddBytes("second-index-segments", period,
+                                                     segments.size() * sizeof(Segment));
+                }
 
+                ReportPhase phase(build_index.report, "second-index", period);
+                size_t seg = 0;
+                StreamSuffixArray([&](const TOffset *sa, TOffset base, TOffset end) {
+                        size_t first = seg;
+                        while (seg < segments.size() && segments[seg].beg < end) {
+                                ++seg;
+                        }
+                        RankSegments(pool, X, N, period, sa, base, first, seg);
+                });
+                if (build_index.report) {
+                        build_index.report->AddBytes("suffix-array-block", period, buffer.capacity() * sizeof(TOffset));
+                }
+        } catch (...) {
+                LOGERROR("RebuildIndexFromFiles");
+                throw;
+        }
 }
 
 
+/// The two offset widths
+#define SBWT_INSTANTIATE_OFFSET(TOffset) \
+        template struct BasicIndexRawData<TOffset>; \
+        template class DifferenceCover<TOffset>; \
+        template void VectorSwap<TOffset>(TOffset, TOffset, TOffset, TOffset*); \
+        template void SortSbwt<TOffset>(char*, TOffset*, TOffset, TOffset, TOffset, const TOffset&, const uint32_t&); \
+        template void SortSbwt<TOffset>(char*, TOffset*, TOffset, TOffset, TOffset, const TOffset&, const uint32_t&, const TOffset&); \
+        template void SortSbwt<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void SortSbwtPacked<TOffset>(char*, TOffset*, TOffset, TOffset, TOffset, const TOffset&, const uint32_t&, DifferenceCover<TOffset>*); \
+        template void SortSbwtBlockwise<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void SortSbwtBlocks<TOffset>(BasicIndexRawData<TOffset>&, const vector<std::pair<TOffset, TOffset> >&, TOffset); \
+        template void SortSbwtBlocks<TOffset>(BasicIndexRawData<TOffset>&, TOffset*, const vector<std::pair<TOffset, TOffset> >&, TOffset, DifferenceCover<TOffset>*); \
+        template void SortSbwtSais<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void TransformCountOccurrence<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void BuildIndex<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void BuildIndexBlockwise<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void BuildIndexSais<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void BuildIndexExternal<TOffset>(BasicIndexRawData<TOffset>&, const string&, uint64_t); \
+        template void BuildSortedIndexBlockwise<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void BuildSortedIndexTransCountOcc<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void PrintFullSearchMatrix<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void SecondIndex::RebuildIndexInit<TOffset>(BasicIndexRawData<TOffset>&, uint32_t); \
+        template void SecondIndex::RebuildIndex<TOffset>(BasicIndexRawData<TOffset>&); \
+        template void SecondIndex::RebuildIndexFromFiles<TOffset>(BasicIndexRawData<TOffset>&, const string&, uint32_t); \
+        template void SecondIndex::PrintSecondIndex<TOffset>(BasicIndexRawData<TOffset>&);
+
+SBWT_INSTANTIATE_OFFSET(uint32_t)
+SBWT_INSTANTIATE_OFFSET(uint64_t)
+#undef SBWT_INSTANTIATE_OFFSET
+
 } /* namespace sbwt */
@@ -12,9 +12,11 @@
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <time.h>
 #include <tuple>
+#include <utility>
 #include <vector>
 #include <string>
 
@@ -25,30 +27,78 @@ namespace sbwt {
 
 using std::string;
 
-struct BuildIndexRawData{
-	BuildIndexRawData();
+class PackedReference;
+template <typename TOffset> class SampledOcc;
+template <typename TOffset> class WaveletOcc;
+template <typename TOffset> class RunLengthIndex;
+template <typename TOffset> class SampledSa;
+template <typename TOffset> class PackedSa;
+template <typename TOffset> class BuildCheckpoint;
+class BuildReport;
+struct SizeHistogram;
+class ThreadPool;
+
+/// Layout of Occ in the array file, chosen at build time
+enum OccFormat {
+        kOccFull = 0,           /* four columns of offsets, before SA */
+        kOccSampled = 1,        /* SampledOcc, after SA */
+        kOccWavelet = 2,        /* WaveletOcc, after SA */
+        kOccRunLength = 3       /* RunLengthIndex, instead of SA too */
+};
+
+/**
+ * The index, templated on the type of the offsets into the reference (SA,
+ * Occ, C and the lengths): uint32_t for references below 4G characters,
+ * uint64_t beyond. The width is chosen at build time and recorded in the
+ * meta file; the 32-bit one keeps half the memory and the cache footprint.
+ */
+template <typename TOffset>
+struct BasicIndexRawData{
+	BasicIndexRawData();
 	/// Build index block-wise (with read reference function)
-        BuildIndexRawData(char *, const uint32_t &/*period*/, const uint32_t&/*# of blocks*/);
+        BasicIndexRawData(char *, const uint32_t &/*period*/, const uint32_t&/*# of blocks*/);
         /// Build index block-wise
-	BuildIndexRawData(char*, size_t, const uint32_t &, const uint32_t&);
-        /// Build index from index files
-        BuildIndexRawData(const string&);
-	~BuildIndexRawData();
+	BasicIndexRawData(char*, size_t, const uint32_t &, const uint32_t&);
+        /// Build index from a reference already read, shared by the periods
+        BasicIndexRawData(const PackedReference&, const uint32_t &/*period*/, const uint32_t&/*# of blocks*/);
+        /// Build index from index files; the reference only, without Occ
+        /// and SA, unless the flag is set
+        BasicIndexRawData(const string&, bool/*Occ and SA too*/ = true);
+	~BasicIndexRawData();
+        void AllocateArrays();
+        /// Allocate seq_raw for the bases with room for the $s and the border
+        void AllocateSequence(uint64_t/*# of bases*/);
+        /// Append the $s to the length_ref bases of seq_raw
+        void AppendDollars();
 	char *seq_raw;			/* Reference sequence */
-	char *seq_transformed;		/* Transformed reference sequence */
-	uint32_t **occurrence;		/* occurrence of A/C/G/T */
-	uint32_t *suffix_array;		/* Suffix array */
-	uint32_t first_column[4];	/* C in the formula, the first column of sbwt matrix*/
+	TOffset **occurrence;		/* occurrence of A/C/G/T */
+        SampledOcc<TOffset> *occ_sampled;       /* Occ sampled in cache lines, instead of occurrence */
+        WaveletOcc<TOffset> *occ_wavelet;       /* Occ as a wavelet tree, instead of occurrence */
+        RunLengthIndex<TOffset> *run_length;    /* run-length BWT sampling SA, instead of occurrence and suffix_array */
+        SampledSa<TOffset> *sa_sampled;         /* SA sampled every sa_sample_rate positions, instead of suffix_array */
+        PackedSa<TOffset> *sa_packed;           /* SA bit-packed, instead of suffix_array */
+	TOffset *suffix_array;		/* Suffix array */
+	TOffset first_column[4];	/* C in the formula, the first column of sbwt matrix*/
 
-	uint32_t length_ref;		/* Length of reference sequence including $s*/
+	TOffset length_ref;		/* Length of reference sequence including $s*/
 	uint32_t num_block_sort;	/* Number of blocks, 4 for 256 */
 	uint32_t num_dollar;		/* The number of $s those are appended to the tail of reference sequence */
 	uint32_t period;		/* The period for sbwt. 1 is used for normal bwt */
+	uint32_t num_threads;		/* Number of threads used to build the index */
+        bool is_ref_shared;             /* The sequence is in the .ref.sbwt file shared by the periods */
+        uint32_t occ_format;            /* OccFormat of the array file */
+        uint32_t sa_sample_rate;        /* SA kept at every sa_sample_rate-th position, 1 for all of it */
+        bool is_sa_packed;              /* SA bit-packed in the array file */
 
         uint8_t *bin_8bit;              /* 8-bit-packed binary sequence */
-        uint32_t size_bin_8bit;         /* Length of packed binary sequence */
+        TOffset size_bin_8bit;          /* Length of packed binary sequence */
+        BuildCheckpoint<TOffset> *checkpoint;   /* Journal of the build to resume it, or nullptr */
+        BuildReport *report;                    /* Telemetry of the build, or nullptr */
 };
 
+typedef BasicIndexRawData<uint32_t> BuildIndexRawData;
+typedef BasicIndexRawData<uint64_t> BuildIndexRawData64;
+
 
 class SecondIndex{
 public:
@@ -56,50 +106,187 @@ public:
 	/// build second index from files stream
         SecondIndex(const string &);
 
-        /// array consists of header and sequence
-	///     1. header: the position in reference;
-        ///     2. size of single segment;
-	///     3. sequence: sorted index (position in SSA).
+        /// Segments: the groups of at least size_min consecutive suffixes
+        /// of SA sharing their seed, by their first position in SA. Their
+        /// entries start at offset in array_ptr, or in array_wide for the
+        /// segments of kWideCount suffixes and more.
+        struct Segment {
+                uint64_t beg;
+                uint32_t count;
+                uint64_t offset;
+        };
+        std::vector<Segment> segments;
+        /// Entries of a segment: for every tau < period, its count suffixes
+        /// in order (index in the segment), 16 or 32 bits, laid out as
+        /// layout says
 	uint16_t *array_ptr;
 	/// size of array_ptr
 	uint64_t size;
-        /// min size of array to sort
-        static uint32_t size_min;
+        uint32_t *array_wide;
+        uint64_t size_wide;
+        /// min size of array to sort, recorded in the second index file
+        uint32_t size_min;
+        static const uint32_t kSizeMinDefault = 200;
+        /// Cap on the bytes of the segments for which size_min is chosen
+        /// from the sizes of the groups (see TuneSizeMin), 0 to keep it
+        uint64_t tune_max_bytes;
         /// size of seed
         uint32_t size_seed;
+        /// Layout of the entries of a tau: sorted, or in Eytzinger order
+        /// (the sorted entries as the breadth-first walk of a complete
+        /// binary search tree, entry k - 1 the node k with children 2k and
+        /// 2k + 1), whose probes down the tree share cache lines
+        enum Layout { kLayoutSorted = 0, kLayoutEytzinger = 1 };
+        uint32_t layout;
 
 	~SecondIndex();
 
 public:
-        void RebuildIndexInit(BuildIndexRawData&, uint32_t);
-        void RebuildIndex(BuildIndexRawData&);
-	void PrintSecondIndex(BuildIndexRawData&);
+        template <typename TOffset> void RebuildIndexInit(BasicIndexRawData<TOffset>&, uint32_t);
+        template <typename TOffset> void RebuildIndex(BasicIndexRawData<TOffset>&);
+        /// Build the second index of the index files "prefix.period" with
+        /// the reference in BasicIndexRawData, streaming their SA
+        template <typename TOffset>
+        void RebuildIndexFromFiles(BasicIndexRawData<TOffset>&, const string&/*prefix*/, uint32_t);
+	template <typename TOffset> void PrintSecondIndex(BasicIndexRawData<TOffset>&);
         bool Empty();
+        /// The segment starting at SA position beg, nullptr if there is none
+        const Segment *Find(uint64_t beg) const;
+
+        /// Segments of that many suffixes and more have 32-bit entries
+        static const uint64_t kWideCount = 65536;
+        static bool IsWide(uint64_t count) { return count >= kWideCount; }
+
+        /// Walk of the n nodes of the Eytzinger layout in sorted order: the
+        /// first node, then the one after k (0 past the last)
+        static uint64_t EytzingerFirst(uint64_t n)
+        {
+                uint64_t k = 1;
+                while (2 * k <= n) {
+                        k *= 2;
+                }
+                return n != 0 ? k : 0;
+        }
+        static uint64_t EytzingerNext(uint64_t k, uint64_t n)
+        {
+                if (2 * k + 1 <= n) {
+                        for (k = 2 * k + 1; 2 * k <= n; k *= 2) {}
+                        return k;
+                }
+                while (k & 1) {
+                        k >>= 1;
+                }
+                return k >> 1;
+        }
+        /// Nodes in the subtree of node k among n, to rank a node in order
+        static uint64_t EytzingerSubtree(uint64_t k, uint64_t n)
+        {
+                uint64_t size = 0;
+                for (uint64_t first = k, last = k; first <= n; first = 2 * first, last = 2 * last + 1) {
+                        size += std::min(last, n) - first + 1;
+                }
+                return size;
+        }
+
+        /// Choose size_min from the histogram of the sizes of the groups
+        /// sharing their seed, under a cap on the bytes of the segments
+        void TuneSizeMin(const SizeHistogram&, uint32_t/*period*/, uint64_t/*max bytes*/);
+        /// The least size of a group worth a segment, by the cost of a read
+        static uint64_t SizeMinCrossover(uint32_t/*period*/);
+
+private:
+        /// Append segments found in SA order, placing their entries
+        void AppendSegments(const std::vector<Segment>&, uint32_t/*period*/);
+        /// Keep the segments found of size_min suffixes and more, once
+        /// chosen from the groups of the whole SA if tuned
+        void SelectSegments(std::vector<Segment>&, const SizeHistogram&, uint32_t/*period*/, BuildReport*);
+        template <typename TOffset>
+        void RankSegments(ThreadPool&, const char*, TOffset, uint32_t, const TOffset*/*SA from base*/,
+                          uint64_t/*base*/, size_t/*first segment*/, size_t/*last*/);
 };
 
 
-void SortSbwt(char*, uint32_t*, uint32_t, uint32_t, uint32_t, const uint32_t&, const uint32_t&);
-void SortSbwt(char*, uint32_t*, uint32_t, uint32_t, uint32_t, const uint32_t&, const uint32_t&, const uint32_t&/*limited length*/);
-inline void VectorSwap(uint32_t, uint32_t, uint32_t, uint32_t*);
-void BuildIndex(BuildIndexRawData&);
-void BuildIndexBlockwise(BuildIndexRawData&);
-void BuildSortedIndexBlockwise(BuildIndexRawData&);
-void BuildSortedIndexTransCountOcc(BuildIndexRawData&);
-void CountOccurrence(BuildIndexRawData&);
-void PrintFullSearchMatrix(BuildIndexRawData&);
+/**
+ * Difference cover sample of the spaced suffixes, the fallback for groups of
+ * suffixes with long shared prefixes (tandem repeats, satellites).
+ *
+ * The sample holds the suffixes i = r + m*period with m mod kCover in the
+ * cover D = {0..8, 16, 24, ..., 56}: any difference mod 64 is a difference
+ * of two elements of D. So for any two suffixes a and b there is a
+ * delta < kCover such that a + delta*period and b + delta*period are both
+ * sampled, and if a and b share their first kCover-1 characters they are
+ * ordered like those two samples. The samples are ranked once, by naming
+ * their kCover-character prefixes and running SA-IS on the names, and the
+ * ranks are built on first use, so references without long repeats never
+ * pay for them.
+ */
+template <typename TOffset>
+class DifferenceCover {
+public:
+        static const uint32_t kCover = 64;
+        /// Groups sharing at least this many characters use the sample
+        static const uint32_t kMinShared = 256;
+
+        DifferenceCover(const char*, TOffset/*length_ref*/, uint32_t/*period*/);
+        /// Upper bound of the memory (bytes) the ranks take while built
+        static uint64_t MemoryBound(TOffset length_ref) { return (uint64_t)length_ref * (6 + sizeof(TOffset)); }
+        /// Build the ranks if not built yet; safe to call from every thread
+        void Prepare();
+        /// Order of two suffixes sharing their first kCover-1 characters
+        bool Less(TOffset a, TOffset b) const
+        {
+                TOffset ma = a / period, mb = b / period;
+                uint32_t delta = delta_table[(ma % kCover) * kCover + mb % kCover];
+                return Rank(a + (TOffset)delta * period) < Rank(b + (TOffset)delta * period);
+        }
+
+private:
+        void Build();
+        TOffset Rank(TOffset i) const
+        {
+                TOffset m = i / period, r = i % period;
+                return rank[segment_offset[r * size_cover + cover_index[m % kCover]] + m / kCover];
+        }
+
+        const char *seq;
+        TOffset length_ref;
+        uint32_t period;
+        uint32_t size_cover;
+        std::vector<uint8_t> cover_index;       /* index in D of a residue mod kCover */
+        std::vector<uint8_t> delta_table;       /* smallest delta per pair of residues */
+        std::vector<TOffset> segment_offset;    /* first sample of every (class, residue in D) */
+        std::vector<TOffset> rank;              /* rank of every sample */
+        std::once_flag built;
+};
+
+/// The sorters and builders below are instantiated for uint32_t and
+/// uint64_t offsets in sbwt.cc
+template <typename TOffset>
+void SortSbwt(char*, TOffset*, TOffset, TOffset, TOffset, const TOffset&, const uint32_t&);
+template <typename TOffset>
+void SortSbwt(char*, TOffset*, TOffset, TOffset, TOffset, const TOffset&, const uint32_t&, const TOffset&/*limited length*/);
+template <typename TOffset>
+void VectorSwap(TOffset, TOffset, TOffset, TOffset*);
+template <typename TOffset> void BuildIndex(BasicIndexRawData<TOffset>&);
+template <typename TOffset> void BuildIndexBlockwise(BasicIndexRawData<TOffset>&);
+template <typename TOffset> void BuildIndexSais(BasicIndexRawData<TOffset>&);
+template <typename TOffset> void BuildIndexExternal(BasicIndexRawData<TOffset>&, const string&/*prefix*/, uint64_t/*max_mem*/);
+template <typename TOffset> void BuildSortedIndexBlockwise(BasicIndexRawData<TOffset>&);
+template <typename TOffset> void BuildSortedIndexTransCountOcc(BasicIndexRawData<TOffset>&);
+template <typename TOffset> void PrintFullSearchMatrix(BasicIndexRawData<TOffset>&);
 void PrintFullSearchMatrix(uint32_t *SA, char *X, uint32_t N, uint32_t period);
-void SortSbwt(BuildIndexRawData&);
+template <typename TOffset> void SortSbwt(BasicIndexRawData<TOffset>&);
+template <typename TOffset>
+void SortSbwtPacked(char*, TOffset*, TOffset, TOffset, TOffset, const TOffset&, const uint32_t&, DifferenceCover<TOffset>* = nullptr);
 void SortSbwtBlockwise( char*, uint32_t*, uint32_t, uint32_t, uint32_t, const uint32_t&, const uint32_t&, const uint32_t&);
-void SortSbwtBlockwise(BuildIndexRawData&);
-void Transform(BuildIndexRawData&);
-
-#ifndef SNIPPET_COUNTOCC
-#define SNIPPET_COUNTOCC()  \
-        O[0][i] = O[0][i-1];\
-        O[1][i] = O[1][i-1];\
-        O[2][i] = O[2][i-1];\
-        O[3][i] = O[3][i-1]
-#endif /* SNIPPET_COUNTOCC */
+template <typename TOffset> void SortSbwtBlockwise(BasicIndexRawData<TOffset>&);
+template <typename TOffset>
+void SortSbwtBlocks(BasicIndexRawData<TOffset>&, const std::vector<std::pair<TOffset, TOffset> >&, TOffset/*depth*/);
+template <typename TOffset>
+void SortSbwtBlocks(BasicIndexRawData<TOffset>&, TOffset*, const std::vector<std::pair<TOffset, TOffset> >&, TOffset/*depth*/, DifferenceCover<TOffset>*);
+void SeedSortRng(uint64_t);
+template <typename TOffset> void SortSbwtSais(BasicIndexRawData<TOffset>&);
+template <typename TOffset> void TransformCountOccurrence(BasicIndexRawData<TOffset>&);
 
 } /* namespace sbwt */
 #endif /* _SBWT_H_ */
@@ -11,6 +11,12 @@
 
 #include "sbwt_search.h"
 #include "sbwt.h"
+#include "io_build_index.h"
+#include "sampled_occ.h"
+#include "wavelet_occ.h"
+#include "run_length_index.h"
+#include "sampled_sa.h"
+#include "packed_sa.h"
 #include "sequence_pack.h"
 #include "log.h"
 #include "alphabet.h"
@@ -1536,69 +1542,454 @@ namespace sbwt
         }
 
 
-        void SortedPackedSearch(int argc, char **argv)
+        /// Compare the reference at pos, from its copies packed by
+        /// BaseChar2Binary8B, with the size_key characters of key packed
+        /// the same way: 64-bit words XORed, the first different base
+        /// ordered. <0, 0 or >0 as strncmp with A < C < G < T.
+        static inline int ComparePackedKey(uint8_t *const *ref_bin, uint64_t pos,
+                                           const uint64_t *key, uint32_t size_key)
         {
-                LOGINFO("Sorted searching...\n");
-                 /// Build index from files
-                auto begin_time_index = std::chrono::high_resolution_clock::now();
-
-                string reads_filename = string(argv[1]);
-                string prefix_filename = string(argv[2]);
-                uint32_t L_R_min = SecondIndex::size_min - 2;
-                if (argc >= 4) {
-                        uint32_t get_uint = utility::GetUint(argc, argv[3]);
-                        if (get_uint > SecondIndex::size_min) {
-                                L_R_min = get_uint;
+                const uint64_t *p = (const uint64_t*)(ref_bin[pos & 3] + (pos >> 2));
+                for (uint32_t k = 0; k < size_key; k += 32, ++p, ++key) {
+                        uint64_t v = (*p) ^ (*key);
+                        if (size_key - k < 32) {
+                                v &= DnaStringRightShiftMaskReverse[size_key - k];
+                        }
+                        if (v != 0) {
+                                uint32_t shift = __builtin_ctzll(v) & ~1u;
+                                uint32_t x = ((*p) >> shift) & 3;
+                                uint32_t y = ((*key) >> shift) & 3;
+                                /// A 00, C 01, G 11, T 10 are in order once Gray decoded
+                                return (int)(x ^ (x >> 1)) - (int)(y ^ (y >> 1));
                         }
                 }
-                LOGINFO("Size of replica: " << L_R_min << "\n");
-                BuildIndexRawData build_index(prefix_filename);
-                /// test second index
-                SecondIndex second_index(prefix_filename);
-                if (second_index.Empty()) {
-                        LOGERROR("The second index is empty");
+                return 0;
+        }
+
+        /// A hit has at most period mismatches, in the second index and in
+        /// the scan of the range alike
+        static inline bool IsWithinMismatches(uint32_t count, uint32_t period)
+        {
+                return count <= period;
+        }
+
+        /// What the second index search of a read needs, set once per run
+        template <typename TOffset>
+        struct SecondIndexProbe {
+                const SecondIndex *second_index;
+                uint8_t *const *ref_bin;        /* the 4 packed copies of the reference */
+                const char *X;
+                TOffset N_packed;               /* the reference before its '$'s */
+                uint32_t period;
+                uint32_t size_seed;
+                uint32_t size_read_bit32;
+                uint32_t size_read_mod32;
+                uint64_t popcount_mask;
+                uint64_t *key;                  /* the packed seeds of the read, key_words a tau */
+                uint32_t key_words;
+                uint64_t *seed_first;           /* the first entry of every seed found */
+                uint32_t *seed_count;           /* and the entries sharing it */
+        };
+
+        /// Candidates of the second index verified at most for a range of
+        /// count suffixes: past them the range is scanned, which stops at
+        /// the first hit and reads SA in order
+        static inline uint32_t SecondIndexVerifyMax(uint32_t count)
+        {
+                return std::max<uint32_t>(count / 8, 1);
+        }
+        /// Suffixes of the range verified in order before the seeds are
+        /// probed: on near-identical repeats the first ones hit
+        static const uint32_t kSecondIndexHead = 4;
+
+        /// SA of the second index: an array, or read through psa[k] by the
+        /// locate policies, which prefetch it where it is read, not located
+        template <typename TOffset>
+        static inline void PrefetchSa(const TOffset *psa, uint64_t k)
+        {
+                __builtin_prefetch(psa + k);
+        }
+        template <typename TSa>
+        static inline void PrefetchSa(const TSa &psa, uint64_t k)
+        {
+                psa.Prefetch(k);
+        }
+        template <typename TSa>
+        struct SaIsRead {
+                static const bool value = TSa::kRead;
+        };
+        template <typename TOffset>
+        struct SaIsRead<const TOffset*> {
+                static const bool value = true;
+        };
+
+        /// Search a read through the segment seg of the second index, its
+        /// SA range at psa (an array, or located on psa[k]). The range holds the suffixes matching the read
+        /// on from index_tmp, whose characters on are ptr[0, ptr_end - ptr).
+        /// Once the first kSecondIndexHead suffixes of the range missed, the
+        /// entries sharing the next size_seed characters of the read (its
+        /// seed) are bounded and counted for every tau; then the seeds are
+        /// verified against the whole read, read_bin packed, the one of the
+        /// fewest candidates first, up to SecondIndexVerifyMax candidates
+        /// in all: a seed past them goes to the scan. Either strand: the
+        /// reverse-complement pass searches the reverse complement of the
+        /// read the same way. On a match, index is the position of the read.
+        ///
+        /// A miss does not rule out a hit: one with a mismatch in every seed
+        /// is within the mismatches allowed, so the caller scans the range.
+        template <typename TOffset, typename TSa>
+        static bool SearchSecondIndex(const SecondIndexProbe<TOffset> &probe, const SecondIndex::Segment &seg,
+                                      const TSa &psa, const char *ptr, const char *ptr_end,
+                                      const uint64_t *read_bin, TOffset index_tmp, TOffset &index)
+        {
+                const SecondIndex &second_index = *probe.second_index;
+                uint8_t *const *ref_bin_ptr_array = probe.ref_bin;
+                const uint32_t size_seed = probe.size_seed;
+                const uint32_t size_range = seg.count;
+                const bool is_wide_2nd = SecondIndex::IsWide(size_range);
+                const bool is_eytzinger = second_index.layout == SecondIndex::kLayoutEytzinger;
+                const uint16_t *ptr16_2nd = nullptr;
+                const uint32_t *ptr32_2nd = nullptr;
+                if (is_wide_2nd) {
+                        ptr32_2nd = second_index.array_wide + seg.offset;
+                } else {
+                        ptr16_2nd = second_index.array_ptr + seg.offset;
                 }
+                auto entry = [&](uint64_t k) -> uint32_t {
+                        return is_wide_2nd ? ptr32_2nd[k] : ptr16_2nd[k];
+                };
+                uint32_t current_pos = 0;
+                const uint64_t *key = probe.key;
 
-                auto end_time_index = std::chrono::high_resolution_clock::now();
-                auto duration_index = std::chrono::duration_cast<std::chrono::milliseconds>(end_time_index-begin_time_index).count();
-                LOGINFO( "Load index elapsed time:\t"
-                                << duration_index
-                                << " ms"
-                                << std::endl);
-#if 0
-                {
+                /// The suffix of the entry at mid, compared with the seed
+                auto compare = [&](uint64_t mid_2nd) -> int {
+                        TOffset mid_pos_2nd = psa[entry(mid_2nd)];
+                        if (mid_pos_2nd + current_pos + size_seed <= probe.N_packed) {
+                                return ComparePackedKey(ref_bin_ptr_array, mid_pos_2nd + current_pos, key, size_seed);
+                        }
+                        return strncmp(probe.X + mid_pos_2nd + current_pos, ptr + current_pos, size_seed);
+                };
+                /// The rank of the first entry above the seed (upper) or not
+                /// below it, and its node in the Eytzinger layout (0 past the
+                /// last one)
+                auto bound = [&](bool upper, uint64_t &node_2nd) -> uint64_t {
+                        if (!is_eytzinger) {
+                                uint32_t left_2nd = 0;
+                                uint32_t right_2nd = size_range;
+                                while (left_2nd < right_2nd) {
+                                        uint32_t mid_2nd = left_2nd + (right_2nd - left_2nd) / 2;
+                                        int c = compare(mid_2nd);
+                                        if (c < 0 || (upper && c == 0)) {
+                                                left_2nd = mid_2nd + 1;
+                                        } else {
+                                                right_2nd = mid_2nd;
+                                        }
+                                }
+                                node_2nd = left_2nd;
+                                return left_2nd;
+                        }
+                        uint64_t rank = 0;
+                        node_2nd = 1;
+                        while (node_2nd <= size_range) {
+                                /// The next levels are known ahead: the
+                                /// entries four levels down, the suffixes
+                                /// of the grandchildren and the reference
+                                /// of the children. Node k is at entry k - 1.
+                                if (is_wide_2nd) {
+                                        __builtin_prefetch(ptr32_2nd + 16 * node_2nd - 1);
+                                } else {
+                                        __builtin_prefetch(ptr16_2nd + 16 * node_2nd - 1);
+                                }
+                                if (4 * node_2nd + 3 <= size_range) {
+                                        for (uint64_t g = 4 * node_2nd - 1; g != 4 * node_2nd + 3; ++g) {
+                                                PrefetchSa(psa, entry(g));
+                                        }
+                                }
+                                if (SaIsRead<TSa>::value && 2 * node_2nd + 1 <= size_range) {
+                                        for (uint64_t c = 2 * node_2nd - 1; c != 2 * node_2nd + 1; ++c) {
+                                                uint64_t pos = psa[entry(c)] + current_pos;
+                                                __builtin_prefetch(ref_bin_ptr_array[pos & 3] + (pos >> 2));
+                                        }
+                                }
+                                int c = compare(node_2nd - 1);
+                                bool is_right = c < 0 || (upper && c == 0);
+                                if (is_right) {
+                                        /// the node and its left subtree are before the bound
+                                        rank += SecondIndex::EytzingerSubtree(2 * node_2nd, size_range) + 1;
+                                }
+                                node_2nd = 2 * node_2nd + is_right;
+                        }
+                        node_2nd >>= __builtin_ffsll(~node_2nd);
+                        return rank;
+                };
+                /// Verification of the whole read at mid_pos_2nd, packed as
+                /// the range search does. Suffixes before the head of the
+                /// read are skipped.
+                auto extend = [&](TOffset mid_pos_2nd) -> bool {
+                        if (mid_pos_2nd < index_tmp) {
+                                return false;
+                        }
+                        index = mid_pos_2nd - index_tmp;
+                        const uint64_t *p = (const uint64_t*)(ref_bin_ptr_array[index & 3] + (index >> 2));
+                        const uint64_t *q = read_bin;
+                        const uint64_t *p_end = p + probe.size_read_bit32;
+                        uint32_t count = 0;
+                        if (probe.size_read_mod32) {
+                                --p_end;
+                                uint64_t v = ((*p_end) ^ q[p_end - p]) & probe.popcount_mask;
+                                count = HammingWeightDna64(v);
+                        }
+                        for (; p != p_end && IsWithinMismatches(count, probe.period);) {
+                                uint64_t v = (*p++) ^ (*q++);
+                                count += HammingWeightDna64(v);
+                        }
+                        return IsWithinMismatches(count, probe.period);
+                };
 
-                        uint32_t count1 = 0;
-                        for (;;) {
-                                if (count1 >= second_index.size) {
-                                        break;
+                for (uint32_t k = 0; k != std::min(kSecondIndexHead, size_range); ++k) {
+                        if (extend(psa[k])) {
+                                return true;
+                        }
+                }
+
+                /// The seeds: their first entries and counts
+                uint32_t num_seed = 0;
+                for (; num_seed != probe.period && ptr + current_pos + size_seed <= ptr_end; ++num_seed) {
+                        key = probe.key + (uint64_t)num_seed * probe.key_words;
+                        sbwtio::BaseChar2Binary8B((char*)ptr + current_pos, (size_seed + 3) / 4, (uint8_t*)key);
+                        uint64_t node_2nd = 0, node_end_2nd = 0;
+                        uint64_t rank = bound(false, node_2nd);
+                        probe.seed_first[num_seed] = node_2nd;
+                        probe.seed_count[num_seed] = 0;
+                        if (rank < size_range && compare(is_eytzinger ? node_2nd - 1 : node_2nd) == 0) {
+                                probe.seed_count[num_seed] = bound(true, node_end_2nd) - rank;
+                        }
+
+                        if (is_wide_2nd) {
+                                ptr32_2nd += size_range;
+                        } else {
+                                ptr16_2nd += size_range;
+                        }
+                        current_pos += size_seed;
+                }
+
+                /// Their candidates, in order, the seed of the fewest first, as
+                /// long as they fit into the candidates left to verify
+                uint32_t num_verify = SecondIndexVerifyMax(size_range);
+                for (;;) {
+                        uint32_t tau = num_seed;
+                        for (uint32_t t = 0; t != num_seed; ++t) {
+                                if (probe.seed_count[t] != 0
+                                    && (tau == num_seed || probe.seed_count[t] < probe.seed_count[tau])) {
+                                        tau = t;
                                 }
-                                uint16_t *p16 = second_index.array_ptr + count1;
-                                uint32_t pos = *((uint32_t*)p16);
-                                uint16_t size_seg = p16[2];
-                                count1 += size_seg * build_index.period + 3;
-                                p16 += 3;
-                                cout << "pos: " << pos << ", size_seg: " << size_seg << endl;
-                                for (uint32_t tau = 0; tau < build_index.period; ++tau) {
-                                        for (uint32_t i0 = 0; i0 < size_seg; ++i0) {
-                                                cout << p16[tau*size_seg+i0] << " ";
+                        }
+                        if (tau == num_seed || probe.seed_count[tau] > num_verify) {
+                                return false;
+                        }
+                        num_verify -= probe.seed_count[tau];
+                        const uint64_t offset_tau = (uint64_t)tau * size_range;
+                        if (is_wide_2nd) {
+                                ptr32_2nd = second_index.array_wide + seg.offset + offset_tau;
+                        } else {
+                                ptr16_2nd = second_index.array_ptr + seg.offset + offset_tau;
+                        }
+                        uint64_t node_2nd = probe.seed_first[tau];
+                        for (uint32_t k = probe.seed_count[tau]; k != 0; --k) {
+                                if (is_eytzinger) {
+                                        if (extend(psa[entry(node_2nd - 1)])) {
+                                                return true;
                                         }
-                                        cout << endl;
+                                        node_2nd = SecondIndex::EytzingerNext(node_2nd, size_range);
+                                } else if (extend(psa[entry(node_2nd++)])) {
+                                        return true;
                                 }
+                        }
+                        probe.seed_count[tau] = 0;
+                }
+        }
 
+        /// Occ of the index for the backward search, as it was built: the
+        /// four full columns, sampled in cache lines, a wavelet tree or the
+        /// run-length BWT
+        template <typename TOffset>
+        struct FullOccRank {
+                explicit FullOccRank(const BasicIndexRawData<TOffset> &index): occ(index.occurrence) { }
+                TOffset operator()(uint32_t a, TOffset i) const { return occ[a][i]; }
+                /// The base of BWT[i], the one whose column goes up at i
+                uint32_t Access(TOffset i) const
+                {
+                        for (uint32_t a = 0; a != 3; ++a) {
+                                if (occ[a][i] != (i ? occ[a][i-1] : 0)) {
+                                        return a;
+                                }
                         }
-                        //sbwt::PrintFullSearchMatrix(build_index);
-                        second_index.PrintSecondIndex(build_index);
+                        return 3;
                 }
-#endif
+                TOffset *const *occ;
+        };
+        template <typename TOffset>
+        struct SampledOccRank {
+                explicit SampledOccRank(const BasicIndexRawData<TOffset> &index): occ(index.occ_sampled) { }
+                TOffset operator()(uint32_t a, TOffset i) const { return occ->Rank(a, i); }
+                uint32_t Access(TOffset i) const { return occ->Access(i); }
+                const SampledOcc<TOffset> *occ;
+        };
+        template <typename TOffset>
+        struct WaveletOccRank {
+                explicit WaveletOccRank(const BasicIndexRawData<TOffset> &index): occ(index.occ_wavelet) { }
+                TOffset operator()(uint32_t a, TOffset i) const { return occ->Rank(a, i); }
+                uint32_t Access(TOffset i) const { return occ->Access(i); }
+                const WaveletOcc<TOffset> *occ;
+        };
+        template <typename TOffset>
+        struct RunLengthOccRank {
+                explicit RunLengthOccRank(const BasicIndexRawData<TOffset> &index): occ(index.run_length) { }
+                TOffset operator()(uint32_t a, TOffset i) const { return occ->Rank(a, i); }
+                const RunLengthIndex<TOffset> *occ;
+        };
+
+        /// SA of the range the backward search ends on, walked by a cursor
+        /// from Begin(L) to End(R): read from the suffix array in full or
+        /// bit-packed, located by walking LF to a sample, or for the
+        /// run-length index through the toehold SA[L] it keeps up to date
+        /// along the search (Start for the first base, Step before L moves).
+        /// At(L) gives SA from L on to the second index, where kRandomAccess.
+        template <typename TOffset>
+        struct FullSaLocate {
+                typedef const TOffset *Cursor;
+                typedef const TOffset *Random;
+                static const bool kRandomAccess = true;
+                explicit FullSaLocate(const BasicIndexRawData<TOffset> &index): SA(index.suffix_array) { }
+                void Start(uint32_t) { }
+                void Step(uint32_t, TOffset) { }
+                Cursor Begin(TOffset L) const { return SA + L; }
+                Cursor End(TOffset R) const { return SA + R + 1; }
+                Random At(TOffset L) const { return SA + L; }
+                void LogStats() const { }
+                const TOffset *SA;
+        };
+        template <typename TOffset>
+        struct PackedSaLocate {
+                struct Cursor {
+                        const PackedSa<TOffset> *SA;
+                        TOffset row;
+                        TOffset operator*() const { return (*SA)[row]; }
+                        Cursor &operator++() { ++row; return *this; }
+                        bool operator==(const Cursor &other) const { return row == other.row; }
+                        bool operator!=(const Cursor &other) const { return row != other.row; }
+                };
+                struct Random {
+                        static const bool kRead = true;
+                        const PackedSa<TOffset> *SA;
+                        TOffset row;
+                        TOffset operator[](uint64_t k) const { return (*SA)[row + k]; }
+                        void Prefetch(uint64_t k) const { __builtin_prefetch(SA->Address(row + k)); }
+                };
+                static const bool kRandomAccess = true;
+                explicit PackedSaLocate(const BasicIndexRawData<TOffset> &index): SA(index.sa_packed) { }
+                void Start(uint32_t) { }
+                void Step(uint32_t, TOffset) { }
+                Cursor Begin(TOffset L) const { return Cursor{SA, L}; }
+                Cursor End(TOffset R) const { return Cursor{SA, R + 1}; }
+                Random At(TOffset L) const { return Random{SA, L}; }
+                void LogStats() const { }
+                const PackedSa<TOffset> *SA;
+        };
+        template <typename TOffset, typename TOcc>
+        struct SampledSaLocate {
+                /// Row located on *
+                struct Cursor {
+                        const SampledSaLocate *locate;
+                        TOffset row;
+                        TOffset operator*() const { return locate->Locate(row); }
+                        Cursor &operator++() { ++row; return *this; }
+                        bool operator==(const Cursor &other) const { return row == other.row; }
+                        bool operator!=(const Cursor &other) const { return row != other.row; }
+                };
+                struct Random {
+                        static const bool kRead = false;
+                        const SampledSaLocate *locate;
+                        TOffset row;
+                        TOffset operator[](uint64_t k) const { return locate->Locate(row + k); }
+                        void Prefetch(uint64_t) const { }
+                };
+                static const bool kRandomAccess = true;
+                explicit SampledSaLocate(const BasicIndexRawData<TOffset> &index):
+                        occ(index), C(index.first_column), samples(index.sa_sampled), period(index.period),
+                        num_located(0), num_step(0) { }
+                void Start(uint32_t) { }
+                void Step(uint32_t, TOffset) { }
+                Cursor Begin(TOffset L) const { return Cursor{this, L}; }
+                Cursor End(TOffset R) const { return Cursor{this, R + 1}; }
+                Random At(TOffset L) const { return Random{this, L}; }
+                /// SA[i]: LF from row i down to a sample, p a step. The rows
+                /// not sampled have a base in the BWT, which Access reads.
+                TOffset Locate(TOffset i) const
+                {
+                        TOffset steps = 0;
+                        TOffset sa = 0;
+                        while (!samples->Find(i, sa)) {
+                                uint32_t a = occ.Access(i);
+                                i = C[a] + occ(a, i) - 1;
+                                ++steps;
+                        }
+                        ++num_located;
+                        num_step += steps;
+                        return sa + steps * period;
+                }
+                void LogStats() const
+                {
+                        LOGINFO("SA located: " << num_located << " ("
+                                << (num_located ? (double)num_step / num_located : 0.0) << " LF steps each)\n");
+                }
+                const TOcc occ;
+                const TOffset *C;
+                const SampledSa<TOffset> *samples;
+                TOffset period;
+                mutable uint64_t num_located;
+                mutable uint64_t num_step;
+        };
+        template <typename TOffset>
+        struct RunLengthLocate {
+                /// Row and its SA; the next one is found on ++
+                struct Cursor {
+                        const RunLengthIndex<TOffset> *runs;
+                        TOffset row;
+                        TOffset sa;
+                        TOffset operator*() const { return sa; }
+                        Cursor &operator++() { sa = runs->Next(sa); ++row; return *this; }
+                        bool operator==(const Cursor &other) const { return row == other.row; }
+                        bool operator!=(const Cursor &other) const { return row != other.row; }
+                };
+                typedef const TOffset *Random;
+                static const bool kRandomAccess = false;
+                explicit RunLengthLocate(const BasicIndexRawData<TOffset> &index):
+                        runs(index.run_length), toehold(0) { }
+                void Start(uint32_t a) { toehold = runs->First(a); }
+                void Step(uint32_t a, TOffset L) { toehold = runs->Step(a, L, toehold); }
+                Cursor Begin(TOffset L) const { return Cursor{runs, L, toehold}; }
+                Cursor End(TOffset R) const { return Cursor{runs, R + 1, 0}; }
+                Random At(TOffset) const { return nullptr; }
+                void LogStats() const { }
+                const RunLengthIndex<TOffset> *runs;
+                TOffset toehold;        /* SA[L] */
+        };
 
+        /// Align the reads of reads_filename on the index, Occ answered by
+        /// TOcc and SA located by TLocate; ranges above L_R_min go through
+        /// the second index
+        template <typename TOffset, typename TOcc, typename TLocate>
+        static void SortedPackedSearchReads(const string &reads_filename, BasicIndexRawData<TOffset> &build_index,
+                                            SecondIndex &second_index, uint32_t L_R_min)
+        {
                 auto begin_time_search = std::chrono::high_resolution_clock::now();
 
                 uint32_t period = build_index.period;
-                uint32_t N = build_index.length_ref;
-                uint32_t *C = build_index.first_column;
-                uint32_t **Occ = build_index.occurrence;
-                uint32_t *SA = build_index.suffix_array;
+                TOffset N = build_index.length_ref;
+                TOffset *C = build_index.first_column;
+                const TOcc Occ(build_index);
+                TLocate locate(build_index);
 
                 static uint8_t *ref_bin_ptr_array[4] = {nullptr};
                 ref_bin_ptr_array[0] = build_index.bin_8bit;
@@ -1629,23 +2020,8 @@ namespace sbwt
                 /// the minimum distance between L and R
                 uint32_t size_seed = second_index.size_seed;
                 uint32_t size_std = size_seed * period;
-                uint16_t *ptr16_right = nullptr;
-                uint16_t *ptr16_left = nullptr;
-                char *ptr_iter = nullptr;
-                uint16_t *ptr16_mid = nullptr;
-                bool is_2nd_success = false;/* seed */
-                bool is_2nd_extend_success = false;/* extend */
-                int compare_flag = 0;
-                uint32_t current_pos = 0;
-                uint32_t distance_2nd = 0;
-                uint32_t mid_index_2nd = 0;
                 uint32_t power_2nd_count = 0;
-                uint32_t mid_pos_2nd = 0;
-                uint16_t *ptr16_2nd_begin = second_index.array_ptr;
-                uint16_t *ptr16_2nd = nullptr;
-                uint32_t index_2nd = 0;
-                uint32_t size_range = 0;
-                uint32_t pos_original = 0;
+                const SecondIndex::Segment *seg_2nd = nullptr;
 
                 if (rb_reads.length_read < period || size_std < rb_reads.length_read) {
                         LOGERROR("the size of read is shorter than "
@@ -1682,8 +2058,8 @@ namespace sbwt
                         q_end_rc = read_bin_buffer_rc + size_read_bit32;
                 }
 
-                uint32_t L = 0, R = 0;
-                uint32_t N_1 = N - 1;
+                TOffset L = 0, R = 0;
+                TOffset N_1 = N - 1;
 
                 // Not sure the addr. of buffer will be changed.
                 // ---
@@ -1705,10 +2081,21 @@ namespace sbwt
                 char **ptr_array_rc     = new char*[period];
                 char *X = build_index.seq_raw;
                 uint32_t *begin_index   = new uint32_t[period];
+                /// the reverse complement of the read, for the second index
+                char *read_rc           = new char[size_read_char + 8];
+                const uint32_t key_words_2nd = (size_seed + 3) / 32 + 1;
+                uint64_t *key_2nd       = new uint64_t[(uint64_t)period * key_words_2nd];
+                uint64_t *seed_first_2nd = new uint64_t[period];
+                uint32_t *seed_count_2nd = new uint32_t[period];
+                SecondIndexProbe<TOffset> probe = {
+                        &second_index, ref_bin_ptr_array, X, N - build_index.num_dollar, period, size_seed,
+                        size_read_bit32, size_read_mod32, popcount_mask, key_2nd, key_words_2nd,
+                        seed_first_2nd, seed_count_2nd
+                };
 
-                uint32_t index_tmp, index;
+                TOffset index_tmp, index;
 
-                uint32_t *psa, *psa_end;
+                typename TLocate::Cursor psa, psa_end;
 
                 {
                         uint32_t tmp0 = size_read_char / period;
@@ -1744,189 +2131,39 @@ namespace sbwt
                                 key = *ptr;
                                 a = charToDna5_32bit[key];
                                 L = C[a];
-                                R = C[a] + Occ[a][N_1] - 1;
+                                R = C[a] + Occ(a, N_1) - 1;
+                                locate.Start(a);
 
                                 for (uint32_t j = 1; j != lmd; ++j) {
                                         ptr -= period;
                                         key = *ptr;
                                         a = charToDna5_32bit[key];
-                                        L = C[a] + Occ[a][L-1];
-                                        R = C[a] + Occ[a][R] - 1;
+                                        locate.Step(a, L);
+                                        L = C[a] + Occ(a, L-1);
+                                        R = C[a] + Occ(a, R) - 1;
                                         if (L > R) {
                                                 goto loop_verification;
                                         }
                                 }
 
-                                /// Use second index to power searching
-                                if (R - L > L_R_min && R-L < 65535/* TODO */) {
-                                        ++power_2nd_count;
-                                        is_2nd_extend_success = false;
-                                        psa = SA + L;
-                                        size_range = R - L + 1;
-                                        psa_end = psa + size_range;
-
-                                        index_2nd = *psa;
-                                        ptr16_2nd = ptr16_2nd_begin + index_2nd;
-                                        /// if index_2nd == 0
-                                        pos_original = *(uint32_t*)ptr16_2nd;
-
-                                        ptr16_2nd += 3;
-#if 0
-                                        cout << "L: " << L
-                                             << " R: " << R
-                                             << " *psa: " << *psa
-                                             << " *psa_end: " << *psa_end
-                                             << " size_range: " << size_range
-                                             << " seed: ";
-                                        for (uint32_t u00 = 0; u00 < size_seed; ++u00) {
-                                                cout << ptr[u00*period];
-                                        }
-                                        cout << endl;
-#endif
-
-#if 0
-                                        /// visualization
-                                        cout << "Original SA" << endl;
-                                        for (uint32_t u = L; u <= R; ++u) {
-                                                uint32_t u0 = *(SA + u);
-                                                if (u == L) {
-                                                        u0 = pos_original;
-                                                }
-                                                for (uint32_t j0 = 0; j0 < size_std; ++j0) {
-                                                                if (j0 % period == 0) {
-                                                                        cout << "\033[1;31m" << X[(j0 + u0) % N] << "\033[0m";
-                                                                }
-                                                                else {
-                                                                        cout << X[(j0 + u0) % N];
-                                                                }
-                                                                if (j0 % size_seed == (size_seed-1)) {
-                                                                        cout << " ";
-                                                                }
-
-                                                }
-                                                cout << endl;
-                                        }
-#endif
-                                        char *cmp_p = ptr;
-                                        char *cmp_r = nullptr;
-
-                                        current_pos = 0;
-                                        for (uint32_t tau = 0; tau != period; ++tau) {
-                                                if (ptr_end < ptr + size_seed) {
-                                                        break;
-                                                }
-                                                /// array: ptr16_2nd,
-                                                /// size:  size_range
-                                                ptr16_left = ptr16_2nd;
-                                                ptr16_right = ptr16_left + size_range;
-                                                uint16_t *ptr16_2nd_head = ptr16_2nd;
-                                                uint16_t *ptr16_2nd_tail = ptr16_right - 1;
-                                                is_2nd_success = false;
-                      #define COMPARE_2ND_INDEX if (mid_index_2nd == 0) \
-                                                        mid_pos_2nd = pos_original;\
-                                                else\
-                                                        mid_pos_2nd = *(psa + mid_index_2nd);\
-                                                compare_flag = strncmp(X + mid_pos_2nd + current_pos, ptr, size_seed)
-
-                                                /// binary search
-                                                while (ptr16_left < ptr16_right) {
-                                                        distance_2nd = ptr16_right - ptr16_left;
-                                                        if (distance_2nd == 1) {
-                                                                ptr16_mid = ptr16_left;
-                                                                mid_index_2nd = *ptr16_mid;
-                                                                COMPARE_2ND_INDEX;
-                                                                is_2nd_success = compare_flag == 0;
-                                                                break;
-                                                        } else {
-                                                                ptr16_mid = ptr16_left + (distance_2nd / 2);
-                                                                mid_index_2nd = *ptr16_mid;
-                                                                COMPARE_2ND_INDEX;
-                                                                if (compare_flag == 0) {
-                                                                        is_2nd_success = true;
-                                                                        break;
-                                                                } else if (compare_flag > 0)/* mid_key > key */ {
-                                                                        ptr16_right = ptr16_mid;
-                                                                } else {
-                                                                        ptr16_left = ptr16_mid;
-                                                                }
-                                                        }
-                                                }
-
-                                                /// Whether seeding successful
-                                                if (is_2nd_success) {
-                                                        /// Second index success, need verification.
-                                                        /// range search [left, right]
-                                                        /// Mid
-                                                        /// Caution
-                                                        if (mid_pos_2nd < current_pos) {
-                                                                continue;
-                                                        }
-
-                              #define EXTEND_2nd_INDEX  ptr_iter = ptr_reads;\
-                                                        index = mid_pos_2nd - (cmp_p - ptr_reads);\
-                                                        cmp_r = X + index;/* Compare from front of read */\
-                                                        count = 0;\
-                                                        for (;ptr_iter != ptr_end;) {\
-                                                                if (*cmp_r++ != *ptr_iter++) {\
-                                                                        ++count;\
-                                                                        if (count >= period) {\
-                                                                                break;\
-                                                                        }\
-                                                                }\
-                                                        }\
-                                                        is_2nd_extend_success = count < period;\
-                                                        if(is_2nd_extend_success)\
-                                                                goto match_success
-
-                                                        EXTEND_2nd_INDEX;
-                                                        /// left <==
-                                                        ptr16_left = ptr16_mid;
-                                                        /// check the head
-                                                        if (ptr16_left != ptr16_2nd_head) {
-                                                                while (--ptr16_left != ptr16_2nd_head) {
-                                                                        mid_index_2nd = *ptr16_left;
-                                                                        COMPARE_2ND_INDEX;
-                                                                        /// seeding successful
-                                                                        if (compare_flag == 0) {
-                                                                                /// Caufion
-                                                                                if (mid_pos_2nd < current_pos) {
-                                                                                        continue;
-                                                                                }
-                                                                                EXTEND_2nd_INDEX;
-                                                                        }
-                                                                }
-                                                        }
-                                                        /// ==> right
-                                                        ptr16_right = ptr16_mid;
-                                                        /// check head
-                                                        if (ptr16_right != ptr16_2nd_tail) {
-                                                                while (++ptr16_right != ptr16_2nd_tail) {
-                                                                        mid_index_2nd = *ptr16_right;
-                                                                        COMPARE_2ND_INDEX;
-                                                                        /// seeding successful
-                                                                        if (compare_flag == 0) {
-                                                                                /// Caution
-                                                                                if (mid_pos_2nd < current_pos) {
-                                                                                        continue;
-                                                                                }
-                                                                                EXTEND_2nd_INDEX;
-                                                                        }
-                                                                }
-                                                        }
-                                                }
+                                index_tmp = begin_index[i];
 
-                                                //for (uint32_t u = 0; u != size_seed; ++u) { cout << ptr[u]; } cout << endl;
-                                                ptr16_2nd += 3 + size_range;
-                                                ptr += size_seed;
-                                                current_pos += size_seed;
+                                /// Use second index to power searching, when the range
+                                /// is one of its segments
+                                if (TLocate::kRandomAccess && R - L > L_R_min
+                                    && (seg_2nd = second_index.Find(L)) != nullptr
+                                    && seg_2nd->count == R - L + 1) {
+                                        ++power_2nd_count;
+                                        if (SearchSecondIndex(probe, *seg_2nd, locate.At(L), ptr, ptr_end,
+                                                              read_bin_buffer, index_tmp, index)) {
+                                                goto match_success;
                                         }
-                                        /// second index failed
-                                        goto loop_verification;
+                                        /// The seeds of the read all have a
+                                        /// mismatch: the range is scanned
                                 }
 
-                                psa = SA + L;
-                                psa_end = SA + R + 1;
-                                index_tmp = begin_index[i];
+                                psa = locate.Begin(L);
+                                psa_end = locate.End(R);
 
                                 // packed method
                                 if (size_read_mod32) {
@@ -1960,7 +2197,7 @@ namespace sbwt
                                                 for (; p != p_end;) {
                                                         v = (*p++) ^ (*q++);
                                                         count += HammingWeightDna64(v);
-                                                        if (count > period) {
+                                                        if (!IsWithinMismatches(count, period)) {
                                                                 ++psa;// Careful about its position
                                                                 goto psa_loop_if;
                                                         }
@@ -1993,7 +2230,7 @@ namespace sbwt
                                                 for (; p != p_end;) {
                                                         v = (*p++) ^ (*q++);
                                                         count += HammingWeightDna64(v);
-                                                        if (count > period) {
+                                                        if (!IsWithinMismatches(count, period)) {
                                                                 ++psa;// Careful about its position
                                                                 goto psa_loop_else;
                                                         }
@@ -2015,6 +2252,9 @@ namespace sbwt
                         match_failure:
                         /// Reverse Complement Binary Stream
                         sbwtio::BaseChar2Binary8B_RC(read_bin, size_read_char, read_bin_rc);
+                        for (uint32_t j = 0; j != size_read_char; ++j) {
+                                read_rc[j] = sbwtio::DnaCharMapReverseComplement[(uint8_t)ptr_reads[size_read_char - 1 - j]];
+                        }
 
                         i = 0;
                         flag_minus_plus = '-';
@@ -2027,25 +2267,42 @@ namespace sbwt
                                 key = *ptr;
                                 a = rcCharToDna5_32bit[key];/// rc
                                 L = C[a];
-                                R = C[a] + Occ[a][N_1] - 1;
+                                R = C[a] + Occ(a, N_1) - 1;
+                                locate.Start(a);
 
                                 for (uint32_t j = 1; j != lmd; ++j) {
                                         ptr += period;/// rc
                                         key = *ptr;
                                         /// Bugs here
                                         a = rcCharToDna5_32bit[key];/// rc
-                                        L = C[a] + Occ[a][L-1];
-                                        R = C[a] + Occ[a][R] - 1;
+                                        locate.Step(a, L);
+                                        L = C[a] + Occ(a, L-1);
+                                        R = C[a] + Occ(a, R) - 1;
                                         if (L > R) {
                                                 goto loop_verification_rc;
                                         }
                                 }
 
-                                // TODO Use 2nd index to power reverse-complemently searching
-                                psa = SA + L;
-                                psa_end = SA + R + 1;
                                 index_tmp = begin_index[i];
 
+                                /// Use second index to power searching, on the
+                                /// reverse complement of the read from index_tmp
+                                if (TLocate::kRandomAccess && R - L > L_R_min
+                                    && (seg_2nd = second_index.Find(L)) != nullptr
+                                    && seg_2nd->count == R - L + 1) {
+                                        ++power_2nd_count;
+                                        if (SearchSecondIndex(probe, *seg_2nd, locate.At(L), read_rc + index_tmp,
+                                                              read_rc + size_read_char, read_bin_buffer_rc,
+                                                              index_tmp, index)) {
+                                                goto match_success;
+                                        }
+                                        /// The seeds of the read all have a
+                                        /// mismatch: the range is scanned
+                                }
+
+                                psa = locate.Begin(L);
+                                psa_end = locate.End(R);
+
                                 // packed method
                                 if (size_read_mod32) {
                                         for (;;) {
@@ -2075,7 +2332,7 @@ namespace sbwt
                                                 for (; p != p_end;) {
                                                         v = (*p++) ^ (*q++);
                                                         count += HammingWeightDna64(v);
-                                                        if (count > period) {
+                                                        if (!IsWithinMismatches(count, period)) {
                                                                 ++psa;// Careful about its position
                                                                 goto psa_loop_if_rc;
                                                         }
@@ -2110,7 +2367,7 @@ namespace sbwt
                                                 for (; p != p_end;) {
                                                         v = (*p++) ^ (*q++);
                                                         count += HammingWeightDna64(v);
-                                                        if (count > period) {
+                                                        if (!IsWithinMismatches(count, period)) {
                                                                 ++psa;// Careful about its position
                                                                 goto psa_loop_else_rc;
                                                         }
@@ -2175,11 +2432,99 @@ namespace sbwt
                                         << "%)\n");
 
                 LOGINFO("Second index powering searching: " << power_2nd_count << "\n");
+                locate.LogStats();
                 delete[] end_array;
                 delete[] ptr_array;
                 delete[] begin_index;
                 delete[] ptr_array_rc;
+                delete[] key_2nd;
+                delete[] seed_first_2nd;
+                delete[] seed_count_2nd;
+                delete[] read_rc;
+
+        }
+
+        /// The search instantiated on SA as the index keeps it: in full,
+        /// bit-packed or sampled
+        template <typename TOffset, typename TOcc>
+        static void SortedPackedSearchWithSa(const string &reads_filename, BasicIndexRawData<TOffset> &build_index,
+                                             SecondIndex &second_index, uint32_t L_R_min)
+        {
+                if (build_index.sa_sampled) {
+                        SortedPackedSearchReads<TOffset, TOcc, SampledSaLocate<TOffset, TOcc> >(
+                                reads_filename, build_index, second_index, L_R_min);
+                } else if (build_index.sa_packed) {
+                        SortedPackedSearchReads<TOffset, TOcc, PackedSaLocate<TOffset> >(
+                                reads_filename, build_index, second_index, L_R_min);
+                } else {
+                        SortedPackedSearchReads<TOffset, TOcc, FullSaLocate<TOffset> >(
+                                reads_filename, build_index, second_index, L_R_min);
+                }
+        }
+
+        template <typename TOffset>
+        static void SortedPackedSearchWithOffset(int argc, char **argv)
+        {
+                LOGINFO("Sorted searching...\n");
+                 /// Build index from files
+                auto begin_time_index = std::chrono::high_resolution_clock::now();
+
+                string reads_filename = string(argv[1]);
+                string prefix_filename = string(argv[2]);
+                BasicIndexRawData<TOffset> build_index(prefix_filename);
+                /// test second index
+                SecondIndex second_index(prefix_filename);
+                if (second_index.Empty() && build_index.occ_format != kOccRunLength) {
+                        LOGERROR("The second index is empty");
+                }
+                /// size_min is the one the second index was built with;
+                /// without segments no range goes to the second index
+                uint32_t L_R_min = UINT32_MAX;
+                if (!second_index.Empty()) {
+                        L_R_min = second_index.size_min > 2 ? second_index.size_min - 2 : 0;
+                }
+                if (argc >= 4) {
+                        uint32_t get_uint = utility::GetUint(argc, argv[3]);
+                        if (get_uint > second_index.size_min) {
+                                L_R_min = get_uint;
+                        }
+                }
+                LOGINFO("Size of replica: " << L_R_min << "\n");
+
+                auto end_time_index = std::chrono::high_resolution_clock::now();
+                auto duration_index = std::chrono::duration_cast<std::chrono::milliseconds>(end_time_index-begin_time_index).count();
+                LOGINFO( "Load index elapsed time:\t"
+                                << duration_index
+                                << " ms"
+                                << std::endl);
+#if 0
+                second_index.PrintSecondIndex(build_index);
+#endif
 
+                /// The search is instantiated on the Occ the index was built with
+                if (build_index.occ_format == kOccSampled) {
+                        SortedPackedSearchWithSa<TOffset, SampledOccRank<TOffset> >(
+                                reads_filename, build_index, second_index, L_R_min);
+                } else if (build_index.occ_format == kOccWavelet) {
+                        SortedPackedSearchWithSa<TOffset, WaveletOccRank<TOffset> >(
+                                reads_filename, build_index, second_index, L_R_min);
+                } else if (build_index.occ_format == kOccRunLength) {
+                        SortedPackedSearchReads<TOffset, RunLengthOccRank<TOffset>, RunLengthLocate<TOffset> >(
+                                reads_filename, build_index, second_index, L_R_min);
+                } else {
+                        SortedPackedSearchWithSa<TOffset, FullOccRank<TOffset> >(
+                                reads_filename, build_index, second_index, L_R_min);
+                }
+        }
+
+        /// The offsets of the index (32 or 64-bit) are recorded in its meta file
+        void SortedPackedSearch(int argc, char **argv)
+        {
+                if (ReadIndexOffsetBits(string(argv[2])) == 64) {
+                        SortedPackedSearchWithOffset<uint64_t>(argc, argv);
+                } else {
+                        SortedPackedSearchWithOffset<uint32_t>(argc, argv);
+                }
         }
 
 
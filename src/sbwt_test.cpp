@@ -73,6 +73,11 @@ void TestSbwtExactMatch(int argc, char **argv)
         uint32_t *C = build_index.first_column;
         uint32_t **Occ = build_index.occurrence;
         uint32_t *SA = build_index.suffix_array;
+        if (!Occ || !SA) {
+                std::cerr << "Index files " << prefix_filename << " have not the Occ columns and SA in full"
+                          << " (--occ sampled, wavelet or runs, --sa-sample or --sa-packed)" << endl;
+                return;
+        }
 
         /// reads
         /// Read first segment.
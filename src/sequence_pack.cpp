@@ -148,7 +148,7 @@ void PrintBinary(T c, const std::string &end_str)
 
         /// Turn string of DNAs to packed 8-bit sequence.
         /// @param size: the one of binary sequence.
-        void BaseChar2Binary8B(char *buffer, uint32_t size, uint8_t *bin)
+        void BaseChar2Binary8B(char *buffer, size_t size, uint8_t *bin)
         {
 #ifdef SBWT_DEBUG_BASECHAR2BINARY8B
                 auto print = [](uint32_t v)->void {
@@ -89,7 +89,7 @@ extern const char DnaCharMapReverseComplement[256];
         /* It seems that 'inline' does not work here */
         /* TODO should be included */
         void BaseChar2Binary64B(char*, uint64_t, uint64_t*);
-        void BaseChar2Binary8B(char*, uint32_t, uint8_t*);
+        void BaseChar2Binary8B(char*, size_t, uint8_t*);
 
         /* Reverse Complement version */
         /// 0100 0[00]1 - A
@@ -0,0 +1,145 @@
+#include "thread_pool.h"
+
+namespace sbwt {
+
+/// The pool and the deque owned by the current thread (nullptr outside of
+/// a pool), so that Submit() from within a task stays local.
+static thread_local ThreadPool *tls_pool = nullptr;
+static thread_local uint32_t tls_worker = 0;
+
+ThreadPool::ThreadPool(uint32_t n):
+        num_threads(n == 0 ? 1 : n),
+        num_queued(0),
+        num_pending(0),
+        next_queue(0),
+        stop(false)
+{
+        for (uint32_t i = 0; i != num_threads; ++i) {
+                queues.emplace_back(new WorkQueue);
+        }
+        for (uint32_t i = 1; i < num_threads; ++i) {
+                workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+        }
+}
+
+ThreadPool::~ThreadPool()
+{
+        {
+                std::lock_guard<std::mutex> lk(mtx_state);
+                stop = true;
+        }
+        cv_state.notify_all();
+        for (auto &t : workers) {
+                t.join();
+        }
+}
+
+void ThreadPool::Submit(Task task)
+{
+        uint32_t id = (tls_pool == this) ? tls_worker : (next_queue++ % num_threads);
+        ++num_pending;
+        {
+                std::lock_guard<std::mutex> lk(queues[id]->mtx);
+                queues[id]->tasks.push_back(std::move(task));
+        }
+        {
+                std::lock_guard<std::mutex> lk(mtx_state);
+                ++num_queued;
+        }
+        cv_state.notify_all();
+}
+
+bool ThreadPool::TryPop(uint32_t id, Task &task)
+{
+        std::lock_guard<std::mutex> lk(queues[id]->mtx);
+        if (queues[id]->tasks.empty()) {
+                return false;
+        }
+        task = std::move(queues[id]->tasks.back());
+        queues[id]->tasks.pop_back();
+        return true;
+}
+
+bool ThreadPool::TrySteal(uint32_t id, Task &task)
+{
+        for (uint32_t k = 1; k < num_threads; ++k) {
+                WorkQueue &q = *queues[(id + k) % num_threads];
+                std::lock_guard<std::mutex> lk(q.mtx);
+                if (!q.tasks.empty()) {
+                        task = std::move(q.tasks.front());
+                        q.tasks.pop_front();
+                        return true;
+                }
+        }
+        return false;
+}
+
+/// Run one task if any is available.
+bool ThreadPool::RunOne(uint32_t id)
+{
+        Task task;
+        if (!TryPop(id, task) && !TrySteal(id, task)) {
+                return false;
+        }
+        --num_queued;
+        try {
+                task();
+        } catch (...) {
+                std::lock_guard<std::mutex> lk(mtx_state);
+                if (!first_error) {
+                        first_error = std::current_exception();
+                }
+        }
+        if (--num_pending == 0) {
+                std::lock_guard<std::mutex> lk(mtx_state);
+                cv_state.notify_all();
+        }
+        return true;
+}
+
+void ThreadPool::WorkerLoop(uint32_t id)
+{
+        tls_pool = this;
+        tls_worker = id;
+        for (;;) {
+                if (RunOne(id)) {
+                        continue;
+                }
+                std::unique_lock<std::mutex> lk(mtx_state);
+                cv_state.wait(lk, [this]() { return stop || num_queued > 0; });
+                if (stop) {
+                        return;
+                }
+        }
+}
+
+void ThreadPool::Wait()
+{
+        ThreadPool *saved_pool = tls_pool;
+        uint32_t saved_worker = tls_worker;
+        tls_pool = this;
+        tls_worker = 0;
+        for (;;) {
+                if (RunOne(0)) {
+                        continue;
+                }
+                std::unique_lock<std::mutex> lk(mtx_state);
+                cv_state.wait(lk, [this]() { return num_pending == 0 || num_queued > 0; });
+                if (num_pending == 0) {
+                        break;
+                }
+        }
+        tls_pool = saved_pool;
+        tls_worker = saved_worker;
+
+        std::exception_ptr error;
+        {
+                std::lock_guard<std::mutex> lk(mtx_state);
+                std::swap(error, first_error);
+        }
+        if (error) {
+                std::rethrow_exception(error);
+        }
+}
+
+} /* namespace sbwt */
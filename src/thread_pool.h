@@ -0,0 +1,66 @@
+#ifndef SBWT_THREAD_POOL_H
+#define SBWT_THREAD_POOL_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sbwt {
+
+/**
+ * Work-stealing thread pool.
+ *
+ * Every worker owns a deque. It pushes and pops its own tasks at the back
+ * (depth first, so the sub-tasks of a split block stay hot in its cache) and
+ * steals from the front of the other deques (the oldest, i.e. biggest,
+ * pending pieces). Tasks may submit sub-tasks. The thread that calls Wait()
+ * runs tasks as well, so a pool of N threads spawns N-1 workers and a pool of
+ * one thread runs everything inline.
+ */
+class ThreadPool {
+public:
+        typedef std::function<void()> Task;
+
+        explicit ThreadPool(uint32_t);
+        ~ThreadPool();
+
+        /// Queue a task; called from a task it goes to the caller's own deque.
+        void Submit(Task);
+        /// Run tasks until every submitted task (and its sub-tasks) is done.
+        /// The first exception thrown by a task is rethrown here.
+        void Wait();
+        uint32_t Size() const { return num_threads; }
+
+private:
+        struct WorkQueue {
+                std::mutex mtx;
+                std::deque<Task> tasks;
+        };
+
+        bool TryPop(uint32_t, Task&);
+        bool TrySteal(uint32_t, Task&);
+        bool RunOne(uint32_t);
+        void WorkerLoop(uint32_t);
+
+        uint32_t num_threads;
+        std::vector<std::unique_ptr<WorkQueue> > queues;  /* queues[0] belongs to the caller of Wait() */
+        std::vector<std::thread> workers;
+        std::atomic<uint64_t> num_queued;                  /* tasks sitting in the deques */
+        std::atomic<uint64_t> num_pending;                 /* queued + running */
+        std::atomic<uint32_t> next_queue;                  /* round robin for external submits */
+        std::mutex mtx_state;
+        std::condition_variable cv_state;
+        std::exception_ptr first_error;
+        bool stop;
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_THREAD_POOL_H */
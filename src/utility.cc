@@ -114,9 +114,34 @@ uint32_t GetUint(int argc, char *parameter)
         return ret;
 }
 
+/** Get a size in bytes from argv, with an optional K, M or G suffix
+ * (powers of 1024).
+ */
+uint64_t GetSize(char *parameter)
+{
+        errno = 0;
+        char *tmpptr;
+        auto tmpval = strtoull(parameter, &tmpptr, 10);
+        bool is_valid = errno == 0 && tmpptr != parameter;
+        uint64_t unit = 1;
+        switch (*tmpptr) {
+                case 'K': case 'k': unit = 1ull << 10; ++tmpptr; break;
+                case 'M': case 'm': unit = 1ull << 20; ++tmpptr; break;
+                case 'G': case 'g': unit = 1ull << 30; ++tmpptr; break;
+                default: break;
+        }
+
+        if (!is_valid || *tmpptr != '\0' || tmpval > UINT64_MAX / unit) {
+                LOGDEBUG("Error: invalid inputs");
+                exit(1);
+        }
+        return tmpval * unit;
+}
+
 /* Count the occurrence of seeds (25 bp) in reference.
  * */
-void CountSeedOccurrence(sbwt::BuildIndexRawData &build_index, uint32_t seed_length)
+template <typename TOffset>
+void CountSeedOccurrence(sbwt::BasicIndexRawData<TOffset> &build_index, uint32_t seed_length)
 {
         using std::vector;
         std::string  str_iter(seed_length, 0);
@@ -130,6 +155,10 @@ void CountSeedOccurrence(sbwt::BuildIndexRawData &build_index, uint32_t seed_len
                 logger::LogDebug("The length is less than 25");
                 return;
         }
+        if (!SA) {
+                LOGERROR("The index has no suffix array in full width (--occ runs, --sa-sample or --sa-packed)");
+                return;
+        }
 
         uint32_t count = 0;  /* count the # of same DNA sequence */
 
@@ -164,9 +193,57 @@ void CountSeedOccurrence(sbwt::BuildIndexRawData &build_index, uint32_t seed_len
         }
 }
 
+template void CountSeedOccurrence<uint32_t>(sbwt::BasicIndexRawData<uint32_t> &, uint32_t);
+template void CountSeedOccurrence<uint64_t>(sbwt::BasicIndexRawData<uint64_t> &, uint32_t);
+
 void PrintHelp_BuildIndex(int argc, char **argv)
 {
-        cout << "usage: build_index [fa] [period] <size_seed>"
+        cout << "usage: build_index [fa] [period[,period...]] <size_seed> [options]\n"
+             << "  several periods read the reference once, store it once in fa.ref.sbwt\n"
+             << "  and build up to --threads periods at a time\n"
+             << "options:\n"
+             << "  -t, --threads N    number of threads to sort with, 0 for all cores (default: 1)\n"
+             << "  --builder NAME     suffix sorting: blockwise (multikey quicksort) or\n"
+             << "                     sais (linear-time induced sorting) (default: blockwise)\n"
+             << "  --occ FORMAT       Occ of the index: full (four columns of offsets),\n"
+             << "                     sampled (the BWT 2 bits a character with counts every\n"
+             << "                     cache line, about 1/48 of the memory) or wavelet (a\n"
+             << "                     Huffman-shaped wavelet tree: 2.3 bits a character\n"
+             << "                     against 2.7 for sampled, about 15% less Occ and the\n"
+             << "                     same peak memory, SA dominating, but about 1.8x\n"
+             << "                     slower to search) or runs (the BWT run-length\n"
+             << "                     encoded with SA sampled at its runs instead of\n"
+             << "                     stored, for collections of similar genomes; no\n"
+             << "                     second index) (default: full)\n"
+             << "  --sa-sample K      keep SA at every K-th position of the reference only,\n"
+             << "                     the others located walking LF up to K-1 steps: about\n"
+             << "                     1/K of the memory of SA (default: 1, SA in full)\n"
+             << "  --sa-packed        keep SA in full, bit-packed in ceil(log2 N) bits an\n"
+             << "                     entry instead of 32 or 64\n"
+             << "  --second-layout L  entries of the second index: sorted, or eytzinger for\n"
+             << "                     fewer cache misses on large repeats (default: sorted)\n"
+             << "  --size-min N       least number of suffixes sharing their seed given\n"
+             << "                     second index entries (default: chosen from the\n"
+             << "                     sizes of the groups, see --second-max-mem)\n"
+             << "  --second-max-mem SIZE\n"
+             << "                     cap on the second index for the choice of its least\n"
+             << "                     segment size (default: the size of the suffix array)\n"
+             << "  --second-only      build again the second index of the index files\n"
+             << "                     fa.period built already (with another <size_seed>,\n"
+             << "                     --size-min or --second-layout, or after --max-mem),\n"
+             << "                     streaming their suffix array\n"
+             << "  --max-mem SIZE     build out of core within SIZE bytes (K/M/G suffixes),\n"
+             << "                     spilling to temporary files next to the index;\n"
+             << "                     blockwise and without <size_seed> only\n"
+             << "  --offset BITS      32 or 64-bit offsets in the index (default: 64 only\n"
+             << "                     for references of 4G characters and more)\n"
+             << "  --checkpoint       journal the build in prefix.period.ckpt* files, removed\n"
+             << "                     once the index is written\n"
+             << "  --resume           go on from the checkpoint of a killed build with the\n"
+             << "                     same reference and options (implies --checkpoint)\n"
+             << "  --report FILE      write the wall and CPU time and the memory of every\n"
+             << "                     phase, the bytes per structure and the block sizes as\n"
+             << "                     JSON into FILE"
              << endl;
 }
 
@@ -181,8 +258,7 @@ void PrintHelp_SbwtAligner(int argc, char **argv)
 {
         cout << "usage: sbwt "
              << "[fasta file] [prefix of index files] <size of replica, default: "
-             << sbwt::SecondIndex::size_min
-             << ">"
+             << "the least size of a segment of the second index>"
              << endl;
 
 }
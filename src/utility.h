@@ -11,7 +11,9 @@ char *ReadFasta(char *, uint32_t &);
 bool IsDNA(char);
 bool IsN(char);
 uint32_t GetUint(int, char *);
-void CountSeedOccurrence(sbwt::BuildIndexRawData &, uint32_t);
+uint64_t GetSize(char *);
+template <typename TOffset>
+void CountSeedOccurrence(sbwt::BasicIndexRawData<TOffset> &, uint32_t);
 void PrintHelp_BuildIndex(int, char**);
 void PrintHelp_CountOcc(int, char**);
 void PrintHelp_SbwtAligner(int, char**);
@@ -0,0 +1,137 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "wavelet_occ.h"
+#include "io_build_index.h"
+
+namespace sbwt {
+
+/// Huffman: the two lightest of the bases and the inner nodes merged so
+/// far are merged, three times. The inner node merged k-th (id 4 + k) is
+/// node 2 - k, the root node 0; bit 0 goes to the lighter child.
+template <typename TOffset>
+WaveletOcc<TOffset>::WaveletOcc(const uint64_t count[4]):
+        nodes(3),
+        length(0)
+{
+        std::vector<std::pair<uint64_t, uint32_t> > items;
+        for (uint32_t a = 0; a != 4; ++a) {
+                items.push_back(std::make_pair(count[a], a));
+        }
+        uint32_t children[3][2];
+        for (uint32_t k = 0; k != 3; ++k) {
+                std::sort(items.begin(), items.end());
+                children[k][0] = items[0].second;
+                children[k][1] = items[1].second;
+                uint64_t weight = items[0].first + items[1].first;
+                items.erase(items.begin(), items.begin() + 2);
+                items.push_back(std::make_pair(weight, 4 + k));
+        }
+
+        /// The codes, walking down from the root
+        struct Walk {
+                uint32_t id;
+                Code code;
+        };
+        std::vector<Walk> stack(1);
+        stack[0].id = 4 + 2;
+        stack[0].code.bits = 0;
+        stack[0].code.length = 0;
+        while (!stack.empty()) {
+                Walk walk = stack.back();
+                stack.pop_back();
+                if (walk.id < 4) {
+                        codes[walk.id] = walk.code;
+                        continue;
+                }
+                uint32_t k = walk.id - 4;
+                for (uint32_t bit = 0; bit != 2; ++bit) {
+                        Walk child = walk;
+                        child.id = children[k][bit];
+                        child.code.bits |= bit << walk.code.length;
+                        child.code.node[walk.code.length] = 2 - k;
+                        ++child.code.length;
+                        stack.push_back(child);
+                }
+        }
+}
+
+template <typename TOffset>
+void WaveletOcc<TOffset>::Append(char c)
+{
+        uint32_t a = 0;
+        switch (c) {
+                case 'A': a = 0; break;
+                case 'C': a = 1; break;
+                case 'G': a = 2; break;
+                case 'T': a = 3; break;
+                default: other.push_back(length); break;
+        }
+        const Code &code = codes[a];
+        for (uint32_t d = 0; d != code.length; ++d) {
+                nodes[code.node[d]].PushBack((code.bits >> d) & 1);
+        }
+        ++length;
+}
+
+template <typename TOffset>
+uint64_t WaveletOcc<TOffset>::Bytes() const
+{
+        uint64_t bytes = other.size() * sizeof(TOffset);
+        for (auto &node : nodes) {
+                bytes += node.Bytes();
+        }
+        return bytes;
+}
+
+template <typename TOffset>
+bool WaveletOcc<TOffset>::Save(std::ostream &fout) const
+{
+        WriteArray(fout, codes, 4);
+        WriteArray(fout, &length, 1);
+        for (auto &node : nodes) {
+                node.Save(fout);
+        }
+        uint64_t num_other = other.size();
+        WriteArray(fout, &num_other, 1);
+        WriteArray(fout, other.data(), other.size());
+        return (bool)fout;
+}
+
+template <typename TOffset>
+bool WaveletOcc<TOffset>::Load(std::istream &fin)
+{
+        fin.read((char*)codes, sizeof(codes));
+        fin.read((char*)&length, sizeof(length));
+        nodes.assign(3, RankBits());
+        for (auto &node : nodes) {
+                if (!node.Load(fin)) {
+                        return false;
+                }
+        }
+        for (uint32_t a = 0; a != 4; ++a) {
+                if (codes[a].length > kMaxCode) {
+                        return false;
+                }
+                for (uint32_t d = 0; d != codes[a].length; ++d) {
+                        if (codes[a].node[d] >= nodes.size()) {
+                                return false;
+                        }
+                }
+        }
+        uint64_t num_other = 0;
+        fin.read((char*)&num_other, sizeof(num_other));
+        if (!fin || num_other > length) {
+                return false;
+        }
+        other.resize(num_other);
+        fin.read((char*)other.data(), num_other * sizeof(TOffset));
+        return (bool)fin;
+}
+
+template class WaveletOcc<uint32_t>;
+template class WaveletOcc<uint64_t>;
+
+} /* namespace sbwt */
@@ -0,0 +1,102 @@
+#ifndef SBWT_WAVELET_OCC_H
+#define SBWT_WAVELET_OCC_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "rank_bits.h"
+
+namespace sbwt {
+
+/**
+ * Occ as a Huffman-shaped wavelet tree over the BWT: the bases with the
+ * most occurrences get the shortest codes, every inner node keeps the bits
+ * of the characters routed through it, and Occ(a, i) is a Rank1 or Rank0
+ * per bit of the code of a, at most three lines. The BWT takes the mean
+ * length of the codes (within a bit of H0, 2 for even bases) a character
+ * and 1/7 more for the ranks, against 8/3 bits for SampledOcc: about 15%
+ * less, next to SA, for up to three dependent lines per rank.
+ *
+ * The other characters (the $s) are coded as A and their positions kept
+ * aside, as SampledOcc does.
+ */
+template <typename TOffset>
+class WaveletOcc {
+public:
+        static const uint32_t kMaxCode = 3;
+
+        WaveletOcc(): length(0) { }
+        /// The shape for a BWT of count[a] bases a (the $s counted as A)
+        explicit WaveletOcc(const uint64_t count[4]);
+
+        /// Occ(a, i): the occurrences of base a in BWT[0, i]
+        TOffset Rank(uint32_t a, TOffset i) const
+        {
+                uint64_t pos = (uint64_t)i + 1;
+                const Code &code = codes[a];
+                for (uint32_t d = 0; d != code.length; ++d) {
+                        uint64_t ones = nodes[code.node[d]].Rank1(pos);
+                        pos = (code.bits >> d) & 1 ? ones : pos - ones;
+                }
+                if (a == 0) {
+                        /// The $s up to i were coded as A
+                        pos -= std::upper_bound(other.begin(), other.end(), i) - other.begin();
+                }
+                return pos;
+        }
+
+        /// The base of BWT[i], a $ read as A: its bits down from the root,
+        /// each giving the position in the next node, to the leaf
+        uint32_t Access(TOffset i) const
+        {
+                uint64_t pos = i;
+                uint32_t bits = 0;
+                uint32_t node = 0;
+                for (uint32_t d = 0; d != kMaxCode; ++d) {
+                        const RankBits &bv = nodes[node];
+                        const uint32_t bit = bv.Get(pos);
+                        const uint64_t ones = bv.Rank1(pos);
+                        pos = bit ? ones : pos - ones;
+                        bits |= bit << d;
+                        const uint32_t mask = (2u << d) - 1;
+                        for (uint32_t a = 0; a != 4; ++a) {
+                                if ((codes[a].bits & mask) != bits) {
+                                        continue;
+                                }
+                                if (codes[a].length == d + 1) {
+                                        return a;
+                                }
+                                node = codes[a].node[d + 1];
+                        }
+                }
+                return 0;
+        }
+
+        /// Route one character of the BWT down the tree, in order
+        void Append(char);
+        uint64_t Bytes() const;
+        /// The shape, the bits of the nodes, then the other positions
+        bool Save(std::ostream&) const;
+        bool Load(std::istream&);
+
+private:
+        /// The code of a base: its bits from the root, and the node each
+        /// one is stored in
+        struct Code {
+                uint32_t bits;
+                uint32_t length;
+                uint32_t node[kMaxCode];
+        };
+
+        Code codes[4];
+        std::vector<RankBits> nodes;
+        std::vector<TOffset> other;     /* positions of the other characters */
+        uint64_t length;
+};
+
+} /* namespace sbwt */
+#endif /* SBWT_WAVELET_OCC_H */
@@ -60,7 +60,7 @@ static inline void writeI32(std::ostream& out, int32_t x) {
  * host.
  */
 static inline void writeU64(std::ostream& out, uint64_t x, bool toBigEndian) {
-        uint32_t y = endianizeU64(x, toBigEndian);
+        uint64_t y = endianizeU64(x, toBigEndian);
         out.write((const char*)&y, 8);
 }
 
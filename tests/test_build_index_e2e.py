@@ -1,7 +1,10 @@
 import json
 import os
+import random
+import struct
 import subprocess
 import sys
+import tempfile
 from typing import List
 from mock_reads import generate_reads_ref
 
@@ -12,19 +15,302 @@ def run(cmd: List[str], *, expect_rc: int = 0) -> subprocess.CompletedProcess:
         raise SystemExit(1)
     return proc
 
+def second_index_header(path: str):
+    """size_min, size_seed and the number of segments of a second index file"""
+    with open(path, 'rb') as f:
+        _, _, size_min, size_seed, _, _, num_segment = struct.unpack('<HQIIIIQ', f.read(34))
+    return size_min, size_seed, num_segment
+
+
+def check_in_memory(exe, ref_fa) -> int:
+    run([exe, ref_fa, '3', '50'])
+
+    # The index must not depend on the number of threads
+    outputs = {}
+    for threads in ('1', '3'):
+        run([exe, ref_fa, '3', '50', '--threads', threads])
+        with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+            outputs[threads] = f.read()
+    if outputs['1'] != outputs['3']:
+        print("index built with 3 threads differs from the one built with 1 thread")
+        return 1
+
+    # Both suffix sorting builders must produce the same index
+    run([exe, ref_fa, '3', '50', '--builder', 'sais'])
+    with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+        if f.read() != outputs['1']:
+            print("index built by sais differs from the one built blockwise")
+            return 1
+
+    # --report writes the phases, the structures and the block sizes as JSON
+    run([exe, ref_fa, '3', '50', '--report', 'test_report.json'])
+    with open('test_report.json') as f:
+        report = json.load(f)
+    phases = {p['name'] for p in report['phases']}
+    structures = {s['name']: s['bytes'] for s in report['structures']}
+    blocks = [h for h in report['histograms'] if h['name'] == 'block-size']
+    groups = [h for h in report['histograms'] if h['name'] == 'seed-group-size']
+    if (report['status'] != 0
+            or not {'read-reference', 'bucket-sort', 'sort-blocks', 'transform-count-occurrence',
+                    'second-index-init', 'second-index', 'write-array', 'write-second-index'} <= phases
+            or structures.get('suffix-array', 0) < 10000 * 4
+            or len(blocks) != 1 or sum(b['total'] for b in blocks[0]['bins']) > structures['suffix-array'] // 4
+            or len(groups) != 1 or sum(b['total'] for b in groups[0]['bins']) != structures['suffix-array'] // 4):
+        print(f"unexpected build report: {report}")
+        return 1
+    return 0
+
+
+def check_checkpoint(exe, ref_fa) -> int:
+    run([exe, ref_fa, '3', '50'])
+    with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+        at_once = f.read()
+
+    # A build that fails writing its index keeps its checkpoint, and
+    # --resume goes on from it to the same index, then removes it
+    second = ref_fa + '.3.second.sbwt'
+    os.remove(second)
+    os.mkdir(second)
+    run([exe, ref_fa, '3', '50', '--checkpoint'], expect_rc=1)
+    os.rmdir(second)
+    if not os.path.isfile(ref_fa + '.3.ckpt'):
+        print("checkpoint of a failed build is missing")
+        return 1
+    proc = run([exe, ref_fa, '3', '50', '--resume'])
+    with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+        if f.read() != at_once or 'from the checkpoint' not in proc.stdout + proc.stderr:
+            print("index resumed from a checkpoint differs from the one built at once")
+            return 1
+    if [f for f in os.listdir('.') if f.startswith(ref_fa + '.3.ckpt')]:
+        print("checkpoint files are left after the build")
+        return 1
+    return 0
+
+
+def check_external(exe, ref_fa) -> int:
+    # The out-of-core build writes the same array file in several chunks
+    external = {}
+    for opts in ([], ['--max-mem', '8300K']):
+        run([exe, ref_fa, '3'] + opts)
+        with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+            external[len(opts)] = f.read()
+    if external[0] != external[2]:
+        print("index built with --max-mem differs from the one built in memory")
+        return 1
+    run([exe, ref_fa, '3', '--max-mem', '1M'], expect_rc=1)
+    # A bucket is not split: one larger than a chunk (the suffixes of a long
+    # homopolymer share their k-mer) does not fit into --max-mem
+    homopolymer_fa = "test_homopolymer.fa"
+    with open(homopolymer_fa, 'w') as f:
+        f.write('>h\n' + 'ACGT' * 500 + 'A' * 400000 + 'ACGT' * 500 + '\n')
+    proc = run([exe, homopolymer_fa, '3', '--max-mem', '9M'], expect_rc=1)
+    os.remove(homopolymer_fa)
+    if "a bucket of" not in proc.stderr:
+        print(f"a bucket exceeding --max-mem should be reported, got:\n{proc.stderr}")
+        return 1
+    return 0
+
+
+def check_compact(exe, ref_fa) -> int:
+    run([exe, ref_fa, '3'])
+    with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+        full = f.read()
+
+    # --occ sampled and wavelet write the same suffix array, the Occ columns
+    # replaced by far fewer bytes after it, in memory and out of core alike
+    occ_sections = {}
+    for fmt in ('sampled', 'wavelet'):
+        compact = {}
+        for opts in ([], ['--max-mem', '8300K']):
+            run([exe, ref_fa, '3', '--occ', fmt] + opts)
+            with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+                compact[len(opts)] = f.read()
+        with open(ref_fa + '.3.meta.sbwt', 'rb') as f:
+            _, length = struct.unpack('<II', f.read(8))
+        size_seq = 4 * ((length + 3) // 4) + length
+        size_sa = 4 * length
+        if (compact[0] != compact[2]
+                or compact[0][size_seq:size_seq + size_sa] != full[size_seq + 4 * size_sa:]
+                or len(compact[0]) - size_seq - size_sa > 4 * size_sa // 30):
+            print(f"index built with --occ {fmt} has not the suffix array and the Occ expected")
+            return 1
+        occ_sections[fmt] = compact[0][size_seq + size_sa:]
+
+    # --sa-sample keeps SA at every K-th position of the reference only: the
+    # Occ section takes the place of SA, and the samples, far fewer bytes,
+    # come last, in memory and out of core alike
+    sampled_sa = {}
+    for opts in ([], ['--max-mem', '8300K']):
+        run([exe, ref_fa, '3', '--occ', 'wavelet', '--sa-sample', '8'] + opts)
+        with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+            sampled_sa[len(opts)] = f.read()
+    head = full[:size_seq] + occ_sections['wavelet']
+    if (sampled_sa[0] != sampled_sa[2] or not sampled_sa[0].startswith(head)
+            or len(sampled_sa[0]) - len(head) > size_sa // 4):
+        print(f"index built with --sa-sample 8 has not the samples expected: {len(sampled_sa[0]) - len(head)} bytes")
+        return 1
+    run([exe, ref_fa, '3', '50', '--second-only'], expect_rc=1)
+    run([exe, ref_fa, '3', '--occ', 'runs', '--sa-sample', '8'], expect_rc=1)
+
+    # --sa-packed keeps SA in ceil(log2 N) bits an entry in its place, the
+    # sampled Occ after it, in memory and out of core alike; the second
+    # index is built again from it as from SA in full
+    packed = {}
+    for opts in ([], ['--max-mem', '8300K']):
+        run([exe, ref_fa, '3', '--occ', 'sampled', '--sa-packed'] + opts)
+        with open(ref_fa + '.3.array.sbwt', 'rb') as f:
+            packed[len(opts)] = f.read()
+    num_entry, bits = struct.unpack('<QI', packed[0][size_seq:size_seq + 12])
+    num_word = (num_entry * bits + 63) // 64 + 1
+    words = int.from_bytes(packed[0][size_seq + 12:size_seq + 12 + 8 * num_word], 'little')
+    sa = full[size_seq + 4 * size_sa:]
+    if (packed[0] != packed[2] or num_entry != length or bits != (length - 1).bit_length()
+            or packed[0][size_seq + 12 + 8 * num_word:] != occ_sections['sampled']
+            or any((words >> (i * bits)) & ((1 << bits) - 1) != struct.unpack_from('<I', sa, 4 * i)[0]
+                   for i in range(length))):
+        print("index built with --sa-packed has not the packed suffix array expected")
+        return 1
+    run([exe, ref_fa, '3', '50', '--sa-packed'])
+    with open(ref_fa + '.3.second.sbwt', 'rb') as f:
+        at_once = f.read()
+    run([exe, ref_fa, '3', '50', '--second-only'])
+    with open(ref_fa + '.3.second.sbwt', 'rb') as f:
+        if f.read() != at_once:
+            print("second index built again from the packed suffix array differs from the one built at once")
+            return 1
+    run([exe, ref_fa, '3', '--sa-packed', '--sa-sample', '8'], expect_rc=1)
+    return 0
+
+
+def check_runs(exe) -> int:
+    # --occ runs keeps the BWT run-length encoded with SA sampled at its runs
+    # in the place of SA: a collection of near-identical copies has few runs,
+    # taking less than a quarter of SA
+    collection_fa = "test_collection.fa"
+    random.seed(3)
+    genome = [random.choice('ACGT') for _ in range(2000)]
+    with open(collection_fa, 'w') as f:
+        for k in range(20):
+            copy = genome[:]
+            for _ in range(4):
+                copy[random.randrange(len(copy))] = random.choice('ACGT')
+            f.write(f'>copy{k}\n' + ''.join(copy) + '\n')
+    runs = {}
+    for opts in ([], ['--max-mem', '8500K']):
+        run([exe, collection_fa, '3', '--occ', 'runs'] + opts)
+        with open(collection_fa + '.3.array.sbwt', 'rb') as f:
+            runs[len(opts)] = f.read()
+    with open(collection_fa + '.3.meta.sbwt', 'rb') as f:
+        _, length = struct.unpack('<II', f.read(8))
+    size_seq = 4 * ((length + 3) // 4) + length
+    if runs[0] != runs[2] or len(runs[0]) - size_seq > length:
+        print(f"index built with --occ runs is not the run-length one expected: {len(runs[0]) - size_seq} bytes")
+        return 1
+    run([exe, collection_fa, '3', '50', '--second-only'], expect_rc=1)
+    return 0
+
+
+def check_periods(exe, ref_fa) -> int:
+    # Several periods share the reference: their array files are the ones
+    # built alone without the sequence section
+    run([exe, ref_fa, '3,4', '--threads', '2'])
+    for period in ('3', '4'):
+        with open(ref_fa + '.' + period + '.array.sbwt', 'rb') as f:
+            shared = f.read()
+        run([exe, ref_fa, period])
+        with open(ref_fa + '.' + period + '.array.sbwt', 'rb') as f:
+            alone = f.read()
+        if not shared or not alone.endswith(shared):
+            print(f"period {period} built with another one differs from the one built alone")
+            return 1
+    return 0
+
+
+def check_tandem(exe) -> int:
+    # Long tandem repeats go through the difference cover fallback
+    tandem_fa = "test_tandem.fa"
+    random.seed(7)
+    flank = ''.join(random.choice('ACGT') for _ in range(2000))
+    with open(tandem_fa, 'w') as f:
+        f.write('>tandem\n' + flank + 'ACGTTAGGC' * 2000 + flank[::-1] + 'A' * 3000 + '\n')
+    tandem = {}
+    for builder in ('blockwise', 'sais'):
+        run([exe, tandem_fa, '3', '--builder', builder])
+        with open(tandem_fa + '.3.array.sbwt', 'rb') as f:
+            tandem[builder] = f.read()
+    if tandem['blockwise'] != tandem['sais']:
+        print("tandem repeat index built blockwise differs from the one built by sais")
+        return 1
+
+    # --second-only builds the second index again from the index files,
+    # streaming their suffix array, as a build at once does
+    second = tandem_fa + '.3.second.sbwt'
+    for opts in ([], ['--size-min', '50', '--second-layout', 'eytzinger']):
+        run([exe, tandem_fa, '3', '50'] + opts)
+        with open(second, 'rb') as f:
+            at_once = f.read()
+        os.remove(second)
+        run([exe, tandem_fa, '3', '50', '--second-only', '--threads', '2'] + opts)
+        with open(second, 'rb') as f:
+            if f.read() != at_once:
+                print(f"second index built again with {opts} differs from the one built at once")
+                return 1
+    run([exe, 'test_missing.fa', '3', '50', '--second-only'], expect_rc=1)
+
+    # The least size of a segment is chosen from the groups sharing their
+    # seed, and raised to fit into --second-max-mem
+    run([exe, tandem_fa, '3', '50', '--second-max-mem', '1G'])
+    size_min, _, num_segment = second_index_header(second)
+    run([exe, tandem_fa, '3', '50', '--second-max-mem', '1K'])
+    size_min_capped, _, num_segment_capped = second_index_header(second)
+    if size_min != 64 or num_segment == 0 or size_min_capped <= size_min or num_segment_capped != 0:
+        print(f"unexpected least sizes of the second index segments: {size_min} ({num_segment} segments),"
+              f" {size_min_capped} ({num_segment_capped} segments) under 1K")
+        return 1
+
+    # Headers are skipped, even where they spell bases; records are concatenated
+    with open(tandem_fa, 'w') as f:
+        f.write('>chr1 ACGT\n' + flank[:1000] + '\n>chr2 GATTACA\r\n' + flank[1000:] + '\n')
+    run([exe, tandem_fa, '3'])
+    with open(tandem_fa + '.3.array.sbwt', 'rb') as f:
+        headers = f.read()
+    with open(tandem_fa, 'w') as f:
+        f.write('>\n' + '\n'.join(flank[i:i+60] for i in range(0, len(flank), 60)))
+    run([exe, tandem_fa, '3'])
+    with open(tandem_fa + '.3.array.sbwt', 'rb') as f:
+        if f.read() != headers:
+            print("index of a multi-record FASTA differs from the one of its concatenated sequence")
+            return 1
+    return 0
+
+
 def build_index() -> int:
     if len(sys.argv) < 2:
         print("Usage: test_build_index_e2e.py <path-to-my_app>")
         return 99
-    exe = sys.argv[1]
+    exe = os.path.abspath(sys.argv[1])
     if not os.path.isfile(exe):
         print(f"Executable not found: {exe}")
         return 98
-    
-    ref_fa = "test_ref.fa"
-    reads_fa = "test_reads.fa"
-    generate_reads_ref(ref_fa, reads_fa, ref_size=10000, kmer=150, reads_size=100)
-    run([exe, ref_fa, '3', '50'])
+
+    # The index files, reports and references are written to a temporary
+    # directory, removed with them whatever the outcome
+    cwd = os.getcwd()
+    with tempfile.TemporaryDirectory(prefix='test_build_index_') as work_dir:
+        os.chdir(work_dir)
+        try:
+            ref_fa = "test_ref.fa"
+            reads_fa = "test_reads.fa"
+            generate_reads_ref(ref_fa, reads_fa, ref_size=10000, kmer=150, reads_size=100)
+            for check in (lambda: check_in_memory(exe, ref_fa), lambda: check_checkpoint(exe, ref_fa),
+                          lambda: check_external(exe, ref_fa), lambda: check_compact(exe, ref_fa),
+                          lambda: check_runs(exe), lambda: check_periods(exe, ref_fa),
+                          lambda: check_tandem(exe)):
+                ret = check()
+                if ret != 0:
+                    return ret
+        finally:
+            os.chdir(cwd)
     print("All e2e checks passed")
     return 0
 
@@ -1,14 +1,15 @@
 import os
+import random
 import sys
 from test_build_index_e2e import run
 from mock_reads import generate_reads_ref
 
-def run_e2e(exe_build_index, exe_sbwt, max_mismatches=2) -> str:
+def run_e2e(exe_build_index, exe_sbwt, max_mismatches=2, build_opts=(), periods='3') -> str:
     ref_fa = "test_ref.fa"
     reads_fa = "test_reads.fa"
     generate_reads_ref(ref_fa, reads_fa, ref_size=10000, kmer=150, reads_size=100, max_mismatches=max_mismatches)
     try:
-        run([exe_build_index, ref_fa, '3', '50'])
+        run([exe_build_index, ref_fa, periods, '50', *build_opts])
         process = run([exe_sbwt, reads_fa, ref_fa+'.3'])
         return process.stderr
     except SystemExit as e:
@@ -24,6 +25,57 @@ def run_e2e(exe_build_index, exe_sbwt, max_mismatches=2) -> str:
             os.remove(ref_fa+'.3.meta.sbwt')
         if os.path.isfile(ref_fa+'.3.second.sbwt'):
             os.remove(ref_fa+'.3.second.sbwt')
+        for name in os.listdir('.'):
+            if name.startswith(ref_fa+'.') and name.endswith('.sbwt'):
+                os.remove(name)
+
+
+def run_e2e_homopolymer(exe_build_index, exe_sbwt, build_opts=()) -> str:
+    ref_fa = "test_homopolymer.fa"
+    reads_fa = "test_homopolymer_reads.fa"
+    random.seed(11)
+    flank = ''.join(random.choice('ACGT') for _ in range(4000))
+    with open(ref_fa, 'w') as f:
+        f.write('>h\n' + flank[:2000] + 'A' * 70000 + flank[2000:] + '\n')
+    with open(reads_fa, 'w') as f:
+        f.write('>a\n' + 'A' * 50 + '\n>b\n' + flank[500:550] + '\n>c\n' + 'T' * 50 + '\n')
+    try:
+        run([exe_build_index, ref_fa, '1', '50', *build_opts])
+        return run([exe_sbwt, reads_fa, ref_fa + '.1']).stderr
+    finally:
+        for name in os.listdir('.'):
+            if name.startswith(ref_fa) or name == reads_fa:
+                os.remove(name)
+
+
+def run_e2e_repeat_mismatches(exe_build_index, exe_sbwt, offsets_reads, is_rc=False) -> str:
+    """Reads with exactly period mismatches, at the given offsets, inside a
+    repeat whose range is a second index segment, reverse complemented if
+    is_rc"""
+    ref_fa = "test_repeat.fa"
+    reads_fa = "test_repeat_reads.fa"
+    random.seed(5)
+    flank = ''.join(random.choice('ACGT') for _ in range(4000))
+    unit = ''.join(random.choice('ACGT') for _ in range(300))
+    ref = flank[:2000] + unit * 300 + flank[2000:]
+    with open(ref_fa, 'w') as f:
+        f.write('>r\n' + ref + '\n')
+    with open(reads_fa, 'w') as f:
+        for k, offsets in enumerate(offsets_reads):
+            read = list(ref[2000 + 300 * 100 + 50:2000 + 300 * 100 + 200])
+            for offset in offsets:
+                read[offset] = {'A': 'C', 'C': 'G', 'G': 'T', 'T': 'A'}[read[offset]]
+            read = ''.join(read)
+            if is_rc:
+                read = read[::-1].translate(str.maketrans('ACGT', 'TGCA'))
+            f.write(f'>q{k}\n{read}\n')
+    try:
+        run([exe_build_index, ref_fa, '3', '50', '--size-min', '64'])
+        return run([exe_sbwt, reads_fa, ref_fa + '.3']).stderr
+    finally:
+        for name in os.listdir('.'):
+            if name.startswith(ref_fa) or name == reads_fa:
+                os.remove(name)
 
 
 def sbwt_e2e() -> int:
@@ -49,6 +101,74 @@ def sbwt_e2e() -> int:
         if "Reads with alignment:	100 (100%)" in ret:
             print(f"all reads should not be aligned with max 10 mismatches, got:\n{ret}")
             return 3
+
+        ret = run_e2e(exe_build_index, exe_sbwt, max_mismatches=2, build_opts=('--offset', '64'))
+        if "Reads with alignment:	100 (100%)" not in ret:
+            print(f"all reads should be aligned on a 64-bit offset index, got:\n{ret}")
+            return 4
+
+        ret = run_e2e(exe_build_index, exe_sbwt, max_mismatches=2, build_opts=('--threads', '2'), periods='3,5')
+        if "Reads with alignment:	100 (100%)" not in ret:
+            print(f"all reads should be aligned on an index sharing its reference with another period, got:\n{ret}")
+            return 5
+
+        # The backward search ranks through the sampled Occ, the wavelet tree
+        # and the run-length BWT alike, the last one locating through its
+        # samples, and SA sampled every few positions is located walking LF,
+        # SA bit-packed read in place
+        for opts in (('--occ', 'sampled'), ('--occ', 'sampled', '--offset', '64'),
+                     ('--occ', 'wavelet'), ('--occ', 'wavelet', '--offset', '64'),
+                     ('--occ', 'runs'), ('--occ', 'runs', '--offset', '64'),
+                     ('--sa-sample', '8'), ('--occ', 'wavelet', '--sa-sample', '8', '--offset', '64'),
+                     ('--sa-packed',), ('--occ', 'sampled', '--sa-packed', '--offset', '64')):
+            ret = run_e2e(exe_build_index, exe_sbwt, max_mismatches=2, build_opts=opts)
+            if "Reads with alignment:	100 (100%)" not in ret:
+                print(f"all reads should be aligned on an index built with {' '.join(opts)}, got:\n{ret}")
+                return 8
+
+        # Seeds of 65536 suffixes and more go through the 32-bit second index,
+        # on the forward strand and on the reverse complement one
+        ret = run_e2e_homopolymer(exe_build_index, exe_sbwt)
+        if "Reads with alignment:\t3 (100%)" not in ret or "Second index powering searching: 2" not in ret:
+            print(f"the homopolymer reads should be aligned through the second index, got:\n{ret}")
+            return 6
+
+        # The Eytzinger layout of the second index finds the same reads
+        ret = run_e2e_homopolymer(exe_build_index, exe_sbwt, build_opts=('--second-layout', 'eytzinger'))
+        if "Reads with alignment:\t3 (100%)" not in ret or "Second index powering searching: 2" not in ret:
+            print(f"the homopolymer reads should be aligned through the Eytzinger second index, got:\n{ret}")
+            return 7
+        for fmt in ('sampled', 'wavelet'):
+            ret = run_e2e_homopolymer(exe_build_index, exe_sbwt, build_opts=('--occ', fmt))
+            if "Reads with alignment:\t3 (100%)" not in ret or "Second index powering searching: 2" not in ret:
+                print(f"the homopolymer reads should be aligned on the {fmt} Occ, got:\n{ret}")
+                return 9
+        ret = run_e2e_homopolymer(exe_build_index, exe_sbwt, build_opts=('--occ', 'runs'))
+        if "Reads with alignment:\t3 (100%)" not in ret or "Second index powering searching: 0" not in ret:
+            print(f"the homopolymer reads should be aligned on the run-length index without a second index, got:\n{ret}")
+            return 10
+        for sa_opts in (('--sa-sample', '16'), ('--sa-packed',)):
+            ret = run_e2e_homopolymer(exe_build_index, exe_sbwt,
+                                      build_opts=('--occ', 'sampled', '--second-layout', 'eytzinger') + sa_opts)
+            if "Reads with alignment:\t3 (100%)" not in ret or "Second index powering searching: 2" not in ret:
+                print(f"the homopolymer reads should be aligned through the second index on {sa_opts[0]}, got:\n{ret}")
+                return 11
+
+        # Up to period mismatches are accepted through the second index and
+        # by the scan of the range, which finds a read with a mismatch in
+        # every seed: mismatches in one seed, then one in each
+        repeat_reads = ((10, 22, 34), (10, 61, 112))
+        ret = run_e2e_repeat_mismatches(exe_build_index, exe_sbwt, repeat_reads)
+        if ("Reads with alignment:\t2 (100%)" not in ret
+                or "Second index powering searching: 0" in ret):
+            print(f"the repeat reads with 3 mismatches should be aligned through the second index, got:\n{ret}")
+            return 12
+        ret = run_e2e_repeat_mismatches(exe_build_index, exe_sbwt, repeat_reads, is_rc=True)
+        if ("Reads with alignment:\t2 (100%)" not in ret
+                or "Second index powering searching: 0" in ret):
+            print(f"the reverse-complemented repeat reads with 3 mismatches should be aligned"
+                  f" through the second index, got:\n{ret}")
+            return 13
         print("All e2e checks passed")
 
     except Exception as e: